@@ -0,0 +1,379 @@
+#
+# Runs the buffer manager and N node controllers as local processes, for every
+# combination of algorithm, node count and workload, several times each, and
+# writes the median, mean and 95% confidence interval of each metric to one file.
+# Build the binaries and libraries with make local first.
+#
+# Workloads set how long each producer thinks between critical sections:
+#   idle       up to 1 s (the producer's default)
+#   busy       up to 20 ms
+#   saturated  none
+#
+# Placements pin the threads of each node (see src/affinity.h):
+#   none       the scheduler decides
+#   colocated  every thread of node i, and its producer, on one CPU
+#   isolated   node i gets three CPUs: the dme handler, the I/O threads and the producer
+# CPUs are handed out in order and wrap around, and bm takes the next one.
+#
+# Shard counts split bm into that many buffers (DME_BM_SHARDS), and locks
+# decide what guards them:
+#   one        one mutex for every shard, donuts go to the shard of their key
+#   shard      a mutex per shard: each node runs a node controller, with its
+#              own producer, in the mesh of every shard
+#
+# Every run gets its own ports and message queue keys, and its logs are kept
+# under the log directory with runs.csv, one line per run.
+#
+# With -m every algorithm runs over one mesh per configuration: the first is
+# started as usual, and each of the others is swapped in through the node
+# controllers' control sockets (DME_CONTROL) once the last one's producers are
+# done, so the connections are set up once. Needs version 2 libraries.
+#
+
+usage() {
+echo "USAGE: $ bash bench.sh [-a algorithms] [-n node_counts] [-w workloads] [-p placements]"
+echo "                       [-s shard_counts] [-k one|shard] [-r repetitions] [-d donuts] [-t timeout_s]"
+echo "                       [-l log_dir] [-o results.csv|results.json] [-m]"
+exit 1
+}
+
+algs="central lamport ricart ricart_rc maekawa maekawa_rt grid tree fuchi"
+nodes="3 5"
+workloads="idle busy saturated"
+placements="none"
+shardings="1"
+locks="one"
+reps=3
+donuts=20
+timeout=600
+logs=bench_logs
+out=results.csv
+warm=0
+while getopts "a:n:w:p:s:k:r:d:t:l:o:m" opt
+do
+    case $opt in
+    a) algs=$OPTARG ;;
+    n) nodes=$OPTARG ;;
+    w) workloads=$OPTARG ;;
+    p) placements=$OPTARG ;;
+    s) shardings=$OPTARG ;;
+    k) locks=$OPTARG ;;
+    r) reps=$OPTARG ;;
+    d) donuts=$OPTARG ;;
+    t) timeout=$OPTARG ;;
+    l) logs=$OPTARG ;;
+    o) out=$OPTARG ;;
+    m) warm=1 ;;
+    *) usage ;;
+    esac
+done
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+for f in bin/nc bin/prod bin/bm
+do
+    if [ ! -x "$root/$f" ]
+    then
+    echo "$f is missing, run make local first"
+    exit 1
+    fi
+done
+
+# Ports and queue keys are spaced out per run, far from the defaults.
+base_port=20000
+base_key=0x44000000
+
+think_us() {
+    case $1 in
+    idle) echo 1000000 ;;
+    busy) echo 20000 ;;
+    saturated) echo 0 ;;
+    *) echo "Unknown workload $1" >&2; exit 1 ;;
+    esac
+}
+
+ncpu=$(nproc)
+
+# Prints DME_CPUS for node $3 of $2 under placement $1 (node 0 is bm).
+cpus() {
+    case $1 in
+    none) echo "" ;;
+    colocated)
+        c=$(($3 > 0 ? $3 - 1 : $2))
+        echo "handler=$((c % ncpu));io=$((c % ncpu));producer=$((c % ncpu));bm=$((c % ncpu))" ;;
+    isolated)
+        c=$(($3 > 0 ? 3 * ($3 - 1) : 3 * $2))
+        echo "handler=$((c % ncpu));io=$(((c + 1) % ncpu));producer=$(((c + 2) % ncpu));bm=$((c % ncpu))" ;;
+    *) echo "Unknown placement $1" >&2; exit 1 ;;
+    esac
+}
+
+if [ $warm = 1 ] && ! command -v curl > /dev/null
+then
+echo "-m needs curl"
+exit 1
+fi
+
+# Starts bm and the node controllers of one configuration in directory $8,
+# running algorithm $1 (see run_one for the arguments).
+start_mesh() {
+    alg=$1; n=$2; think=$3; place=$4; k=$5; lock=$6; run=$7; dir=$8
+    # bm takes the first k ports, the mesh of shard s the n after port + k + s * n.
+    port=$((base_port + (run % 200) * 200))
+    meshes=$([ $lock = shard ] && echo $k || echo 1)
+
+    DME_CPUS=$(cpus $place $n 0) DME_BM_PORT=$port DME_BM_SHARDS=$k "$root/bin/bm" > "$dir/bm.log" 2>&1 &
+    bm=$!
+    pids=""
+    socks=""
+    for s in $(seq 0 $((meshes - 1)))
+    do
+        hosts=""
+        for i in $(seq 1 $n)
+        do
+            hosts="$hosts${hosts:+,}127.0.0.1:$((port + k + s * n + i))"
+        done
+        for i in $(seq 1 $n)
+        do
+            key=$((base_key + run * 256 + s * n + i))
+            ipcrm -Q $key 2> /dev/null
+            log=$([ $meshes = 1 ] && echo "n$i.log" || echo "n$i-s$s.log")
+            shard=$([ $meshes = 1 ] && echo "" || echo $s)
+            sock=$([ $warm = 1 ] && echo "$dir/c$i-s$s.sock" || echo "")
+            socks="$socks $sock"
+            DME_HOSTS=$hosts DME_QUEUE_KEY=$key DME_PROD="$root/bin/prod" DME_DONUTS=$donuts \
+            DME_THINK_US=$think DME_BM_HOST=127.0.0.1 DME_BM_PORT=$port DME_CPUS=$(cpus $place $n $i) \
+            DME_BM_SHARDS=$k DME_SHARD=$shard DME_CONTROL=$sock \
+                "$root/bin/nc" $i $n "$root/lib/$alg.so" > "$dir/$log" 2>&1 &
+            pids="$pids $!"
+        done
+    done
+}
+
+# Waits until $1 producers have reported in $dir, or gives up. Sets ok.
+wait_producers() {
+    ok=1
+    start=$(date +%s)
+    while [ "$(cat "$dir"/n*.log | grep -c '^PROD: [0-9]* donuts')" -lt $1 ]
+    do
+        if [ $(($(date +%s) - start)) -ge $timeout ]
+        then
+        ok=0
+        break
+        fi
+        sleep 0.2
+    done
+}
+
+stop_mesh() {
+    # nc reports what it sent on SIGTERM.
+    kill -TERM $pids 2> /dev/null
+    sleep 0.5
+    kill -9 $pids $bm 2> /dev/null
+    wait 2> /dev/null
+    for i in $(seq 1 $((n * meshes)))
+    do
+        ipcrm -Q $((base_key + run * 256 + i)) 2> /dev/null
+    done
+}
+
+# Prints ok,throughput,ms_per_cs,messages_per_cs of the $2nd algorithm run
+# in $dir, from the $2nd report of each producer and node controller.
+results() {
+    awk -v ok=$1 -v j=$2 '
+        FNR == 1                                   { p = m = 0 }
+        /^PROD: [0-9]+ donuts in/ && ++p == j      { d += $2; if ($5 > secs) secs = $5; cs += $10; nodes++ }
+        /^NC: [0-9]+ messages/ && ++m == j         { msgs += $2 }
+        END {
+            if (!ok || nodes == 0 || secs == 0 || d == 0) { print "0,,,"; exit }
+            printf "1,%.4f,%.4f,%.4f\n", d / secs, cs / nodes, msgs / d
+        }' "$dir"/n*.log
+}
+
+# Runs one configuration in directory $8, then prints
+# ok,throughput,ms_per_cs,messages_per_cs (ok is 0 if it did not finish).
+run_one() {
+    start_mesh "$@"
+    wait_producers $((n * meshes))
+    stop_mesh
+    results $ok 1
+}
+
+# Runs every algorithm of $1 over one mesh in directory $8 (the others as for
+# run_one), then prints a line of results for each.
+run_warm() {
+    list=$1
+    shift
+    start_mesh $(echo $list | cut -d' ' -f1) "$@"
+    j=0
+    ok=1
+    oks=""
+    for a in $list
+    do
+        j=$((j + 1))
+        if [ $j -gt 1 ] && [ $ok = 1 ]
+        then
+        # Every node is asked at once, and swaps when all of them are done.
+        cps=""
+        for sock in $socks
+        do
+            curl -s -f --max-time 30 --unix-socket "$sock" -X POST \
+                "http://nc/swap?library=$root/lib/$a.so&donuts=$donuts" > /dev/null &
+            cps="$cps $!"
+        done
+        for cp in $cps
+        do
+            wait $cp || ok=0
+        done
+        fi
+        [ $ok = 1 ] && wait_producers $((n * meshes * j))
+        oks="$oks $ok"
+    done
+    stop_mesh
+    j=0
+    for a in $list
+    do
+        j=$((j + 1))
+        echo "$a $(results $(echo $oks | cut -d' ' -f$j) $j)"
+    done
+}
+
+mkdir -p "$logs"
+echo "algorithm,nodes,workload,placement,shards,locks,repetition,ok,throughput,ms_per_cs,messages_per_cs" > "$logs/runs.csv"
+run=0
+for alg in $algs
+do
+    if [ ! -f "$root/lib/$alg.so" ]
+    then
+    echo "lib/$alg.so is missing, run make local first"
+    exit 1
+    fi
+done
+# A warm sweep runs all the algorithms in each configuration at once.
+sweeps=$([ $warm = 1 ] && echo warm || echo $algs)
+for alg in $sweeps
+do
+    for n in $nodes
+    do
+        for w in $workloads
+        do
+            think=$(think_us $w) || exit 1
+            for pl in $placements
+            do
+                cpus $pl 1 1 > /dev/null || exit 1
+                for k in $shardings
+                do
+                    for lk in $locks
+                    do
+                        case $lk in
+                        one|shard) ;;
+                        *) echo "Unknown locks $lk"; exit 1 ;;
+                        esac
+                        # One lock over one shard is the same run either way.
+                        [ $k = 1 ] && [ $lk = shard ] && continue
+                        if [ $(((n + 1) * k)) -ge 200 ]
+                        then
+                        echo "$n nodes with $k shards need too many ports"
+                        exit 1
+                        fi
+                        for r in $(seq 1 $reps)
+                        do
+                            dir="$logs/$alg-$n-$w-$pl-$k-$lk-$r"
+                            rm -rf "$dir"
+                            mkdir -p "$dir"
+                            if [ $warm = 1 ]
+                            then
+                            echo "Running $algs over one mesh with $n nodes, $w workload, $pl placement, $k shards under $lk lock(s), repetition $r of $reps"
+                            run_warm "$algs" $n $think $pl $k $lk $run "$dir" | while read a res
+                            do
+                                echo "$a,$n,$w,$pl,$k,$lk,$r,$res" >> "$logs/runs.csv"
+                            done
+                            else
+                            echo "Running $alg with $n nodes, $w workload, $pl placement, $k shards under $lk lock(s), repetition $r of $reps"
+                            res=$(run_one $alg $n $think $pl $k $lk $run "$dir")
+                            echo "$alg,$n,$w,$pl,$k,$lk,$r,$res" >> "$logs/runs.csv"
+                            fi
+                            run=$((run + 1))
+                        done
+                    done
+                done
+            done
+        done
+    done
+done
+
+# Summarizes the runs of each configuration. The confidence interval is that of
+# the mean, from Student's t, so it needs at least two runs that finished.
+case $out in
+*.json) format=json ;;
+*) format=csv ;;
+esac
+awk -F, -v format=$format '
+    function sort(a, n,    i, j, t) {
+        for (i = 2; i <= n; i++)
+            for (j = i; j > 1 && a[j-1] > a[j]; j--) { t = a[j]; a[j] = a[j-1]; a[j-1] = t }
+    }
+    function stats(key, col,    a, n, i, mean, var, t) {
+        n = split(vals[key, col], a, " ")
+        if (n == 0)
+            return format == "json" ? "null,null,null" : ",,"
+        for (i = 1; i <= n; i++)
+            a[i] += 0
+        sort(a, n)
+        med = n % 2 ? a[(n+1)/2] : (a[n/2] + a[n/2+1]) / 2
+        for (i = 1; i <= n; i++)
+            mean += a[i]
+        mean /= n
+        for (i = 1; i <= n; i++)
+            var += (a[i] - mean) ^ 2
+        t = n - 1 <= 30 ? tdist[n - 1] : 1.96
+        ci = n > 1 ? sprintf("%.4f", t * sqrt(var / (n - 1)) / sqrt(n)) : (format == "json" ? "null" : "")
+        return sprintf("%.4f,%.4f,%s", med, mean, ci)
+    }
+    BEGIN {
+        split("12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 2.228 2.201 2.179 2.160 2.145 2.131 " \
+              "2.120 2.110 2.101 2.093 2.086 2.080 2.074 2.069 2.064 2.060 2.056 2.052 2.048 2.045 2.042", tdist, " ")
+        names[9] = "throughput"; names[10] = "ms_per_cs"; names[11] = "messages_per_cs"
+    }
+    NR > 1 {
+        key = $1 "," $2 "," $3 "," $4 "," $5 "," $6
+        if (!(key in runs))
+            order[++nkeys] = key
+        runs[key]++
+        if ($8 == 1)
+            for (c = 9; c <= 11; c++)
+                vals[key, c] = vals[key, c] " " $c
+        else
+            failed[key]++
+    }
+    END {
+        if (format == "csv") {
+            printf "algorithm,nodes,workload,placement,shards,locks,runs,failed"
+            for (c = 9; c <= 11; c++)
+                printf ",%s_median,%s_mean,%s_ci95", names[c], names[c], names[c]
+            printf "\n"
+        }
+        else
+            printf "[\n"
+        for (k = 1; k <= nkeys; k++) {
+            key = order[k]
+            split(key, f, ",")
+            if (format == "csv") {
+                printf "%s,%d,%d", key, runs[key], failed[key]
+                for (c = 9; c <= 11; c++)
+                    printf ",%s", stats(key, c)
+                printf "\n"
+            }
+            else {
+                printf "  {\"algorithm\": \"%s\", \"nodes\": %d, \"workload\": \"%s\", \"placement\": \"%s\", \"shards\": %d, \"locks\": \"%s\", \"runs\": %d, \"failed\": %d", \
+                       f[1], f[2], f[3], f[4], f[5], f[6], runs[key], failed[key]
+                for (c = 9; c <= 11; c++) {
+                    split(stats(key, c), s, ",")
+                    printf ", \"%s\": {\"median\": %s, \"mean\": %s, \"ci95\": %s}", names[c], s[1], s[2], s[3]
+                }
+                printf "}%s\n", k < nkeys ? "," : ""
+            }
+        }
+        if (format == "json")
+            printf "]\n"
+    }' "$logs/runs.csv" > "$out"
+echo "Results written to $out"
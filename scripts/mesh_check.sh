@@ -0,0 +1,303 @@
+#
+# Checks what bin/sim cannot, on a mesh of node controllers run as local
+# processes. Build the binaries and libraries with make local first.
+#
+#   swap   node 1 is asked to swap while the other nodes are still taking the
+#          lock under the old library, which has to go on answering them until
+#          they are done and swap too. Every node must finish both runs.
+#   stall  the node controller of the last node is stopped while simple.so,
+#          which tells every node of each entry without waiting for answers,
+#          keeps the others sending to it. With small socket buffers the flows
+#          to it back up: none may go past DME_FLOW_CAP, the others must stop
+#          taking input without suspecting each other down, and all must
+#          finish once it runs again.
+#   withdraw  every producer tries for the lock in the ways an acquire can be
+#          withdrawn (DME_TRY_MS), while the others hold it often. Each must
+#          have as many acquires withdrawn as its node controller withdrew,
+#          no two critical sections may overlap, and all must finish.
+#
+# Logs are kept under the log directory. Exits 1 if a check fails.
+#
+
+usage() {
+echo "USAGE: $ bash mesh_check.sh [-a algorithm] [-n nodes] [-t timeout_s] [-l log_dir] [checks]"
+exit 1
+}
+
+alg=ricart
+n=3
+timeout=60
+logs=mesh_logs
+while getopts "a:n:t:l:" opt
+do
+    case $opt in
+    a) alg=$OPTARG ;;
+    n) n=$OPTARG ;;
+    t) timeout=$OPTARG ;;
+    l) logs=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+checks=${*:-swap stall withdraw}
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+for f in bin/nc bin/prod bin/bm lib/$alg.so lib/simple.so
+do
+    if [ ! -e "$root/$f" ]
+    then
+    echo "$f is missing, run make local first"
+    exit 1
+    fi
+done
+
+port=24000
+key=0x45000000
+
+# Starts bm and n node controllers running lib/$lib.so, node i making
+# ${donuts[i]} donuts with DME_THINK_US=$think, and anything in $extra set for
+# each, bm included. The pid of node i is ${npid[i]}.
+start_mesh() {
+    dir=$1
+    rm -rf "$dir"
+    mkdir -p "$dir"
+    env $extra DME_BM_PORT=$port "$root/bin/bm" > "$dir/bm.log" 2>&1 &
+    bm=$!
+    hosts=""
+    for i in $(seq 1 $n)
+    do
+        hosts="$hosts${hosts:+,}127.0.0.1:$((port + i))"
+    done
+    pids=""
+    for i in $(seq 1 $n)
+    do
+        ipcrm -Q $((key + i)) 2> /dev/null
+        env $extra DME_HOSTS=$hosts DME_QUEUE_KEY=$((key + i)) DME_PROD="$root/bin/prod" \
+            DME_DONUTS=${donuts[i]} DME_THINK_US=$think DME_BM_HOST=127.0.0.1 DME_BM_PORT=$port \
+            DME_CONTROL="$dir/c$i.sock" "$root/bin/nc" $i $n "$root/lib/$lib.so" > "$dir/n$i.log" 2>&1 &
+        npid[i]=$!
+        pids="$pids $!"
+    done
+}
+
+stop_mesh() {
+    kill -TERM $pids 2> /dev/null
+    sleep 0.5
+    kill -9 $pids $bm 2> /dev/null
+    wait 2> /dev/null
+    for i in $(seq 1 $n)
+    do
+        ipcrm -Q $((key + i)) 2> /dev/null
+    done
+}
+
+# Producers of the given nodes that have finished, counting every run.
+finished() {
+    for i in "$@"
+    do
+        cat "$dir/n$i.log"
+    done | grep -c '^PROD: [0-9]* donuts'
+}
+
+# Waits until $1 producers of the nodes after it have finished. Returns 1 on timeout.
+wait_finished() {
+    want=$1
+    shift
+    start=$(date +%s)
+    while [ "$(finished "$@")" -lt $want ]
+    do
+        if [ $(($(date +%s) - start)) -ge $timeout ]
+        then
+        return 1
+        fi
+        sleep 0.2
+    done
+    return 0
+}
+
+# Asks node $1 to swap to lib/$2.so, writing the HTTP status to $dir/swap$1.
+swap() {
+    curl -s -o "$dir/swap$1.txt" -w '%{http_code}' --max-time $((timeout + 30)) --unix-socket "$dir/c$1.sock" \
+        -X POST "http://nc/swap?library=$root/lib/$2.so&donuts=5" > "$dir/swap$1" 2> /dev/null
+}
+
+check_swap() {
+    # Node 1 is done at once, the others keep asking for the lock for a while.
+    donuts[1]=1
+    for i in $(seq 2 $n)
+    do
+        donuts[i]=40
+    done
+    think=20000
+    lib=$alg
+    extra=""
+    start_mesh "$logs/swap"
+    others=$(seq 2 $n)
+    if ! wait_finished 1 1
+    then
+    echo "swap: node 1 did not finish its first run"
+    return 1
+    fi
+    if [ "$(finished $others)" -gt 0 ]
+    then
+    echo "swap: the other nodes finished before node 1 was asked, nothing was checked"
+    return 1
+    fi
+    swap 1 $alg &
+    cps=$!
+    if ! wait_finished $((n - 1)) $others
+    then
+    echo "swap: the other nodes stalled after node 1 was asked to swap"
+    return 1
+    fi
+    for i in $others
+    do
+        swap $i $alg &
+        cps="$cps $!"
+    done
+    wait $cps
+    for i in $(seq 1 $n)
+    do
+        if [ "$(cat "$dir/swap$i")" != 200 ]
+        then
+        echo "swap: node $i answered $(cat "$dir/swap$i") $(cat "$dir/swap$i.txt")"
+        return 1
+        fi
+    done
+    if ! wait_finished $((2 * n)) $(seq 1 $n)
+    then
+    echo "swap: the second run did not finish"
+    return 1
+    fi
+    return 0
+}
+
+# Prints the value of metric $2 of node $1, 0 if it has none.
+metric() {
+    curl -s --max-time 5 --unix-socket "$dir/c$1.sock" http://nc/metrics |
+        awk -v m="$2" '$1 == m { v = $2 } END { print v + 0 }'
+}
+
+check_stall() {
+    for i in $(seq 1 $n)
+    do
+        donuts[i]=20000
+    done
+    think=0
+    lib=simple
+    cap=64
+    extra="DME_FLOW_CAP=$cap DME_SOCK_BUF=4096 DME_BM_RING=4096"
+    start_mesh "$logs/stall"
+    others=$(seq 1 $((n - 1)))
+    start=$(date +%s)
+    until grep -q "Fully connected" "$dir/n$n.log"
+    do
+        if [ $(($(date +%s) - start)) -ge $timeout ]
+        then
+        echo "stall: node $n never connected"
+        return 1
+        fi
+        sleep 0.1
+    done
+    kill -STOP ${npid[n]}
+    while [ "$(metric 1 "nc_flow_frames{peer=\"$n\"}")" -lt $cap ]
+    do
+        if [ $(($(date +%s) - start)) -ge $timeout ]
+        then
+        kill -CONT ${npid[n]}
+        echo "stall: the flow from node 1 to node $n never filled"
+        return 1
+        fi
+        sleep 0.2
+    done
+    # Held there for a few failure detector timeouts.
+    sleep 3
+    for i in $others
+    do
+        for j in $(seq 1 $n)
+        do
+            max=$(metric $i "nc_flow_frames_max{peer=\"$j\"}")
+            if [ $max -gt $cap ]
+            then
+            kill -CONT ${npid[n]}
+            echo "stall: the flow from node $i to node $j held $max frames, more than $cap"
+            return 1
+            fi
+        done
+        if [ "$(metric $i 'nc_input_waits_total{room="flows"}')" -eq 0 ]
+        then
+        kill -CONT ${npid[n]}
+        echo "stall: node $i never waited for room in its flows"
+        return 1
+        fi
+        if grep -v "node $n is" "$dir/n$i.log" | grep -q "suspected down"
+        then
+        kill -CONT ${npid[n]}
+        echo "stall: node $i suspected a node that runs: $(grep -v "node $n is" "$dir/n$i.log" | grep -m 1 "suspected down")"
+        return 1
+        fi
+    done
+    kill -CONT ${npid[n]}
+    if ! wait_finished $n $(seq 1 $n)
+    then
+    echo "stall: the nodes did not finish once node $n ran again"
+    return 1
+    fi
+    return 0
+}
+
+check_withdraw() {
+    for i in $(seq 1 $n)
+    do
+        donuts[i]=30
+    done
+    think=20000
+    lib=$alg
+    extra="DME_TRY_MS=60"
+    start_mesh "$logs/withdraw"
+    if ! wait_finished $n $(seq 1 $n)
+    then
+    echo "withdraw: the nodes did not finish"
+    return 1
+    fi
+    total=0
+    for i in $(seq 1 $n)
+    do
+        w=$(sed -n 's/^PROD: \([0-9]*\) acquires withdrawn/\1/p' "$dir/n$i.log")
+        nw=$(grep -c '^NC: acquire .* withdrawn' "$dir/n$i.log")
+        if [ "$w" != "$nw" ]
+        then
+        echo "withdraw: the producer of node $i had ${w:-no} acquires withdrawn, its node controller withdrew $nw"
+        return 1
+        fi
+        total=$((total + w))
+    done
+    if [ $total -eq 0 ]
+    then
+    echo "withdraw: no acquire was withdrawn, nothing was checked"
+    return 1
+    fi
+    # Every critical section, in the order they began, must end before the next one begins.
+    overlap=$(cat "$dir"/n*.log | sed -n 's/^PROD: held the lock from \([0-9.]*\) to \([0-9.]*\) ms/\1 \2/p' | sort -n |
+        awk '$1 < end { print "from " $1 " ms, while one held it until " end " ms"; exit } $2 > end { end = $2 }')
+    if [ -n "$overlap" ]
+    then
+    echo "withdraw: two nodes held the lock at once $overlap"
+    return 1
+    fi
+    return 0
+}
+
+failed=0
+for c in $checks
+do
+    echo "Checking $c on $n nodes"
+    if check_$c
+    then
+    echo "$c passed"
+    else
+    failed=1
+    fi
+    stop_mesh
+done
+exit $failed
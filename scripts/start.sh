@@ -21,7 +21,12 @@ do
     echo "Creating container with hostname: " $host
     #docker run --detach --net dist_net -h $host --name $host dme_nc "/bin/nc" $nid $tot "/lib/simple.so"
     #docker run --detach --net dist_net -h $host --name $host dme_nc "/bin/nc" $nid $tot "/lib/ricart.so"
+    #docker run --detach --net dist_net -h $host --name $host dme_nc "/bin/nc" $nid $tot "/lib/ricart_rc.so"
     #docker run --detach --net dist_net -h $host --name $host dme_nc "/bin/nc" $nid $tot "/lib/maekawa.so"
+    #docker run --detach --net dist_net -h $host --name $host dme_nc "/bin/nc" $nid $tot "/lib/grid.so"
+    #docker run --detach --net dist_net -h $host --name $host dme_nc "/bin/nc" $nid $tot "/lib/tree.so"
+    #docker run --detach --net dist_net -h $host --name $host dme_nc "/bin/nc" $nid $tot "/lib/lamport.so"
+    #docker run --detach --net dist_net -h $host --name $host -e DME_COORDINATOR=1 dme_nc "/bin/nc" $nid $tot "/lib/central.so"
     docker run --detach --net dist_net -h $host --name $host dme_nc "/bin/nc" $nid $tot "/lib/fuchi.so"
     # Sleeping in order to make sure container is listening before new container makes a call.
     sleep 1 
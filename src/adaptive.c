@@ -0,0 +1,611 @@
+/******************************************************************************/
+/*                                                                            */
+/* adaptive.c - Runs one of several v2 libraries at a time and switches to    */
+/*              another as the load changes. DME_ADAPT_ALGS names them in     */
+/*              order of use (default "ricart fuchi maekawa"): the first      */
+/*              while the lock is calm, the second while it is hot, and the   */
+/*              third, if there is one, while it is calm on DME_ADAPT_LARGE_N */
+/*              nodes or more (default 16). They are loaded from the          */
+/*              directory of this library, or from DME_ADAPT_DIR.             */
+/*                                                                            */
+/*              Every node measures how long its acquires wait and sends the  */
+/*              leader, the lowest numbered node that is up, a LOAD report    */
+/*              every DME_ADAPT_WINDOW_MS (default 1000). By Little's law the  */
+/*              wait per unit of time is the mean number of requests waiting, */
+/*              and their sum over the nodes is the queue depth. Above        */
+/*              DME_ADAPT_HIGH (default 1.5) the lock is hot, below           */
+/*              DME_ADAPT_LOW (default 0.5) it is calm, and in between the    */
+/*              current algorithm stays. A switch needs two windows in a row  */
+/*              that agree, and DME_ADAPT_HOLD_MS (default 10000) since the   */
+/*              last one.                                                     */
+/*                                                                            */
+/*              Each switch starts a new epoch, and every message carries the */
+/*              epoch of the instance that sent it. The leader sends PREPARE  */
+/*              with the next epoch and algorithm; every node sets up the new */
+/*              instance, holds back new acquires, and answers READY once it  */
+/*              neither waits for nor holds the lock of the current one. Once */
+/*              every node that is up is READY no node can be in the critical */
+/*              section, and the leader sends COMMIT, after which acquires go */
+/*              to the new instance. Messages for the previous epoch, still   */
+/*              on their way, are delivered to it; older ones are dropped. If */
+/*              the leader goes down the next one asks again.                 */
+/*                                                                            */
+/*              DME_ADAPT_FORCE=1 switches to the next algorithm at every     */
+/*              window, which bin/sim uses to check that switches are safe.   */
+/*                                                                            */
+/*              Built against the v2 interface (see dme_v2.h).                */
+/*                                                                            */
+/******************************************************************************/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <libgen.h>
+#include <time.h>
+
+#include <string.h>
+
+#include "dme_v2.h"
+#include "codec.h"
+
+// A number which is not a node number.
+#define NULLnode -1
+
+#define MAX_ALGS 8
+
+// Types of messages. A_ALG carries a message of an instance, the others are
+// the switch protocol's.
+typedef enum { A_ALG,
+               A_LOAD,
+               A_PREPARE,
+               A_READY,
+               A_COMMIT    } a_type;
+
+// What the local process is doing. A withdrawn acquire whose library cannot
+// withdraw it is ABANDONED until its grant arrives and is given back.
+typedef enum { L_IDLE, L_QUEUED, L_WAITING, L_HELD, L_ABANDONED } l_state;
+
+struct ada_ctx;
+
+const struct dme_ops dme_ops;
+
+// One instance of an underlying library, for one epoch.
+struct inst {
+    struct ada_ctx *a;
+    int epoch;
+    int alg;
+    void *ctx;
+    struct dme_env env;
+};
+
+// State of one instance of this library.
+struct ada_ctx {
+    const struct dme_env *env;
+    int nid;
+    int ntot;
+    int *down;
+
+    // The libraries that can be switched to.
+    int nalgs;
+    char names[MAX_ALGS][32];
+    const struct dme_ops *ops[MAX_ALGS];
+
+    // Instances of the previous, current and next epoch.
+    struct inst *prev, *cur, *next;
+    int epoch;
+    int prepared;        // Epoch of the PREPARE last seen, epoch when none is pending.
+    int target;          // Algorithm of that epoch.
+    int ready_sent;
+
+    l_state local;
+    double asked;        // When the local acquire was made.
+
+    // Load measured here since the last report.
+    double window_start;
+    unsigned int acquires;
+    double wait_ms;
+
+    // Leader only: the reports of the current window and the switch policy.
+    int *ready;
+    double depth, rate;
+    double eval_start, last_switch;
+    int want, streak;
+
+    // Configuration.
+    double window_ms, hold_ms, low, high;
+    int large_n, force;
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double env_double(const char *name, double def) {
+    char *env = getenv(name);
+
+    return env != NULL ? atof(env) : def;
+}
+
+static int leader(struct ada_ctx *a) {
+    int i;
+
+    for (i = 1; i <= a->ntot; i++)
+        if (!a->down[i])
+            return i;
+    return NULLnode;
+}
+
+/******************************************************************************/
+/*                                                                            */
+/* Instances                                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+static void inst_send(void *arg, int to, const void *buf, unsigned int len) {
+    struct inst *in = (struct inst *) arg;
+    unsigned char wire[FRAME_MAX];
+    struct codec c;
+
+    codec_init(&c, wire, sizeof(wire));
+    codec_put_u8(&c, A_ALG);
+    codec_put_uint(&c, in->epoch);
+    if (c.err || c.pos + len > sizeof(wire)) {
+        fprintf(stderr, "ADAPTIVE: message of %u bytes does not fit in a frame\n", len);
+        exit(1);
+    }
+    memcpy(wire + c.pos, buf, len);
+    in->a->env->send(in->a->env->arg, to, wire, c.pos + len);
+}
+
+static void maybe_ready(struct ada_ctx *a);
+
+static void inst_grant(void *arg) {
+    struct inst *in = (struct inst *) arg;
+    struct ada_ctx *a = in->a;
+    double t = now_ms();
+
+    if (in != a->cur) {
+        fprintf(stderr, "ADAPTIVE: grant from epoch %d, the current one is %d\n", in->epoch, a->epoch);
+        exit(1);
+    }
+    if (a->local == L_ABANDONED) {
+        printf("ADAPTIVE: grant of a withdrawn acquire given back\n");
+        fflush(stdout);
+        a->local = L_IDLE;
+        in->a->ops[in->alg]->on_local_release(in->ctx);
+        maybe_ready(a);
+        return;
+    }
+    a->local = L_HELD;
+    a->acquires++;
+    a->wait_ms += t - a->asked;
+    a->env->grant(a->env->arg);
+}
+
+static struct inst *inst_new(struct ada_ctx *a, int epoch, int alg) {
+    struct inst *in = (struct inst *) malloc(sizeof(struct inst));
+    int i;
+
+    if (in == NULL || (in->ctx = calloc(1, a->ops[alg]->ctx_size)) == NULL) {
+        perror("malloc failed :\n");
+        exit(1);
+    }
+    in->a         = a;
+    in->epoch     = epoch;
+    in->alg       = alg;
+    in->env.arg   = in;
+    in->env.send  = inst_send;
+    in->env.grant = inst_grant;
+    printf("ADAPTIVE: epoch %d runs %s\n", epoch, a->names[alg]);
+    fflush(stdout);
+    a->ops[alg]->init(in->ctx, &in->env, a->nid, a->ntot);
+    // It has to know who is down already.
+    if (a->ops[alg]->on_peer_down != NULL)
+        for (i = 1; i <= a->ntot; i++)
+            if (a->down[i])
+                a->ops[alg]->on_peer_down(in->ctx, i);
+    return in;
+}
+
+static void inst_free(struct inst *in) {
+    if (in == NULL)
+        return;
+    in->a->ops[in->alg]->fini(in->ctx);
+    free(in->ctx);
+    free(in);
+}
+
+// Loads the libraries named in DME_ADAPT_ALGS.
+static void load_algs(struct ada_ctx *a) {
+    char *env = getenv("DME_ADAPT_ALGS");
+    char list[256], dir[256], path[512], *tok, *save;
+    Dl_info info;
+    void *handle;
+
+    snprintf(list, sizeof(list), "%s", env != NULL ? env : "ricart fuchi maekawa");
+    if ((env = getenv("DME_ADAPT_DIR")) != NULL)
+        snprintf(dir, sizeof(dir), "%s", env);
+    else if (dladdr((void *) &dme_ops, &info) != 0 && info.dli_fname != NULL) {
+        snprintf(path, sizeof(path), "%s", info.dli_fname);
+        snprintf(dir, sizeof(dir), "%s", dirname(path));
+    }
+    else
+        snprintf(dir, sizeof(dir), ".");
+
+    a->nalgs = 0;
+    for (tok = strtok_r(list, " ,", &save); tok != NULL && a->nalgs < MAX_ALGS; tok = strtok_r(NULL, " ,", &save)) {
+        snprintf(path, sizeof(path), "%s/%s.so", dir, tok);
+        if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+            fprintf(stderr, "ADAPTIVE: %s\n", dlerror());
+            exit(1);
+        }
+        a->ops[a->nalgs] = (const struct dme_ops *) dlsym(handle, DME_OPS_SYMBOL);
+        if (a->ops[a->nalgs] == NULL || a->ops[a->nalgs]->version != DME_ABI_V2 || a->ops[a->nalgs] == &dme_ops) {
+            fprintf(stderr, "ADAPTIVE: %s is not a v2 library that can be switched to\n", path);
+            exit(1);
+        }
+        snprintf(a->names[a->nalgs], sizeof(a->names[0]), "%s", tok);
+        a->nalgs++;
+    }
+    if (a->nalgs == 0) {
+        fprintf(stderr, "ADAPTIVE: no libraries in DME_ADAPT_ALGS\n");
+        exit(1);
+    }
+}
+
+/******************************************************************************/
+/*                                                                            */
+/* Switch protocol                                                            */
+/*                                                                            */
+/******************************************************************************/
+
+static void handle(struct ada_ctx *a, int from, a_type type, struct codec *c);
+
+// Sends a protocol message of up to three fields, handled at once if it is for
+// this node (to 0 sends it to every node, this one included).
+static void send_ctl(struct ada_ctx *a, int to, a_type type, unsigned int x, unsigned int y, unsigned int z) {
+    unsigned char wire[1 + 3 * CODEC_FIELD_MAX];
+    struct codec c;
+
+    codec_init(&c, wire, sizeof(wire));
+    codec_put_u8(&c, type);
+    codec_put_uint(&c, x);
+    codec_put_uint(&c, y);
+    codec_put_uint(&c, z);
+    if (to != a->nid)
+        a->env->send(a->env->arg, to, wire, c.pos);
+    if (to == a->nid || to == 0) {
+        codec_init(&c, wire + 1, c.pos - 1);
+        handle(a, a->nid, type, &c);
+    }
+}
+
+// Answers a pending PREPARE once the current instance is left alone.
+static void maybe_ready(struct ada_ctx *a) {
+    if (a->prepared == a->epoch || a->ready_sent)
+        return;
+    if (a->local != L_IDLE && a->local != L_QUEUED)
+        return;
+    a->ready_sent = 1;
+    send_ctl(a, leader(a), A_READY, a->prepared, a->target, 0);
+}
+
+// Leader: asks every node to switch to alg in the next epoch.
+static void prepare(struct ada_ctx *a, int epoch, int alg) {
+    printf("ADAPTIVE: switching to %s in epoch %d\n", a->names[alg], epoch);
+    fflush(stdout);
+    memset(a->ready, 0, sizeof(int) * (a->ntot + 1));
+    a->last_switch = now_ms();
+    send_ctl(a, 0, A_PREPARE, epoch, alg, 0);
+}
+
+// Leader: commits once every node that is up is ready.
+static void maybe_commit(struct ada_ctx *a) {
+    int i;
+
+    if (leader(a) != a->nid || a->prepared == a->epoch)
+        return;
+    for (i = 1; i <= a->ntot; i++)
+        if (!a->down[i] && !a->ready[i])
+            return;
+    send_ctl(a, 0, A_COMMIT, a->prepared, a->target, 0);
+}
+
+// Leader: picks the algorithm for a queue depth.
+static int choose(struct ada_ctx *a, double depth) {
+    int calm = a->nalgs > 2 && a->ntot >= a->large_n ? 2 : 0;
+
+    if (a->force && a->cur != NULL)
+        return (a->cur->alg + 1) % a->nalgs;
+    if (depth >= a->high && a->nalgs > 1)
+        return 1;
+    if (depth <= a->low)
+        return calm;
+    return a->cur->alg;
+}
+
+// Leader: a window is over, decides whether to switch.
+static void evaluate(struct ada_ctx *a) {
+    double t = now_ms();
+    int alg = choose(a, a->depth);
+
+    printf("ADAPTIVE: %.1f acquires per second, %.2f requests waiting, %s runs\n",
+           a->rate, a->depth, a->names[a->cur->alg]);
+    fflush(stdout);
+    a->depth = a->rate = 0;
+    a->eval_start = t;
+
+    a->streak = alg == a->want ? a->streak + 1 : 1;
+    a->want = alg;
+    if (alg == a->cur->alg || a->prepared != a->epoch)
+        return;
+    if (!a->force && (a->streak < 2 || t - a->last_switch < a->hold_ms))
+        return;
+    prepare(a, a->epoch + 1, alg);
+}
+
+// Sends the leader the load seen since the last report.
+static void report(struct ada_ctx *a) {
+    double t = now_ms(), span = t - a->window_start;
+
+    if (span < a->window_ms || leader(a) == NULLnode)
+        return;
+    send_ctl(a, leader(a), A_LOAD, a->acquires, (unsigned int) (a->wait_ms * 1000), (unsigned int) (span * 1000));
+    a->window_start = t;
+    a->acquires = 0;
+    a->wait_ms = 0;
+}
+
+static void handle(struct ada_ctx *a, int from, a_type type, struct codec *c) {
+    unsigned int x = codec_get_uint(c), y = codec_get_uint(c), z = codec_get_uint(c);
+
+    if (c->err || c->pos != c->len) {
+        printf("ADAPTIVE: malformed message from %d, ignored\n", from);
+        fflush(stdout);
+        return;
+    }
+    switch (type) {
+    case A_LOAD:
+        // x acquires waited y us in total over z us.
+        if (leader(a) != a->nid || z == 0)
+            break;
+        a->rate  += x * 1000000.0 / z;
+        a->depth += (double) y / z;
+        if (now_ms() - a->eval_start >= a->window_ms)
+            evaluate(a);
+        break;
+    case A_PREPARE:
+        if ((int) y >= a->nalgs)
+            break;
+        if ((int) x <= a->epoch) {
+            // From a new leader, this node has switched already.
+            send_ctl(a, from, A_READY, x, y, 0);
+            break;
+        }
+        if (a->next == NULL || a->next->epoch != (int) x) {
+            inst_free(a->next);
+            a->next = inst_new(a, x, y);
+        }
+        a->prepared = x;
+        a->target = y;
+        a->ready_sent = 0;
+        maybe_ready(a);
+        break;
+    case A_READY:
+        if (leader(a) != a->nid)
+            break;
+        if ((int) x > a->prepared && (int) y < a->nalgs) {
+            // The leader that asked went down before this one heard it.
+            prepare(a, x, y);
+        }
+        if ((int) x == a->prepared) {
+            a->ready[from] = 1;
+            maybe_commit(a);
+        }
+        break;
+    case A_COMMIT:
+        if ((int) x != a->prepared || (int) x <= a->epoch)
+            break;
+        printf("ADAPTIVE: epoch %d, %s runs\n", x, a->names[y]);
+        fflush(stdout);
+        inst_free(a->prev);
+        a->prev = a->cur;
+        a->cur = a->next;
+        a->next = NULL;
+        a->epoch = x;
+        a->ready_sent = 0;
+        if (a->local == L_QUEUED) {
+            a->local = L_WAITING;
+            a->ops[a->cur->alg]->on_local_acquire(a->cur->ctx);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/******************************************************************************/
+/*                                                                            */
+/* Entry points                                                               */
+/*                                                                            */
+/******************************************************************************/
+
+static void ada_init(void *ctx, const struct dme_env *env, int nid, int ntot) {
+    struct ada_ctx *a = (struct ada_ctx *) ctx;
+
+    a->env       = env;
+    a->nid       = nid;
+    a->ntot      = ntot;
+    a->down      = (int *) calloc(ntot + 1, sizeof(int));
+    a->ready     = (int *) calloc(ntot + 1, sizeof(int));
+    if (a->down == NULL || a->ready == NULL) {
+        perror("calloc failed :\n");
+        exit(1);
+    }
+    a->window_ms = env_double("DME_ADAPT_WINDOW_MS", 1000);
+    a->hold_ms   = env_double("DME_ADAPT_HOLD_MS", 10000);
+    a->low       = env_double("DME_ADAPT_LOW", 0.5);
+    a->high      = env_double("DME_ADAPT_HIGH", 1.5);
+    a->large_n   = (int) env_double("DME_ADAPT_LARGE_N", 16);
+    a->force     = (int) env_double("DME_ADAPT_FORCE", 0);
+    load_algs(a);
+
+    a->epoch = a->prepared = 0;
+    a->ready_sent = 0;
+    a->local = L_IDLE;
+    a->prev = a->cur = a->next = NULL;
+    a->cur = inst_new(a, 0, choose(a, 0));
+    a->target = a->cur->alg;
+    a->window_start = a->eval_start = a->last_switch = now_ms();
+    a->acquires = 0;
+    a->wait_ms = a->depth = a->rate = 0;
+    a->want = a->cur->alg;
+    a->streak = 0;
+    printf("Adaptive algorithm started with %d nodes over %d libraries\n", ntot, a->nalgs);
+    fflush(stdout);
+}
+
+static void ada_message(void *ctx, int from, const void *buf, unsigned int len) {
+    struct ada_ctx *a = (struct ada_ctx *) ctx;
+    struct inst *in;
+    struct codec c;
+    int type, epoch;
+
+    codec_init(&c, (void *) buf, len);
+    type = codec_get_u8(&c);
+    if (type != A_ALG) {
+        handle(a, from, type, &c);
+        return;
+    }
+    epoch = codec_get_uint(&c);
+    if (a->next != NULL && epoch == a->next->epoch)
+        in = a->next;
+    else if (epoch == a->cur->epoch)
+        in = a->cur;
+    else if (a->prev != NULL && epoch == a->prev->epoch)
+        in = a->prev;
+    else {
+        printf("ADAPTIVE: message from %d for epoch %d dropped\n", from, epoch);
+        fflush(stdout);
+        return;
+    }
+    if (c.err)
+        return;
+    a->ops[in->alg]->on_message(in->ctx, from, (const char *) buf + c.pos, len - c.pos);
+}
+
+static void ada_acquire(void *ctx) {
+    struct ada_ctx *a = (struct ada_ctx *) ctx;
+
+    a->asked = now_ms();
+    if (a->prepared != a->epoch) {
+        // Waits for the switch.
+        a->local = L_QUEUED;
+        return;
+    }
+    a->local = L_WAITING;
+    a->ops[a->cur->alg]->on_local_acquire(a->cur->ctx);
+}
+
+static void ada_release(void *ctx) {
+    struct ada_ctx *a = (struct ada_ctx *) ctx;
+
+    a->local = L_IDLE;
+    a->ops[a->cur->alg]->on_local_release(a->cur->ctx);
+    report(a);
+    maybe_ready(a);
+}
+
+static void ada_cancel(void *ctx) {
+    struct ada_ctx *a = (struct ada_ctx *) ctx;
+    const struct dme_ops *ops = a->ops[a->cur->alg];
+
+    if (a->local == L_QUEUED)
+        a->local = L_IDLE;
+    else if (ops->on_local_cancel != NULL) {
+        ops->on_local_cancel(a->cur->ctx);
+        a->local = L_IDLE;
+    }
+    else {
+        a->local = L_ABANDONED;
+        return;
+    }
+    maybe_ready(a);
+}
+
+static void ada_fini(void *ctx) {
+    struct ada_ctx *a = (struct ada_ctx *) ctx;
+
+    inst_free(a->prev);
+    inst_free(a->cur);
+    inst_free(a->next);
+    free(a->down);
+    free(a->ready);
+}
+
+// Passes node nid's state on to every instance.
+static void peer_change(struct ada_ctx *a, int nid, int down) {
+    struct inst *ins[3] = { a->prev, a->cur, a->next };
+    void (*fn)(void *, int);
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (ins[i] == NULL)
+            continue;
+        fn = down ? a->ops[ins[i]->alg]->on_peer_down : a->ops[ins[i]->alg]->on_peer_up;
+        if (fn != NULL)
+            fn(ins[i]->ctx, nid);
+    }
+}
+
+// Node nid crashed. If it led, the next leader asks for the pending switch
+// again, or commits the last one again for nodes that may have missed it.
+static void ada_peer_down(void *ctx, int nid) {
+    struct ada_ctx *a = (struct ada_ctx *) ctx;
+    int was = leader(a);
+
+    printf("ADAPTIVE: node %d is down\n", nid);
+    fflush(stdout);
+    a->down[nid] = 1;
+    peer_change(a, nid, 1);
+    if (was != nid) {
+        maybe_commit(a);
+        return;
+    }
+    a->ready_sent = 0;
+    if (leader(a) == a->nid) {
+        if (a->prepared != a->epoch)
+            prepare(a, a->prepared, a->target);
+        else if (a->epoch > 0)
+            send_ctl(a, 0, A_COMMIT, a->epoch, a->cur->alg, 0);
+    }
+    else
+        maybe_ready(a);
+}
+
+static void ada_peer_up(void *ctx, int nid) {
+    struct ada_ctx *a = (struct ada_ctx *) ctx;
+
+    printf("ADAPTIVE: node %d is up\n", nid);
+    fflush(stdout);
+    a->down[nid] = 0;
+    peer_change(a, nid, 0);
+}
+
+const struct dme_ops dme_ops = {
+    DME_ABI_V2,
+    "adaptive",
+    sizeof(struct ada_ctx),
+    ada_init,
+    ada_message,
+    ada_acquire,
+    ada_release,
+    ada_fini,
+    ada_peer_down,
+    ada_peer_up,
+    ada_cancel,
+};
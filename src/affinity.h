@@ -0,0 +1,100 @@
+#ifndef _AFFINITY
+#define _AFFINITY
+// Thread placement for the node controller, its producer and the buffer manager.
+//
+// DME_CPUS assigns CPU lists to roles, separated by semicolons, for instance
+//     handler=2;io=3-4;producer=5
+// The node controller's roles are handler (the dme handler, timer, loopback and
+// combiner threads), io (receivers, senders, relay, heartbeat, failure
+// detector, emulated links, control and signal threads) and producer. The buffer manager only has bm. A role that is
+// not listed keeps the default placement. Every placement applied is read back
+// and logged, since the kernel drops CPUs that are offline or not allowed.
+// NOTE: Everything is static. Needs _GNU_SOURCE before the first system header.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+// Parses a CPU list such as 0-2,5 into set. Returns 0 if it is malformed.
+static int cpus_parse(const char *list, int len, cpu_set_t *set) {
+    char buf[256], *tok, *save;
+    int lo, hi, i;
+
+    if (len <= 0 || len >= (int) sizeof(buf))
+        return 0;
+    memcpy(buf, list, len);
+    buf[len] = '\0';
+    CPU_ZERO(set);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (sscanf(tok, "%d-%d", &lo, &hi) != 2) {
+            if (sscanf(tok, "%d", &lo) != 1)
+                return 0;
+            hi = lo;
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+            return 0;
+        for (i = lo; i <= hi; i++)
+            CPU_SET(i, set);
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+// Formats set as a CPU list.
+static void cpus_format(cpu_set_t *set, char *buf, int len) {
+    int i, j, n = 0;
+
+    buf[0] = '\0';
+    for (i = 0; i < CPU_SETSIZE && n < len - 1; i = j) {
+        if (!CPU_ISSET(i, set)) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < CPU_SETSIZE && CPU_ISSET(j, set); j++) ;
+        if (j - 1 == i)
+            n += snprintf(buf + n, len - n, "%s%d", n > 0 ? "," : "", i);
+        else
+            n += snprintf(buf + n, len - n, "%s%d-%d", n > 0 ? "," : "", i, j - 1);
+    }
+}
+
+// Finds the CPUs DME_CPUS gives role. Returns 0 if it gives none.
+static int placement_get(const char *role, cpu_set_t *set) {
+    char *env = getenv("DME_CPUS");
+    char *p, *end;
+    int rlen = strlen(role);
+
+    if (env == NULL)
+        return 0;
+    for (p = env; *p != '\0'; p = *end == ';' ? end + 1 : end) {
+        end = p + strcspn(p, ";");
+        if (strncmp(p, role, rlen) == 0 && p[rlen] == '=') {
+            if (!cpus_parse(p + rlen + 1, end - p - rlen - 1, set)) {
+                fprintf(stderr, "AFFINITY: bad CPU list for %s in DME_CPUS\n", role);
+                return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Pins thread t, called name, to the CPUs of role and logs where it ended up.
+static void place(pthread_t t, const char *role, const char *name) {
+    cpu_set_t set;
+    char buf[256];
+    int err;
+
+    if (!placement_get(role, &set))
+        return;
+    if ((err = pthread_setaffinity_np(t, sizeof(cpu_set_t), &set)) != 0)
+        printf("AFFINITY: cannot pin %s to the %s CPUs: %s\n", name, role, strerror(err));
+    if (pthread_getaffinity_np(t, sizeof(cpu_set_t), &set) == 0) {
+        cpus_format(&set, buf, sizeof(buf));
+        printf("AFFINITY: %s (%s) runs on CPUs %s\n", name, role, buf);
+    }
+    fflush(stdout);
+}
+
+#endif
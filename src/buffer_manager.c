@@ -1,92 +1,439 @@
+// For CPU affinity (see affinity.h), before any header
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <strings.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 
 #include <pthread.h>
 
-#define PORTNO 1992
+#include "affinity.h"
+#include "donut.h"
+
 #define BSIZE  100
 
-struct msg {
-	int node_id;
-	int donut_number;
+// Shards (DME_BM_SHARDS=<count>)
+// Each shard is a buffer of its own with its own listener on the port after
+// the previous shard's (shard 0 on DME_BM_PORT), its own batches and its own
+// fencing tokens, so shards can be guarded by separate distributed mutexes.
+struct slot;
+struct shard {
+	int id;
+	int sockfd;
+	char name[24];             // Shown in batch headers, empty with one shard.
+	struct msg buffer[BSIZE];
+	int buf_indx;
+
+	struct slot *ring;         // Ring mode, see below.
+	long reserved;             // Next position to hand out.
+	long emitted;              // Positions below it have been printed, their slots are free.
+
+	// Newest fencing token seen. A write with an older one comes from a holder
+	// whose lease has run out, and is answered with -1 instead of a buffer index.
+	unsigned int newest;
+	int rejected;
+	pthread_mutex_t fence_lock;
 };
+struct shard *shards;
+int nshards;
 
-struct msg buffer[BSIZE];
-int buf_indx;
+// A connection for a handler thread.
+struct conn {
+	struct shard *sh;
+	int fd;
+};
+
+// Ring mode (DME_BM_RING=<slots>)
+// Writers reserve a slot with an atomic increment instead of sharing buf_indx,
+// and publish it by storing its position + 1 in seq. The emitter thread prints
+// the ring a batch of BSIZE at a time as the slots are published, so later
+// batches fill while earlier ones are printed, and writers only wait when the
+// ring is full. Writes never collide, so producers may run without mutual
+// exclusion at all (lib/none.so) to measure what the rest of the system allows.
+struct slot {
+	struct msg donut;
+	long seq;
+};
+long ring_size;
+void *emitter(void *arg);
+
+// Durable log (DME_BM_LOG=<file>)
+// Every donut taken is appended to the file through a shared mapping of a
+// preallocated segment of DME_BM_LOG_MB, and the next segment is mapped when it
+// fills. The committer thread flushes what was appended every DME_BM_COMMIT_MS
+// (group commit, 0 flushes as soon as there is anything) and a donut is only
+// answered once the commit that covers it is done. Offsets are in the file.
+struct log_rec {
+	struct msg donut;
+	int shard;
+	int reply;
+};
+int log_fd = -1;
+char *log_map;               // Mapping of the current segment.
+long log_seg;                // Bytes in a segment.
+long log_start;              // Offset of the current segment.
+long log_written;            // Appended up to here.
+long log_committed;          // Durable up to here.
+int commit_ms;
+long commits, committed_bytes;
+double commit_total_ms, commit_max_ms;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t appended = PTHREAD_COND_INITIALIZER;
+pthread_cond_t committed = PTHREAD_COND_INITIALIZER;
+void log_open(const char *path);
+long log_append(struct msg *donut, int shard, int reply);
+void log_wait(long end);
+void *committer(void *arg);
 
 void error(char *msg) {
 	perror(msg);
 	exit(1);
 }
 
+void *listener(void *arg);
 void *handler(void *arg);
+int ring_put(struct shard *sh, struct msg *donut);
 
 int main(int argc, char *argv[]) {
+	int i, one = 1;
+	char *env;
+	struct sockaddr_in serv_addr;
+	struct shard *sh;
+	pthread_t thread_ID;
+
+	// Handler threads inherit the placement.
+	place(pthread_self(), "bm", "buffer manager");
+
+	env = getenv("DME_BM_SHARDS");
+	nshards = env != NULL && atoi(env) > 1 ? atoi(env) : 1;
+	shards = (struct shard *) calloc(nshards, sizeof(struct shard));
+	if (shards == NULL)
+		error("ERROR on calloc");
+	env = getenv("DME_BM_RING");
+	ring_size = env != NULL ? atol(env) : 0;
+	if (ring_size > 0 && ring_size < BSIZE)
+		ring_size = BSIZE;
+
+	for (i = 0; i < nshards; i++) {
+		sh = &shards[i];
+		sh->id = i;
+		if (nshards > 1)
+			snprintf(sh->name, sizeof(sh->name), " of shard %d", i);
+		pthread_mutex_init(&sh->fence_lock, NULL);
+
+		// Creating socket
+		sh->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (sh->sockfd < 0)
+			error("ERROR opening socket.");
+
+		setsockopt(sh->sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		// Binding socket, DME_BM_PORT overrides the default port.
+		bzero((char *) &serv_addr, sizeof(serv_addr));
+		serv_addr.sin_family = AF_INET;
+		serv_addr.sin_addr.s_addr = INADDR_ANY;
+		serv_addr.sin_port = htons(bm_port() + i);
+		if (bind(sh->sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+			error("ERROR on binding");
+		listen(sh->sockfd, 5);
+
+		if (ring_size > 0) {
+			sh->ring = (struct slot *) calloc(ring_size, sizeof(struct slot));
+			if (sh->ring == NULL)
+				error("ERROR on calloc");
+			if (pthread_create(&thread_ID, NULL, emitter, sh) != 0)
+				error("ERROR on pthread_create");
+		}
+	}
+	if (nshards > 1)
+		printf("%d shards on ports %d to %d\n", nshards, bm_port(), bm_port() + nshards - 1);
+	if (ring_size > 0)
+		printf("Ring of %ld slots\n", ring_size);
+	fflush(stdout);
+
+	if ((env = getenv("DME_BM_LOG")) != NULL)
+		log_open(env);
+
+	// Shard 0 is served by this thread.
+	for (i = 1; i < nshards; i++)
+		if (pthread_create(&thread_ID, NULL, listener, &shards[i]) != 0)
+			error("ERROR on pthread_create");
+	listener(&shards[0]);
+
+	return 0;
+}
+
+// Starts a handler thread for the next connection to shard sh.
+static pthread_t accept_one(struct shard *sh) {
+	struct sockaddr_in cli_addr;
+	socklen_t clilen = sizeof(cli_addr);
+	struct conn *c;
+	pthread_t thread_ID;
+
+	if ((c = (struct conn *) malloc(sizeof(struct conn))) == NULL)
+		error("ERROR on malloc");
+	c->sh = sh;
+	while ((c->fd = accept(sh->sockfd, (struct sockaddr *) &cli_addr, &clilen)) < 0) ;
+	if (pthread_create(&thread_ID, NULL, handler, c) != 0)
+		error("ERROR on pthread_create");
+	return thread_ID;
+}
+
+void *listener(void *arg) {
+	// Takes the connections of one shard.
+	struct shard *sh = (struct shard *) arg;
 	int i, batch = 0;
-	int sockfd, newsockfd, portno, clilen;
-	struct sockaddr_in serv_addr, cli_addr;
 	pthread_t thread_ID;
 
-	// Creating socket
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0)
-		error("ERROR opening socket.");
-
-	// Binding socket
-	bzero((char *) &serv_addr, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = INADDR_ANY;
-	serv_addr.sin_port = htons(PORTNO);
-	if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
-		error("ERROR on binding");
-	listen(sockfd, 5);
-
-	clilen = sizeof(cli_addr);
+	if (ring_size > 0)
+		while (1)
+			pthread_detach(accept_one(sh));
+
 	while(1) {
         // Reset buffer index
-        buf_indx = 0;
+        sh->buf_indx = 0;
         // Listen for connections, create thread on accept.
-        while (buf_indx < BSIZE-1) {
-            newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-            pthread_create(&thread_ID, NULL, handler, (void *) &newsockfd);
-        }
+        while (sh->buf_indx < BSIZE-1)
+            thread_ID = accept_one(sh);
 
         // Wait for final thread to finish
         pthread_join(thread_ID, NULL);
 
         // Print content of buffer
-        printf("------ Start Batch %d ------\n", batch);
+        printf("------ Start Batch %d%s ------\n", batch, sh->name);
         for (i = 0; i < BSIZE; i++)
-            printf("NODE: %4d DONUT: %4d\n", buffer[i].node_id, buffer[i].donut_number);
-        printf("------ End Batch %d ------\n", batch++);
+            printf("NODE: %4d DONUT: %4d\n", sh->buffer[i].node_id, sh->buffer[i].donut_number);
+        if (sh->rejected > 0)
+            printf("Rejected %d stale writes, newest token %u\n", sh->rejected, sh->newest);
+        printf("------ End Batch %d%s ------\n", batch++, sh->name);
         fflush(stdout);
     }
-
-	return 0;
+	return NULL;
 }
 
 void *handler(void *arg) {
-	// Cast the parameter into what is needed.
-	int sockfd = *((int *) arg);
-	int n;
+	// The connection is handed over, the next accept would overwrite it.
+	struct conn *c = (struct conn *) arg;
+	struct shard *sh = c->sh;
+	int sockfd = c->fd;
+	int n, stale, reply;
+	struct msg donut;
 
-	n = read(sockfd, &buffer[buf_indx], sizeof(struct msg));
+	free(c);
+	n = read(sockfd, &donut, sizeof(struct msg));
 	
 	if (n < 0) error("ERROR reading from socket");
+
+	// Only the check is locked, so writes without mutual exclusion still collide.
+	pthread_mutex_lock(&sh->fence_lock);
+	stale = donut.token != 0 && donut.token < sh->newest;
+	if (stale)
+		sh->rejected++;
+	else if (donut.token > sh->newest)
+		sh->newest = donut.token;
+	pthread_mutex_unlock(&sh->fence_lock);
+
+	if (stale) {
+		printf("Rejected donut %d from node %d: token %u is older than %u\n",
+		       donut.donut_number, donut.node_id, donut.token, sh->newest);
+		reply = -1;
+	}
+	else if (ring_size > 0)
+		reply = ring_put(sh, &donut);
+	else {
+		sh->buffer[sh->buf_indx] = donut;
+		// Sleeping to ensure corruption happens if no mutual exclusion.
+		// Donut is placed in the buffer, but before the index is increased, another
+		// node places a donut in the same buffer, then the index is increased twice. 
+		usleep(5000);
+		sh->buf_indx++;
+		reply = sh->buf_indx;
+	}
+	if (log_fd >= 0 && reply != -1)
+		log_wait(log_append(&donut, sh->id, reply));
 	
-	// Sleeping to ensure corruption happens if no mutual exclusion.
-	// Donut is placed in the buffer, but before the index is increased, another
-	// node places a donut in the same buffer, then the index is increased twice. 
-	usleep(5000);
-	buf_indx++;
-	
-	n = write(sockfd, &buf_indx, sizeof(int));
+	n = write(sockfd, &reply, sizeof(int));
 	//if (n < 0) error("ERROR writing to socket");
 	if (n < 0) printf("Warning: could not write to node\n");
     fflush(stdout);
+	close(sockfd);
+	return NULL;
+}
+
+// Puts the donut in the next free slot of the shard's ring and returns its
+// place in its batch, as buf_indx would be.
+int ring_put(struct shard *sh, struct msg *donut) {
+	long pos = __atomic_fetch_add(&sh->reserved, 1, __ATOMIC_RELAXED);
+	struct slot *s = &sh->ring[pos % ring_size];
+
+	// The slot is free once the batch that had it last has been printed.
+	while (pos - __atomic_load_n(&sh->emitted, __ATOMIC_ACQUIRE) >= ring_size)
+		usleep(100);
+	s->donut = *donut;
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	return pos % BSIZE + 1;
+}
+
+void *emitter(void *arg) {
+	// Prints a shard's ring in order, a batch at a time, as its slots are published.
+	struct shard *sh = (struct shard *) arg;
+	long pos, batch = 0;
+	struct slot *s;
+
+	for (pos = 0; ; pos++) {
+		s = &sh->ring[pos % ring_size];
+		while (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			usleep(100);
+		if (pos % BSIZE == 0)
+			printf("------ Start Batch %ld%s ------\n", batch, sh->name);
+		printf("NODE: %4d DONUT: %4d\n", s->donut.node_id, s->donut.donut_number);
+		if (pos % BSIZE == BSIZE - 1) {
+			pthread_mutex_lock(&sh->fence_lock);
+			if (sh->rejected > 0)
+				printf("Rejected %d stale writes, newest token %u\n", sh->rejected, sh->newest);
+			pthread_mutex_unlock(&sh->fence_lock);
+			printf("------ End Batch %ld%s ------\n", batch++, sh->name);
+			fflush(stdout);
+			// Frees the batch's slots for writers.
+			__atomic_store_n(&sh->emitted, pos + 1, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+// Wall clock in milliseconds.
+double now_ms() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Maps the segment at offset start, allocating its blocks first so that
+// appends never fault on a full disk. Called with log_lock held, or before
+// the committer starts.
+void log_map_segment(long start) {
+	int err;
+
+	if ((err = posix_fallocate(log_fd, start, log_seg)) != 0) {
+		fprintf(stderr, "ERROR on fallocate: %s\n", strerror(err));
+		exit(1);
+	}
+	log_map = mmap(NULL, log_seg, PROT_READ | PROT_WRITE, MAP_SHARED, log_fd, start);
+	if (log_map == MAP_FAILED)
+		error("ERROR on mmap");
+	log_start = start;
+}
+
+void log_open(const char *path) {
+	char *env;
+	pthread_t thread_ID;
+
+	env       = getenv("DME_BM_LOG_MB");
+	log_seg   = (env != NULL ? atol(env) : 64) << 20;
+	env       = getenv("DME_BM_COMMIT_MS");
+	commit_ms = env != NULL ? atoi(env) : 5;
+	if (log_seg <= 0)
+		log_seg = 1 << 20;
+	if ((log_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		error("ERROR opening the log");
+	log_map_segment(0);
+	printf("Logging donuts to %s, segments of %ld MB, commits every %d ms\n", path, log_seg >> 20, commit_ms);
+	fflush(stdout);
+	if (pthread_create(&thread_ID, NULL, committer, NULL) != 0)
+		error("ERROR on pthread_create");
+}
+
+// Appends a record and returns the offset a commit must reach to cover it.
+long log_append(struct msg *donut, int shard, int reply) {
+	struct log_rec rec;
+	long end;
+
+	rec.donut = *donut;
+	rec.shard = shard;
+	rec.reply = reply;
+	pthread_mutex_lock(&log_lock);
+	while (log_written + (long) sizeof(rec) > log_start + log_seg) {
+		// The segment is full. Its mapping goes once all of it is durable,
+		// and its unused tail stays zeroes.
+		if (log_committed < log_written) {
+			pthread_cond_wait(&committed, &log_lock);
+			continue;
+		}
+		munmap(log_map, log_seg);
+		log_map_segment(log_start + log_seg);
+		log_written = log_committed = log_start;
+	}
+	memcpy(log_map + (log_written - log_start), &rec, sizeof(rec));
+	log_written += sizeof(rec);
+	end = log_written;
+	pthread_cond_signal(&appended);
+	pthread_mutex_unlock(&log_lock);
+	return end;
+}
+
+// Waits for the commit that covers offset end.
+void log_wait(long end) {
+	pthread_mutex_lock(&log_lock);
+	while (log_committed < end)
+		pthread_cond_wait(&committed, &log_lock);
+	pthread_mutex_unlock(&log_lock);
+}
+
+void *committer(void *arg) {
+	// Flushes everything appended since the last commit in one msync, then
+	// lets the handlers it covers answer. Reports once a second.
+	long from, to, page = sysconf(_SC_PAGESIZE);
+	double t, ms, last = now_ms(), last_bytes = 0;
+	char *map;
+
+	for (;;) {
+		pthread_mutex_lock(&log_lock);
+		while (log_written == log_committed)
+			pthread_cond_wait(&appended, &log_lock);
+		pthread_mutex_unlock(&log_lock);
+		if (commit_ms > 0)
+			usleep(commit_ms * 1000);
+
+		// Appends go on while the flush runs. The segment cannot change under
+		// it, since it is only unmapped once everything in it is committed.
+		pthread_mutex_lock(&log_lock);
+		map  = log_map;
+		from = log_committed - log_start;
+		to   = log_written - log_start;
+		pthread_mutex_unlock(&log_lock);
+		from -= from % page;
+		t = now_ms();
+		if (msync(map + from, to - from, MS_SYNC) < 0)
+			error("ERROR on msync");
+		ms = now_ms() - t;
+
+		pthread_mutex_lock(&log_lock);
+		committed_bytes += log_start + to - log_committed;
+		log_committed = log_start + to;
+		commits++;
+		commit_total_ms += ms;
+		if (ms > commit_max_ms)
+			commit_max_ms = ms;
+		pthread_cond_broadcast(&committed);
+		pthread_mutex_unlock(&log_lock);
+
+		if ((t = now_ms()) - last >= 1000) {
+			printf("LOG: %ld commits, %.3f ms mean commit latency (max %.3f), %.0f bytes per second\n",
+			       commits, commit_total_ms / commits, commit_max_ms,
+			       (committed_bytes - last_bytes) * 1000 / (t - last));
+			fflush(stdout);
+			last = t;
+			last_bytes = committed_bytes;
+		}
+	}
+	return NULL;
 }
@@ -0,0 +1,353 @@
+/******************************************************************************/
+/*                                                                            */
+/* central.c - A centralized coordinator for distributed mutual exclusion.    */
+/*             One node grants the lock to requesters in FIFO order, which    */
+/*             costs 3 messages per critical section (REQUEST, GRANT,         */
+/*             RELEASE) and gives a best-case reference point for the other   */
+/*             algorithms.                                                    */
+/*                                                                            */
+/*             The coordinator is node 1 unless the DME_COORDINATOR           */
+/*             environment variable names another node.                       */
+/*                                                                            */
+/*             If the coordinator is reported down, the next node up after    */
+/*             it takes over. Every node tells it what it is doing (REQUEST,  */
+/*             HELD or IDLE), and it grants nothing until all have answered.  */
+/*                                                                            */
+/*             A withdrawn local request (on_local_cancel) sends RELEASE,     */
+/*             which frees the lock if the GRANT is already on its way and    */
+/*             takes the request out of the queue otherwise. Requests are     */
+/*             numbered and a GRANT carries the number of the one it answers, */
+/*             so a late GRANT is not taken for one to the next request.      */
+/*                                                                            */
+/*             Built against the v2 interface (see dme_v2.h).                 */
+/*                                                                            */
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+
+#include "dme_v2.h"
+#include "codec.h"
+#include "pool.h"
+
+// A number which is not a node number.
+#define NULLnode -1
+
+// Types of messages that can be received
+typedef enum { REQUEST,
+               GRANT,
+               RELEASE,
+               HELD,          // To a new coordinator: in the critical section.
+               IDLE        } c_type;  // To a new coordinator: not asking.
+
+// What the local process is doing.
+typedef enum { L_IDLE, L_WAITING, L_HELD } l_state;
+
+struct cen_msg {
+    c_type type;
+    int nid;
+    int seq;     // Number of the request a REQUEST or GRANT is about.
+};
+
+// Wire order of its fields, see codec.h.
+static const struct codec_field cen_schema[] = {
+    CODEC_FIELD(CODEC_TYPE, struct cen_msg, type),
+    CODEC_FIELD(CODEC_UINT, struct cen_msg, nid),
+    CODEC_FIELD(CODEC_UINT, struct cen_msg, seq),
+};
+
+// Queue of nodes waiting for the lock, kept by the coordinator in FIFO order.
+struct qent {
+    int nid;
+    int seq;
+    struct qent *next;
+};
+
+// State of one instance.
+struct cen_ctx {
+    const struct dme_env *env;
+    int nid;
+    int ntot;
+    int coord;
+    l_state local;
+    int seq;     // Number of the latest local request.
+
+    // Coordinator state: current holder and the requesters waiting behind it.
+    int holder;
+    struct qent *cen_front, *cen_back;
+
+    // down[j] is set while node j is reported down. A coordinator that took
+    // over waits to have answered[] set for every node that is up (missing of them).
+    int *down;
+    int *answered;
+    int missing;
+
+    // Queue entries come from a pool so the handler does not malloc per message.
+    struct pool qent_pool;
+};
+
+static void send_msg(struct cen_ctx *c, struct cen_msg cmsg, int to) {
+    unsigned char wire[CODEC_FIELD_MAX * CODEC_FIELDS(cen_schema)];
+
+    c->env->send(c->env->arg, to, wire, codec_encode(cen_schema, CODEC_FIELDS(cen_schema), &cmsg, wire, sizeof(wire)));
+}
+
+// Reads the coordinator's node id from the environment, defaulting to node 1.
+static int coordinator(int ntot) {
+    char *env = getenv("DME_COORDINATOR");
+    int c = 1;
+
+    if (env != NULL)
+        c = atoi(env);
+    if (c < 1 || c > ntot) {
+        fprintf(stderr, "CENTRAL: invalid coordinator %d, using node 1\n", c);
+        c = 1;
+    }
+    return c;
+}
+
+static void queue_add(struct cen_ctx *c, int nid, int seq) {
+    struct qent *temp;
+
+    temp = (struct qent *) pool_alloc(&c->qent_pool);
+    temp->nid  = nid;
+    temp->seq  = seq;
+    temp->next = NULL;
+    if (c->cen_back == NULL)
+        c->cen_front = temp;
+    else
+        c->cen_back->next = temp;
+    c->cen_back = temp;
+}
+
+// Removes node nid from the queue, if it is there.
+static void queue_drop(struct cen_ctx *c, int nid) {
+    struct qent *temp, *prev;
+
+    for (prev = NULL, temp = c->cen_front; temp != NULL && temp->nid != nid; prev = temp, temp = temp->next) ;
+    if (temp == NULL)
+        return;
+    if (prev == NULL)
+        c->cen_front = temp->next;
+    else
+        prev->next = temp->next;
+    if (c->cen_back == temp)
+        c->cen_back = prev;
+    pool_free(&c->qent_pool, temp);
+}
+
+// The lock is free: GRANT it to the next node in line.
+static void grant_next(struct cen_ctx *c) {
+    struct cen_msg cmsg;
+    struct qent *temp;
+
+    if (c->coord != c->nid || c->holder != NULLnode || c->missing > 0 || c->cen_front == NULL)
+        return;
+    temp = c->cen_front;
+    c->cen_front = c->cen_front->next;
+    if (c->cen_front == NULL)
+        c->cen_back = NULL;
+    c->holder = temp->nid;
+    cmsg.nid  = c->holder;
+    cmsg.seq  = temp->seq;
+    cmsg.type = GRANT;
+    pool_free(&c->qent_pool, temp);
+
+    printf("CENTRAL: GRANT sent to %d\n", c->holder);
+    fflush(stdout);
+    send_msg(c, cmsg, c->holder);
+}
+
+static void cen_init(void *ctx, const struct dme_env *env, int nid, int ntot) {
+    struct cen_ctx *c = (struct cen_ctx *) ctx;
+
+    c->env       = env;
+    c->nid       = nid;
+    c->ntot      = ntot;
+    c->coord     = coordinator(ntot);
+    c->local     = L_IDLE;
+    c->seq       = 0;
+    c->holder    = NULLnode;
+    c->cen_front = NULL;
+    c->cen_back  = NULL;
+    c->missing   = 0;
+    c->down      = (int *) calloc(ntot + 1, sizeof(int));
+    c->answered  = (int *) calloc(ntot + 1, sizeof(int));
+    if (c->down == NULL || c->answered == NULL) {
+        perror("calloc failed :\n");
+        exit(1);
+    }
+    pool_init(&c->qent_pool, "qent", sizeof(struct qent), POOL_SLAB);
+    printf("Central algorithm started with %d nodes, coordinator is node %d\n", ntot, c->coord); // prints are for logging information
+    fflush(stdout);
+}
+
+static void cen_message(void *ctx, int from, const void *buf, unsigned int len) {
+    struct cen_ctx *c = (struct cen_ctx *) ctx;
+    struct cen_msg cmsg;
+
+    if (codec_decode(cen_schema, CODEC_FIELDS(cen_schema), &cmsg, buf, len) != 0) {
+        printf("CENTRAL: malformed message of %u bytes from %d, ignored\n", len, from);
+        fflush(stdout);
+        return;
+    }
+
+    if (c->down[cmsg.nid]) {
+        // Sent before the node went down.
+        printf("CENTRAL: message from %d, which is down, ignored\n", cmsg.nid);
+        fflush(stdout);
+        return;
+    }
+    // Answers to a coordinator that took over. They can arrive before this
+    // node hears that it is the coordinator, so they are counted anyway.
+    if (cmsg.type != GRANT && !c->answered[cmsg.nid]) {
+        c->answered[cmsg.nid] = 1;
+        if (c->missing > 0)
+            c->missing--;
+    }
+
+    switch(cmsg.type) {
+    case REQUEST:
+        // Only the coordinator receives REQUESTs.
+        printf("CENTRAL: REQUEST received from %d.\n", cmsg.nid);
+        fflush(stdout);
+        queue_add(c, cmsg.nid, cmsg.seq);
+        break;
+    case RELEASE:
+        // Holder is done, grant the lock to the next node in line.
+        // From a node still in the queue, it withdraws the request.
+        printf("CENTRAL: RELEASE received from %d.\n", cmsg.nid);
+        fflush(stdout);
+        if (c->holder == cmsg.nid)
+            c->holder = NULLnode;
+        else
+            queue_drop(c, cmsg.nid);
+        break;
+    case HELD:
+        printf("CENTRAL: node %d holds the lock.\n", cmsg.nid);
+        fflush(stdout);
+        c->holder = cmsg.nid;
+        break;
+    case IDLE:
+        break;
+    case GRANT:
+        if (from != c->coord || c->local != L_WAITING || cmsg.seq != c->seq) {
+            // From a coordinator that has since gone down, or for a withdrawn request.
+            printf("CENTRAL: GRANT from %d ignored\n", from);
+            fflush(stdout);
+            break;
+        }
+        // Let the process that asked for the lock run.
+        printf("CENTRAL: GRANT received, message sent to producer\n");
+        fflush(stdout);
+        c->local = L_HELD;
+        c->env->grant(c->env->arg);
+        break;
+    }
+    grant_next(c);
+}
+
+static void cen_acquire(void *ctx) {
+    struct cen_ctx *c = (struct cen_ctx *) ctx;
+    struct cen_msg cmsg;
+
+    cmsg.nid  = c->nid;
+    cmsg.seq  = ++c->seq;
+    cmsg.type = REQUEST;
+    c->local  = L_WAITING;
+    printf("CENTRAL: REQUEST sent to %d\n", c->coord);
+    fflush(stdout);
+    send_msg(c, cmsg, c->coord);
+}
+
+static void cen_release(void *ctx) {
+    struct cen_ctx *c = (struct cen_ctx *) ctx;
+    struct cen_msg cmsg;
+
+    cmsg.nid  = c->nid;
+    cmsg.seq  = c->seq;
+    cmsg.type = RELEASE;
+    c->local  = L_IDLE;
+    printf("CENTRAL: RELEASE sent to %d\n", c->coord);
+    fflush(stdout);
+    send_msg(c, cmsg, c->coord);
+}
+
+// The local request is withdrawn before it was granted. RELEASE does for it
+// what it does for a critical section that ran (see cen_message()).
+static void cen_cancel(void *ctx) {
+    printf("CENTRAL: request withdrawn\n");
+    fflush(stdout);
+    cen_release(ctx);
+}
+
+static void cen_fini(void *ctx) {
+    struct cen_ctx *c = (struct cen_ctx *) ctx;
+
+    pool_report(&c->qent_pool);
+    pool_destroy(&c->qent_pool);
+    free(c->down);
+    free(c->answered);
+}
+
+// Node nid crashed. If it was the coordinator, the next node up takes over and
+// every node reports to it, otherwise the coordinator forgets the node.
+static void cen_peer_down(void *ctx, int nid) {
+    struct cen_ctx *c = (struct cen_ctx *) ctx;
+    struct cen_msg cmsg;
+    int i;
+
+    printf("CENTRAL: node %d is down\n", nid);
+    fflush(stdout);
+    c->down[nid] = 1;
+
+    if (nid != c->coord) {
+        queue_drop(c, nid);
+        if (c->holder == nid)
+            c->holder = NULLnode;
+        if (c->missing > 0 && !c->answered[nid]) {
+            c->answered[nid] = 1;
+            c->missing--;
+        }
+        grant_next(c);
+        return;
+    }
+
+    for (c->coord = nid % c->ntot + 1; c->down[c->coord]; c->coord = c->coord % c->ntot + 1) ;
+    printf("CENTRAL: node %d is the coordinator now\n", c->coord);
+    fflush(stdout);
+    if (c->coord == c->nid) {
+        // Wait to hear from everyone, itself included.
+        c->missing = 0;
+        for (i = 1; i <= c->ntot; i++)
+            c->missing += !c->down[i] && !c->answered[i];
+    }
+
+    cmsg.nid  = c->nid;
+    cmsg.seq  = c->seq;
+    cmsg.type = c->local == L_WAITING ? REQUEST : c->local == L_HELD ? HELD : IDLE;
+    send_msg(c, cmsg, c->coord);
+}
+
+static void cen_peer_up(void *ctx, int nid) {
+    struct cen_ctx *c = (struct cen_ctx *) ctx;
+
+    printf("CENTRAL: node %d is up\n", nid);
+    fflush(stdout);
+    c->down[nid] = 0;
+}
+
+const struct dme_ops dme_ops = {
+    DME_ABI_V2,
+    "central",
+    sizeof(struct cen_ctx),
+    cen_init,
+    cen_message,
+    cen_acquire,
+    cen_release,
+    cen_fini,
+    cen_peer_down,
+    cen_peer_up,
+    cen_cancel,
+};
@@ -0,0 +1,161 @@
+#ifndef _CODEC
+#define _CODEC
+// Portable encoding of the algorithm libraries' messages.
+//
+// A library describes its message struct with a schema, one entry per field in
+// wire order, and codec_encode()/codec_decode() turn it into bytes and back:
+//     CODEC_TYPE  an enum, 1 byte
+//     CODEC_UINT  a non-negative int such as a node id, unsigned varint
+//     CODEC_INT   an int that may be negative such as a clock that can be
+//                 NULLtime, zigzag varint (0, -1, 1, -2, ... become 0, 1, 2, 3, ...)
+// Varints are those of frame.h, so the bytes are the same on every host, and
+// small values, which are most of them, take one byte.
+// Built with -DCODEC_CHECK (make check), every message encoded is decoded
+// again and compared with the original, and a mismatch aborts.
+// NOTE: Everything is static, like frame.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "frame.h"
+
+#define CODEC_TYPE 1
+#define CODEC_UINT 2
+#define CODEC_INT  3
+
+// Largest encoding of one field.
+#define CODEC_FIELD_MAX 5
+
+struct codec_field {
+    int kind;
+    size_t offset;     // Of the int in the message struct.
+};
+
+#define CODEC_FIELD(kind, type, member) { kind, offsetof(type, member) }
+#define CODEC_FIELDS(schema) ((int) (sizeof(schema) / sizeof(struct codec_field)))
+
+// A buffer being written or read. err is set once a write does not fit or a
+// read runs past the end, and everything after that does nothing.
+struct codec {
+    unsigned char *buf;
+    int pos;
+    int len;
+    int err;
+};
+
+static inline void codec_init(struct codec *c, void *buf, int len) {
+    c->buf = (unsigned char *) buf;
+    c->pos = 0;
+    c->len = len;
+    c->err = 0;
+}
+
+static inline void codec_put_u8(struct codec *c, int v) {
+    if (c->err || c->pos + 1 > c->len) {
+        c->err = 1;
+        return;
+    }
+    c->buf[c->pos++] = (unsigned char) v;
+}
+
+static inline void codec_put_uint(struct codec *c, unsigned int v) {
+    if (c->err || c->pos + CODEC_FIELD_MAX > c->len) {
+        c->err = 1;
+        return;
+    }
+    c->pos += varint_put(c->buf + c->pos, v);
+}
+
+static inline void codec_put_int(struct codec *c, int v) {
+    codec_put_uint(c, ((unsigned int) v << 1) ^ (unsigned int) (v >> 31));
+}
+
+static inline int codec_get_u8(struct codec *c) {
+    if (c->err || c->pos + 1 > c->len) {
+        c->err = 1;
+        return 0;
+    }
+    return c->buf[c->pos++];
+}
+
+static inline unsigned int codec_get_uint(struct codec *c) {
+    unsigned int v = 0;
+    int n;
+
+    if (c->err || (n = varint_get(c->buf + c->pos, c->len - c->pos, &v)) == 0) {
+        c->err = 1;
+        return 0;
+    }
+    c->pos += n;
+    return v;
+}
+
+static inline int codec_get_int(struct codec *c) {
+    unsigned int v = codec_get_uint(c);
+
+    return (int) (v >> 1) ^ -(int) (v & 1);
+}
+
+// Reads the schema's fields from msg into buf, which holds len bytes.
+// Returns the number of bytes used, or -1 if they do not fit.
+static inline int codec_decode(const struct codec_field *schema, int n, void *msg, const void *buf, int len);
+
+static inline int codec_encode(const struct codec_field *schema, int n, const void *msg, void *buf, int len) {
+    struct codec c;
+    int i, v;
+
+    codec_init(&c, buf, len);
+    for (i = 0; i < n; i++) {
+        memcpy(&v, (const char *) msg + schema[i].offset, sizeof(int));
+        switch (schema[i].kind) {
+        case CODEC_TYPE: codec_put_u8(&c, v); break;
+        case CODEC_UINT: codec_put_uint(&c, (unsigned int) v); break;
+        default:         codec_put_int(&c, v); break;
+        }
+    }
+    if (c.err)
+        return -1;
+#ifdef CODEC_CHECK
+    {
+        char back[256];
+        int w;
+
+        memset(back, 0, sizeof(back));
+        if (codec_decode(schema, n, back, buf, c.pos) != 0) {
+            fprintf(stderr, "CODEC: a message of %d bytes does not decode\n", c.pos);
+            abort();
+        }
+        for (i = 0; i < n; i++) {
+            memcpy(&v, (const char *) msg + schema[i].offset, sizeof(int));
+            memcpy(&w, back + schema[i].offset, sizeof(int));
+            if (v != w) {
+                fprintf(stderr, "CODEC: field %d encoded as %d decodes as %d\n", i, v, w);
+                abort();
+            }
+        }
+    }
+#endif
+    return c.pos;
+}
+
+// Fills in the schema's fields of msg from the len bytes at buf.
+// Returns 0, or -1 if buf is too short or has bytes left over.
+static inline int codec_decode(const struct codec_field *schema, int n, void *msg, const void *buf, int len) {
+    struct codec c;
+    int i, v;
+
+    codec_init(&c, (void *) buf, len);
+    for (i = 0; i < n; i++) {
+        switch (schema[i].kind) {
+        case CODEC_TYPE: v = codec_get_u8(&c); break;
+        case CODEC_UINT: v = (int) codec_get_uint(&c); break;
+        default:         v = codec_get_int(&c); break;
+        }
+        memcpy((char *) msg + schema[i].offset, &v, sizeof(int));
+    }
+    return c.err || c.pos != len ? -1 : 0;
+}
+
+#endif
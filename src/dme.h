@@ -3,23 +3,77 @@
 // This declares the functions needed to perform distributed mutual exclusion
 // The inner workings of these functions depend on the implementation (With general guidelines)
 // The one that will be used on compilation is dependent on link flags.
+// This is version 1 of the library interface, see dme_v2.h for version 2.
+
+#include <stddef.h>
+#include <string.h>
+
+#include "frame.h"
 
 // Message queue ID used by dme algorithm
 #define M_ID 2017
 
+// Key of the node's message queue: M_ID, unless DME_QUEUE_KEY gives another so
+// that several nodes can run on one host.
+static inline int dme_queue_key(void) {
+	char *env = getenv("DME_QUEUE_KEY");
+
+	return env != NULL ? atoi(env) : M_ID;
+}
+
 // Message type convention
 #define TO_DME 1
 #define TO_CON 2
 #define TO_SND 3
 
+// Largest payload carried inside a queue message, larger ones travel in a frame.
+#define MSG_INLINE 255
+
 // Message queue message definition
+// Payloads received from the network are always handed over by reference in ref,
+// so only the header goes through the queue; the handler must msg_release() them.
 typedef struct dme_message {
 	long type;            // TO_SNDR | TO_DME | TO_CONS
-	char size;            // Size of dme message
-	char network;         // Used by the dme thread to determine whether from local queue or from network.
-	char buf[255];        // Contains the dme data structure. NOTE: limited to 255 bytes. 
+	int network;          // TO_DME: sending node (0 if local). TO_SND: destination node (0 broadcasts).
+	unsigned int size;    // Size of dme message (up to FRAME_MAX)
+	struct frame *ref;    // Pooled frame holding the payload, or NULL if it is in buf.
+	char buf[MSG_INLINE]; // Contains the dme data structure when it fits.
 } MSG;
 
+// Returns the message's payload, wherever it is held.
+static inline char *msg_payload(MSG *m) {
+	return m->ref != NULL ? (char *) m->ref->data : m->buf;
+}
+
+// Returns a referenced payload to its pool once the handler is done with it.
+static inline void msg_release(MSG *m) {
+	if (m->ref != NULL)
+		frame_put(m->ref);
+	m->ref = NULL;
+}
+
+// Copies len bytes into the message, using a frame from pool p if they do not fit in buf.
+static inline void msg_attach(MSG *m, struct frame_pool *p, const void *data, unsigned int len) {
+	m->size = len;
+	m->ref  = NULL;
+	if (len > MSG_INLINE) {
+		if ((m->ref = frame_get(p, len)) == NULL) {
+			fprintf(stderr, "Message of %u bytes is too large\n", len);
+			exit(1);
+		}
+		memcpy(m->ref->data, data, len);
+	}
+	else
+		memcpy(m->buf, data, len);
+}
+
+// Number of bytes msgsnd() needs to copy for the message: the header and any inline payload.
+static inline size_t msg_size(MSG *m) {
+	if (m->ref != NULL)
+		return offsetof(MSG, buf) - sizeof(long);
+	return offsetof(MSG, buf) - sizeof(long) + (m->size > MSG_INLINE ? MSG_INLINE : m->size);
+}
+
 // This is the thread that is created by the node controller to process requests sent to the message queue.
 // First it initializes all of the global structures needed for its implemenetation. 
 // It then listens for messages from consumers (via dme_down and dme_up) or the node controller's receiver thread.
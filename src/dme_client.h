@@ -0,0 +1,134 @@
+#ifndef _DME_CLIENT
+#define _DME_CLIENT
+// Client side of the local messages of dme_v2.h, for a process asking the node
+// controller for the critical section of a v2 library.
+//
+// dme_down_async() sends the acquire and returns at once, so the round trips it
+// takes can overlap the work that prepares the critical section. Its handle is
+// then tested (dme_down_test), waited on (dme_down_wait) or cancelled
+// (dme_down_cancel). With a timeout the node controller withdraws the acquire
+// if it is not granted in time; dme_down_timed() and dme_try_down() wrap that.
+// System V message queues cannot be handed to poll(), so the handle is tested
+// rather than waited on with other descriptors.
+// One acquire at a time per node, and a granted one ends with dme_local_up().
+// NOTE: Everything is static, like frame.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/msg.h>
+
+#include "dme.h"
+#include "dme_v2.h"
+
+// States of an acquire.
+#define DME_PENDING   0
+#define DME_GRANTED   1
+#define DME_WITHDRAWN 2   // Timed out or cancelled before it was granted.
+
+struct dme_acquire {
+	int msqid;
+	int state;
+	struct dme_lease lease;   // Of a grant in lease mode, zeroes otherwise.
+};
+
+static int dme_client_queue(void) {
+	int msqid = msgget(dme_queue_key(), 0600);
+
+	if (msqid == -1) {
+		perror("msgget failed");
+		exit(1);
+	}
+	return msqid;
+}
+
+// Sends the node controller one of the local messages, with a timeout for an acquire.
+static void dme_local(int msqid, char what, int timeout_ms) {
+	MSG imsg;
+
+	imsg.type    = TO_DME;
+	imsg.network = 0;
+	imsg.ref     = NULL;
+	imsg.size    = 1;
+	imsg.buf[0]  = what;
+	if (what == DME_LOCAL_ACQUIRE && timeout_ms >= 0) {
+		memcpy(imsg.buf + 1, &timeout_ms, sizeof(int));
+		imsg.size += sizeof(int);
+	}
+	if (msgsnd(msqid, &imsg, msg_size(&imsg), 0) == -1) {
+		perror("Error on message send");
+		exit(1);
+	}
+}
+
+// Takes the node controller's answer off the queue, if there is one yet.
+static int dme_answer(struct dme_acquire *a, int flags) {
+	MSG imsg;
+
+	if (a->state != DME_PENDING)
+		return a->state;
+	if (msgrcv(a->msqid, &imsg, sizeof(MSG) - sizeof(long), TO_CON, flags) == -1) {
+		if (errno == ENOMSG || errno == EINTR)
+			return DME_PENDING;
+		perror("Error on message receive");
+		exit(1);
+	}
+	if (imsg.size == 1 && msg_payload(&imsg)[0] == DME_LOCAL_CANCEL)
+		a->state = DME_WITHDRAWN;
+	else {
+		a->state = DME_GRANTED;
+		if (imsg.size >= sizeof(struct dme_lease))
+			memcpy(&a->lease, msg_payload(&imsg), sizeof(struct dme_lease));
+	}
+	msg_release(&imsg);
+	return a->state;
+}
+
+// Asks for the critical section without waiting. A timeout_ms of 0 or more
+// has it withdrawn unless granted within that time (0: only if it can be
+// granted without waiting on other nodes), a negative one waits for ever.
+static void dme_down_async(struct dme_acquire *a, int timeout_ms) {
+	a->msqid = dme_client_queue();
+	a->state = DME_PENDING;
+	memset(&a->lease, 0, sizeof(struct dme_lease));
+	dme_local(a->msqid, DME_LOCAL_ACQUIRE, timeout_ms);
+}
+
+// Returns the state of the acquire without blocking.
+static int dme_down_test(struct dme_acquire *a) {
+	return dme_answer(a, IPC_NOWAIT);
+}
+
+// Blocks until the acquire is granted or withdrawn, and returns which.
+static int dme_down_wait(struct dme_acquire *a) {
+	while (dme_answer(a, 0) == DME_PENDING) ;
+	return a->state;
+}
+
+// Withdraws a pending acquire. The grant may win the race, so the result says
+// whether the critical section is held after all (DME_GRANTED) or not.
+static int dme_down_cancel(struct dme_acquire *a) {
+	if (dme_down_test(a) != DME_PENDING)
+		return a->state;
+	dme_local(a->msqid, DME_LOCAL_CANCEL, -1);
+	return dme_down_wait(a);
+}
+
+// Blocks at most timeout_ms for the critical section. Returns 1 once it is held.
+static int dme_down_timed(struct dme_acquire *a, int timeout_ms) {
+	dme_down_async(a, timeout_ms);
+	return dme_down_wait(a) == DME_GRANTED;
+}
+
+// Takes the critical section only if it is free for the asking.
+static int dme_try_down(struct dme_acquire *a) {
+	return dme_down_timed(a, 0);
+}
+
+// Leaves the critical section.
+static void dme_local_up(void) {
+	dme_local(dme_client_queue(), DME_LOCAL_RELEASE, -1);
+}
+
+#endif
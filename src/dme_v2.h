@@ -0,0 +1,85 @@
+#ifndef _DME_V2
+#define _DME_V2
+// Version 2 of the algorithm library interface.
+//
+// A v1 library (dme.h) owns a thread that blocks on the message queue and keeps
+// its state in globals, so there can be one instance per process.
+// A v2 library exports one dme_ops table instead. Its state lives in a context
+// the caller allocates (ctx_size bytes), and it only runs when the caller invokes
+// one of its entry points, so the caller decides how messages get delivered:
+// the node controller calls it from its receiver threads, and the simulator
+// (sim.c) runs many instances in one process without any queues.
+//
+// The node controller and producer look for the dme_ops symbol first and fall
+// back to dme_msg_handler, dme_down and dme_up, so v1 libraries keep working.
+
+#include <stddef.h>
+
+#define DME_ABI_V2 2
+
+// Name of the symbol a v2 library exports.
+#define DME_OPS_SYMBOL "dme_ops"
+
+// Payload of the local messages the producer sends to the node controller
+// for a v2 library (network 0, one byte). An acquire may be followed by an int
+// timeout in ms, after which the node controller withdraws it; 0 withdraws it
+// unless the library grants it straight away. A cancel withdraws the pending
+// acquire. Either way the producer gets exactly one answer on the queue: the
+// grant, or a one-byte DME_LOCAL_CANCEL if the acquire was withdrawn first
+// (see dme_client.h).
+#define DME_LOCAL_ACQUIRE 1
+#define DME_LOCAL_RELEASE 2
+#define DME_LOCAL_CANCEL  3
+
+// In delegation mode (DME_DELEGATE) the producer sends the node controller its
+// donut (donut.h) behind this byte instead of taking the lock, and gets the
+// buffer manager's int answer back once the combiner has written it.
+#define DME_LOCAL_DELEGATE 4
+
+// Payload of the grant the node controller sends the producer when it runs
+// with leases (DME_LEASE_MS). Without them the grant is empty.
+struct dme_lease {
+    unsigned int token;   // Fencing token, larger than that of any earlier holder.
+    long expires;         // Wall clock (ms) when the lock is taken back.
+};
+
+// Callbacks an instance uses to reach the outside world.
+// Neither may call back into the instance before it returns: messages sent to
+// the node itself are delivered later, like any other message.
+struct dme_env {
+    void *arg;    // Passed back to the callbacks.
+    // Sends len bytes to node to (0 broadcasts to every other node).
+    void (*send)(void *arg, int to, const void *buf, unsigned int len);
+    // The local acquire has been granted, the critical section may start.
+    void (*grant)(void *arg);
+};
+
+struct dme_ops {
+    int version;          // DME_ABI_V2
+    const char *name;     // Used in log messages.
+    size_t ctx_size;      // Bytes the caller allocates for each instance.
+
+    // Sets up the instance in ctx for node nid of ntot. The caller keeps env alive.
+    void (*init)(void *ctx, const struct dme_env *env, int nid, int ntot);
+    // A message of len bytes arrived from node from (nid itself for loopback).
+    void (*on_message)(void *ctx, int from, const void *buf, unsigned int len);
+    // The local process wants the critical section, env->grant() says when it has it.
+    void (*on_local_acquire)(void *ctx);
+    // The local process left the critical section.
+    void (*on_local_release)(void *ctx);
+    // Frees what init allocated. ctx itself belongs to the caller.
+    void (*fini)(void *ctx);
+
+    // The failure detector suspects node nid has crashed, or hears from it
+    // again. Either may be NULL if the library cannot cope with failures.
+    void (*on_peer_down)(void *ctx, int nid);
+    void (*on_peer_up)(void *ctx, int nid);
+
+    // The local process no longer wants the critical section it asked for and
+    // has not been granted: its request is withdrawn from the other nodes.
+    // May be NULL, then the caller lets the request run its course and
+    // releases the critical section as soon as it is granted.
+    void (*on_local_cancel)(void *ctx);
+};
+
+#endif
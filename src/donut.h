@@ -0,0 +1,88 @@
+#ifndef _DONUT
+#define _DONUT
+// What the producer writes to the buffer manager inside the critical section:
+// one donut per connection, answered with the buffer index it went to, or -1
+// if its fencing token is stale. Shared by prod, bm and the node controller,
+// which writes donuts for the producers in delegation mode (DME_DELEGATE).
+//
+// With DME_BM_SHARDS the buffer manager serves that many shards, shard s on
+// port bm_port() + s. A donut goes to the shard its key (node and number)
+// hashes to, or to DME_SHARD when that is set, for a node whose lock guards
+// one shard only.
+// NOTE: Everything is static, like frame.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#define BM_PORT 1992
+
+// Assuming buffer manager container hostname.
+// DME_BM_HOST and DME_BM_PORT override it and BM_PORT.
+#define BM_HOST "dme_bm"
+
+struct msg {
+	int node_id;
+	int donut_number;
+	unsigned int token;  // Fencing token of the writer's lease, 0 without one.
+};
+
+static int bm_port(void) {
+	return getenv("DME_BM_PORT") != NULL ? atoi(getenv("DME_BM_PORT")) : BM_PORT;
+}
+
+// Shard a donut goes to.
+static int bm_shard(struct msg *donut) {
+	char *env = getenv("DME_BM_SHARDS");
+	int n = env != NULL ? atoi(env) : 1;
+	unsigned int key;
+
+	if (n <= 1)
+		return 0;
+	if ((env = getenv("DME_SHARD")) != NULL && *env != '\0')
+		return atoi(env) % n;
+	// Knuth's multiplicative hash, so consecutive donuts spread out.
+	key = (unsigned int) donut->node_id * 65599u + (unsigned int) donut->donut_number;
+	return (key * 2654435761u >> 16) % n;
+}
+
+// Points addr, filled in by bm_addr(), at the shard of donut.
+static void bm_route(struct sockaddr_in *addr, struct msg *donut) {
+	addr->sin_port = htons(bm_port() + bm_shard(donut));
+}
+
+// Fills in the buffer manager's address. Returns 0 if its host is unknown.
+static int bm_addr(struct sockaddr_in *addr) {
+	struct hostent *server;
+
+	server = gethostbyname(getenv("DME_BM_HOST") != NULL ? getenv("DME_BM_HOST") : BM_HOST);
+	if (server == NULL)
+		return 0;
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	memcpy(&addr->sin_addr.s_addr, server->h_addr, server->h_length);
+	addr->sin_port = htons(bm_port());
+	return 1;
+}
+
+// Writes one donut on a connection of its own to its shard and returns the
+// answer. Returns -2 if the buffer manager cannot be reached.
+static int bm_put(struct sockaddr_in *addr, struct msg *donut) {
+	int fd, num;
+
+	bm_route(addr, donut);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -2;
+	if (connect(fd, (struct sockaddr *) addr, sizeof(struct sockaddr_in)) < 0 ||
+	    write(fd, donut, sizeof(struct msg)) != sizeof(struct msg) ||
+	    read(fd, &num, sizeof(int)) != sizeof(int))
+		num = -2;
+	close(fd);
+	return num;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef _FLOW
+#define _FLOW
+// Queues of frames between the node controller's threads, one per flow, such
+// as the frames for one peer on their way to its sender thread.
+//
+// flow_push() never blocks, so the thread running the library never waits on
+// a full queue, which could wait in turn on the threads that feed the library.
+// A flow's capacity is kept by those threads instead: they take no more input,
+// such as frames from a socket, while a flow is at capacity, and flow_pop()
+// says when it drops below (see the node controller). The deepest a flow has
+// been, and how many times it filled up to capacity, show how close to the limit
+// it runs.
+// NOTE: Everything is static, like frame.h.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "frame.h"
+
+struct flow_item {
+    int type;                 // Frame type (see frame.h).
+    unsigned int len;         // Bytes of payload in ref.
+    struct frame *ref;        // NULL for an empty frame.
+};
+
+struct flow {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;     // Signalled when a frame is pushed.
+    struct flow_item *items;  // Ring of size slots, grown when full.
+    int size, head, depth;
+    int cap;                  // Capacity.
+    int high;                 // High-water mark of depth.
+    long pushed, full;        // Frames pushed, and times one took it up to capacity.
+};
+// depth, high, pushed and full are written with relaxed atomic stores under
+// the lock, so they can be read for metrics without it.
+
+static inline void flow_init(struct flow *f, int cap) {
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->ready, NULL);
+    f->size  = 64;
+    f->head  = f->depth = f->high = 0;
+    f->cap   = cap;
+    f->pushed = f->full = 0;
+    if ((f->items = (struct flow_item *) malloc(f->size * sizeof(struct flow_item))) == NULL) {
+        fprintf(stderr, "Flow of %d frames cannot be allocated\n", cap);
+        exit(1);
+    }
+}
+
+// Appends a frame. Returns 1 if it took the flow up to its capacity, 0 otherwise.
+static inline int flow_push(struct flow *f, int type, struct frame *ref, unsigned int len) {
+    struct flow_item *items;
+    int i, crossed;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->depth == f->size) {
+        // Unwrap the ring into storage twice the size.
+        if ((items = (struct flow_item *) malloc(2 * f->size * sizeof(struct flow_item))) == NULL) {
+            fprintf(stderr, "Flow of %d frames cannot grow\n", f->depth);
+            exit(1);
+        }
+        for (i = 0; i < f->depth; i++)
+            items[i] = f->items[(f->head + i) % f->size];
+        free(f->items);
+        f->items = items;
+        f->head  = 0;
+        f->size *= 2;
+    }
+    i = (f->head + f->depth) % f->size;
+    f->items[i].type = type;
+    f->items[i].ref  = ref;
+    f->items[i].len  = len;
+    __atomic_store_n(&f->depth, f->depth + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->pushed, f->pushed + 1, __ATOMIC_RELAXED);
+    crossed = f->depth == f->cap;
+    if (crossed)
+        __atomic_store_n(&f->full, f->full + 1, __ATOMIC_RELAXED);
+    if (f->depth > f->high)
+        __atomic_store_n(&f->high, f->depth, __ATOMIC_RELAXED);
+    pthread_cond_signal(&f->ready);
+    pthread_mutex_unlock(&f->lock);
+    return crossed;
+}
+
+// Takes the oldest frame, waiting for one if the flow is empty. Returns 1 if
+// that took the flow below its capacity, 0 otherwise.
+static inline int flow_pop(struct flow *f, struct flow_item *it) {
+    int below;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->depth == 0)
+        pthread_cond_wait(&f->ready, &f->lock);
+    *it = f->items[f->head];
+    f->head = (f->head + 1) % f->size;
+    __atomic_store_n(&f->depth, f->depth - 1, __ATOMIC_RELAXED);
+    below = f->depth == f->cap - 1;
+    pthread_mutex_unlock(&f->lock);
+    return below;
+}
+
+#endif
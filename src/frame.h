@@ -0,0 +1,147 @@
+#ifndef _FRAME
+#define _FRAME
+// Framing used between node controllers, and the pooled buffers that carry
+// frame payloads through the message queue by reference.
+//
+// A frame on the wire is:
+//     length (varint) | type (1 byte) | destination (varint) | payload (length bytes)
+// Varints are base-128, least significant group first, with the high bit set
+// on every byte but the last. The destination is 0 for a broadcast.
+//
+// Pools are shared by threads of one process: whoever takes a frame with
+// frame_get() may hand it to another thread, which returns it with frame_put().
+// NOTE: Everything is static so each algorithm library gets its own copy,
+//       frames remember which pool they belong to.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// Largest payload a frame may carry.
+#define FRAME_MAX     65536
+// Largest header: two 5-byte varints and the type.
+#define FRAME_HDR_MAX 11
+
+// Frame types
+#define FRAME_DME 1           // Message for the dme algorithm.
+#define FRAME_HEARTBEAT 2     // Empty, tells the failure detector the sender is alive.
+#define FRAME_FENCED 3        // FRAME_DME whose payload starts with a varint fencing token.
+#define FRAME_DELEGATE 4      // A donut for the combiner to write (delegation mode).
+#define FRAME_RESULT 5        // The buffer manager's answer to a delegated donut.
+#define FRAME_SWAP 6          // Empty, the sender's later frames are for the library it swapped to.
+#define FRAME_DONE 7          // Varint generation the sender will not take the lock under again.
+
+// Frames up to this size come from the small free list, larger ones hold FRAME_MAX.
+#define FRAME_SMALL   512
+
+struct frame_pool;
+
+struct frame {
+    struct frame *next;       // Free list link.
+    struct frame_pool *pool;  // Pool the frame goes back to.
+    unsigned int cap;         // Bytes available in data.
+    unsigned char data[];
+};
+
+struct frame_pool {
+    pthread_mutex_t lock;
+    struct frame *small;      // Free small frames.
+    struct frame *large;      // Free large frames.
+    int out;                  // Frames currently handed out.
+    int high;                 // High-water mark of out.
+};
+
+#define FRAME_POOL_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0 }
+
+// Takes a frame that can hold len bytes, reusing a free one when possible.
+static inline struct frame *frame_get(struct frame_pool *p, unsigned int len) {
+    struct frame **list;
+    struct frame *f;
+    unsigned int cap;
+
+    if (len > FRAME_MAX)
+        return NULL;
+    if (len <= FRAME_SMALL) {
+        list = &p->small;
+        cap  = FRAME_SMALL;
+    }
+    else {
+        list = &p->large;
+        cap  = FRAME_MAX;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    f = *list;
+    if (f != NULL)
+        *list = f->next;
+    if (++p->out > p->high)
+        p->high = p->out;
+    pthread_mutex_unlock(&p->lock);
+
+    if (f == NULL) {
+        f = (struct frame *) malloc(sizeof(struct frame) + cap);
+        if (f == NULL) {
+            perror("frame malloc failed :\n");
+            exit(1);
+        }
+        f->pool = p;
+        f->cap  = cap;
+    }
+    f->next = NULL;
+    return f;
+}
+
+// Returns a frame to the pool it came from.
+static inline void frame_put(struct frame *f) {
+    struct frame_pool *p = f->pool;
+
+    pthread_mutex_lock(&p->lock);
+    if (f->cap == FRAME_SMALL) {
+        f->next  = p->small;
+        p->small = f;
+    }
+    else {
+        f->next  = p->large;
+        p->large = f;
+    }
+    p->out--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Writes v as a varint, returns the number of bytes used (at most 5).
+static inline int varint_put(unsigned char *buf, unsigned int v) {
+    int n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (unsigned char) v;
+    return n;
+}
+
+// Reads a varint from the len bytes at buf. Returns the number of bytes used,
+// or 0 if buf ends before the varint does (or it is longer than 5 bytes).
+static inline int varint_get(const unsigned char *buf, int len, unsigned int *v) {
+    int n;
+
+    *v = 0;
+    for (n = 0; n < len && n < 5; n++) {
+        *v |= (unsigned int) (buf[n] & 0x7F) << (7 * n);
+        if (!(buf[n] & 0x80))
+            return n + 1;
+    }
+    return 0;
+}
+
+// Builds a frame header, returns its length.
+static inline int frame_header(unsigned char *hdr, unsigned int len, int type, unsigned int dest) {
+    int n = 0;
+
+    n += varint_put(hdr + n, len);
+    hdr[n++] = (unsigned char) type;
+    n += varint_put(hdr + n, dest);
+    return n;
+}
+
+#endif
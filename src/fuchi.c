@@ -5,37 +5,24 @@
 /*           "An Improved sqrt(N) Algorithm for Mutual Exclusion in           */
 /*            Decentralized Systems" (Fuchi, 1992).                           */
 /*                                                                            */
+/*           When a node is reported down, the lowest numbered node that is   */
+/*           up asks every other one whether it has the token (PROBE). If     */
+/*           none has, it makes a new one. Tokens carry a generation, and a   */
+/*           node that has answered a PROBE drops tokens of older generations */
+/*           that were still on their way, so two tokens never coexist.       */
+/*                                                                            */
+/*           Built against the v2 interface (see dme_v2.h).                   */
+/*                                                                            */
 /******************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
-#include <sys/msg.h>
-#include <netinet/in.h>
-
-#include "dme.h"
-
-// The voting set must have the following properties:
-// 1. All node's sets have a non-null intersection (optimally of size 1). 
-// 2. Node i's set always contains i.
-// 3. The size of i's set is K, for any i.
-// 4. All nodes apear in an equal number of sets. 
-// NOTE: Ideally this should be automated, but are currently pre-computed.
-int voting_set[8][8][3] = {{{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of zero nodes
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of one node
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of two nodes
-                           {{0,0,0},{1,2,0},{2,3,0},{1,3,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of three nodes
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of four nodes
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of five nodes
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of six nodes
-                           {{0,0,0},{1,2,3},{2,4,6},{3,5,6},{1,4,5},{2,5,7},{1,6,7},{3,4,7}}, // Set of seven nodes
-                       };
-int voting_set_size[] = { 0, 1, 2,
-              2,        // Set of three nodes
-              4, 5, 6,
-              3,        // Set of seven nodes
-              8, 9, 10, 11, 12,
-              4 };        // Set of thirteen nodes
+
+#include "dme_v2.h"
+#include "frame.h"
+#include "codec.h"
+#include "quorum.h"
 
 /******************************************************************************/
 /*                                                                            */
@@ -44,9 +31,6 @@ int voting_set_size[] = { 0, 1, 2,
 /*                                                                            */
 /******************************************************************************/
 
-// Maximum number of nodes
-#define N 8
-
 // A number which is not a node number.
 #define NULLnode -1
 
@@ -59,20 +43,20 @@ struct Node {
     int number;          // non-redundant number indicating node id
     int timeStamp;       // time stamp of node
     int *member;         // Members of node
-    int requestTimes[N]; // Time of node requesting exclusion
-    int finishTimes[N];  // Finish exclusion time of another node
+    int *requestTimes;   // Time of node requesting exclusion
+    int *finishTimes;    // Finish exclusion time of another node
     int waitNode;        // sender of finish exclusion message
     int waitTime;        // time the finish exclusion is received
     int oldestStamp;     // anti-starvation time stamp
     int haveToken;       // holding situation of token (0 or 1)
-} myNode;
+};
 
 // Form of exclusion request messages
 struct Request {
     int timeStamp;       // Time stamp of message
     int sender;          // Number on the sender of message
-    int requestTimes[N]; // Time of node requesting exclusion
-    int finishTimes[N];  // Finish exclusion time of another node
+    int *requestTimes;   // Time of node requesting exclusion
+    int *finishTimes;    // Finish exclusion time of another node
     int oldestStamp;     // anti-starvation time stamp
 };
 
@@ -80,69 +64,276 @@ struct Request {
 struct Finish {
     int timeStamp;      // Time stamp message
     int sender;         // number on the sender of message
-    int finishTimes[N]; // finish exclusion time of another node
+    int *finishTimes;   // finish exclusion time of another node
 };
 
 // Form of token representing exclusion privilege
 struct Token {
     int timeStamp;       // time stamp of token
-    int requestTimes[N]; // time of node requesting exclusion
-    int finishTimes[N];  // finish exclusion time of another node
-} keepToken;
+    int *requestTimes;   // time of node requesting exclusion
+    int *finishTimes;    // finish exclusion time of another node
+};
 
 /******************************************************************************/
 
-// Data structures used by dme_msg_handler
+// Data structures used by the handler
 // Types of messages that can be received
 typedef enum { REQUEST,
                TOKEN,
                FINISH,
-               LOCAL_REQUEST,
-               LOCAL_FINISH     } m_type;
+               PROBE,           // Is the token here? (from the lowest node up)
+               ANSWER,          // Reply to PROBE.
+               LOST       } m_type;  // The last token sent went to a node now down.
 
 // Message holds type and one of three structures.
+// The vectors of all three point at the same scratch arrays (see msg_init()).
+// gen is the token generation of TOKEN, PROBE and ANSWER. An ANSWER also says
+// whether the node has the token, when it asked for it (or NULLtime) and when
+// it last finished, which a dropped token may have been the only one to know.
 struct fuchi_msg {
     m_type type;
-    union msg {
+    struct {
     struct Request request;
     struct Finish  finish;
     struct Token   token;
     } msg; 
+    int gen;
+    int have;
+    int asked;
+    int done;
 };
 
+/******************************************************************************/
+/*                                                                            */
+/* Wire encoding. Messages do not carry whole vectors: each vector is sent as */
+/* the (index, time) pairs that changed since the last message exchanged with */
+/* that peer. Links are FIFO, so both ends keep the same baseline per peer:   */
+/* sentReq[p]/sentFin[p] on the sender and recvReq[p]/recvFin[p] on the       */
+/* receiver. Frames are                                                       */
+/*     type, sender, timeStamp, [oldestStamp], [requestTimes], finishTimes    */
+/* where a vector is a count followed by that many index/time pairs. TOKEN    */
+/* adds the sender's generation, and PROBE and ANSWER carry only sender and   */
+/* gen (and ANSWER have, asked and done). LOST carries only the sender.       */
+/* The type is one byte, node ids, counts, indexes, gen and have are unsigned */
+/* varints and times are zigzag varints (see codec.h).                        */
+/*                                                                            */
+/******************************************************************************/
 
-// Helper function to send message to specified node.
-static void send_msg(int msqid, struct fuchi_msg mmsg, int to) {
-    MSG imsg;
-
-    // If destination is local node, place directly in that queue.
-    if (myNode.number == to)
-        imsg.type = TO_DME;
-    else
-        imsg.type = TO_SND;
-    imsg.network = to;
-    memcpy(&imsg.buf, &(mmsg), sizeof(struct fuchi_msg));
-    imsg.size = sizeof(struct fuchi_msg);
-
-    if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-        perror("Error on message send\n");
+// State of one instance.
+struct fuchi_ctx {
+    const struct dme_env *env;
+
+    // Length of the node-indexed vectors (number of nodes + 1, entry 0 unused).
+    int N;
+    int M;               // Size of this node's voting set.
+
+    // The voting set must have the following properties:
+    // 1. All node's sets have a non-null intersection (optimally of size 1). 
+    // 2. Node i's set always contains i.
+    // 3. The size of i's set is K, for any i.
+    // 4. All nodes apear in an equal number of sets. 
+    // They are generated when the handler starts (see quorum_maekawa() in quorum.h).
+    // myNode.member is this node's own set unless one of its members is down.
+    struct quorum vote;
+
+    // down[j] is set while node j is reported down.
+    int *down;
+    int inCS;            // Set while the local process runs the critical section.
+
+    // Token recovery. gen is the newest token generation seen. The node running
+    // a PROBE waits for an ANSWER from every node that is up (missing of them).
+    int gen;
+    int lastTo;          // Where this node last sent the token.
+    int probing;
+    int found;
+    int missing;
+    int *answered;
+
+    struct Node myNode;
+    struct Token keepToken;
+
+    int **sentReq, **sentFin;
+    int **recvReq, **recvFin;
+    int *msgReq, *msgFin;   // Scratch vectors for the message being handled.
+    struct fuchi_msg mmsg;  // The message being handled.
+
+    // Messages are encoded into wire before they are sent (FRAME_MAX bytes).
+    char *wire;
+};
+
+static int *vector_alloc(struct fuchi_ctx *f) {
+    int *v = (int *) malloc(sizeof(int) * f->N);
+    int i;
+
+    if (v == NULL) {
+        perror("malloc failed :\n");
+        exit(1);
+    }
+    for (i = 0; i < f->N; i++)
+        v[i] = NULLtime;
+    return v;
+}
+
+static int **baseline_alloc(struct fuchi_ctx *f) {
+    int **b = (int **) malloc(sizeof(int *) * f->N);
+    int i;
+
+    if (b == NULL) {
+        perror("malloc failed :\n");
+        exit(1);
+    }
+    for (i = 0; i < f->N; i++)
+        b[i] = vector_alloc(f);
+    return b;
+}
+
+// Points the message's vectors at the scratch arrays.
+static void msg_init(struct fuchi_ctx *f, struct fuchi_msg *mmsg) {
+    mmsg->msg.request.requestTimes = f->msgReq;
+    mmsg->msg.request.finishTimes  = f->msgFin;
+    mmsg->msg.finish.finishTimes   = f->msgFin;
+    mmsg->msg.token.requestTimes   = f->msgReq;
+    mmsg->msg.token.finishTimes    = f->msgFin;
+}
+
+// Writes the entries of v that differ from the baseline, then updates the baseline.
+static void put_vector(struct fuchi_ctx *f, struct codec *c, int *v, int *base) {
+    int i, n = 0;
+
+    for (i = 0; i < f->N; i++)
+        if (v[i] != base[i])
+            n++;
+    codec_put_uint(c, n);
+    for (i = 0; i < f->N; i++) {
+        if (v[i] == base[i])
+            continue;
+        codec_put_uint(c, i);
+        codec_put_int(c, v[i]);
+        base[i] = v[i];
+    }
+}
+
+// Applies the pairs read to the baseline and copies the result to v.
+static void get_vector(struct fuchi_ctx *f, struct codec *c, int *v, int *base) {
+    int i, n = codec_get_uint(c);
+
+    while (n-- > 0 && !c->err) {
+        i = codec_get_uint(c);
+        if (i >= f->N) {
+            c->err = 1;
+            break;
+        }
+        base[i] = codec_get_int(c);
+    }
+    memcpy(v, base, sizeof(int) * f->N);
+}
+
+static int encode_msg(struct fuchi_ctx *f, struct fuchi_msg *mmsg, int to, char *buf) {
+    struct codec c;
+
+    codec_init(&c, buf, FRAME_MAX);
+    codec_put_u8(&c, mmsg->type);
+    codec_put_uint(&c, f->myNode.number);
+    switch (mmsg->type) {
+    case REQUEST:
+        codec_put_int(&c, mmsg->msg.request.timeStamp);
+        codec_put_int(&c, mmsg->msg.request.oldestStamp);
+        put_vector(f, &c, mmsg->msg.request.requestTimes, f->sentReq[to]);
+        put_vector(f, &c, mmsg->msg.request.finishTimes, f->sentFin[to]);
+        break;
+    case TOKEN:
+        codec_put_int(&c, mmsg->msg.token.timeStamp);
+        codec_put_uint(&c, f->gen);
+        put_vector(f, &c, mmsg->msg.token.requestTimes, f->sentReq[to]);
+        put_vector(f, &c, mmsg->msg.token.finishTimes, f->sentFin[to]);
+        break;
+    case FINISH:
+        codec_put_int(&c, mmsg->msg.finish.timeStamp);
+        put_vector(f, &c, mmsg->msg.finish.finishTimes, f->sentFin[to]);
+        break;
+    case PROBE:
+        codec_put_uint(&c, f->gen);
+        break;
+    case ANSWER:
+        codec_put_uint(&c, f->gen);
+        codec_put_uint(&c, mmsg->have);
+        codec_put_int(&c, mmsg->asked);
+        codec_put_int(&c, mmsg->done);
+        break;
+    default:
+        break;
+    }
+    if (c.err) {
+        fprintf(stderr, "FUCHI: message does not fit in a frame\n");
         exit(1);
     }
+    return c.pos;
+}
+
+// Returns the sender, or NULLnode if the message is malformed.
+static int decode_msg(struct fuchi_ctx *f, const char *buf, unsigned int len, struct fuchi_msg *mmsg) {
+    struct codec c;
+    int from;
+
+    codec_init(&c, (void *) buf, len);
+    msg_init(f, mmsg);
+    mmsg->type = codec_get_u8(&c);
+    from = codec_get_uint(&c);
+    if (c.err || from <= 0 || from >= f->N)
+        return NULLnode;
+    switch (mmsg->type) {
+    case REQUEST:
+        mmsg->msg.request.sender      = from;
+        mmsg->msg.request.timeStamp   = codec_get_int(&c);
+        mmsg->msg.request.oldestStamp = codec_get_int(&c);
+        get_vector(f, &c, f->msgReq, f->recvReq[from]);
+        get_vector(f, &c, f->msgFin, f->recvFin[from]);
+        break;
+    case TOKEN:
+        mmsg->msg.token.timeStamp = codec_get_int(&c);
+        mmsg->gen = codec_get_uint(&c);
+        get_vector(f, &c, f->msgReq, f->recvReq[from]);
+        get_vector(f, &c, f->msgFin, f->recvFin[from]);
+        break;
+    case FINISH:
+        mmsg->msg.finish.sender    = from;
+        mmsg->msg.finish.timeStamp = codec_get_int(&c);
+        get_vector(f, &c, f->msgFin, f->recvFin[from]);
+        break;
+    case PROBE:
+        mmsg->gen = codec_get_uint(&c);
+        break;
+    case ANSWER:
+        mmsg->gen   = codec_get_uint(&c);
+        mmsg->have  = codec_get_uint(&c);
+        mmsg->asked = codec_get_int(&c);
+        mmsg->done  = codec_get_int(&c);
+        break;
+    default:
+        break;
+    }
+    return c.err || c.pos != (int) len ? NULLnode : from;
+}
+
+// Helper function to send message to specified node.
+static void send_msg(struct fuchi_ctx *f, struct fuchi_msg mmsg, int to) {
+    f->env->send(f->env->arg, to, f->wire, encode_msg(f, &mmsg, to, f->wire));
 }
 
 // Function which returns the affixed number of eht element having the minimum
 // value (except NULLtime) in the reference array. However, if all the values
 // are Nulltime, then NULLnode is returned.
-static int searchOldestRequest() {
+static int searchOldestRequest(struct fuchi_ctx *f) {
     int i;
     int lowtime = NULLtime;
     int lownode = NULLnode;
-    for (i = 0; i < N; i++) {
-        if (myNode.requestTimes[i] == NULLtime)
+    for (i = 0; i < f->N; i++) {
+        // A node that is down would take the token with it.
+        if (f->myNode.requestTimes[i] == NULLtime || (i > 0 && f->down[i]))
             continue;
-        if (lownode == NULLnode || myNode.requestTimes[i] < lowtime) {
+        if (lownode == NULLnode || f->myNode.requestTimes[i] < lowtime) {
             lownode = i;
-            lowtime = myNode.requestTimes[i];
+            lowtime = f->myNode.requestTimes[i];
         }
     }
 
@@ -157,391 +348,599 @@ static int max(int a, int b) {
     return b;
 }
 
-void *dme_msg_handler(void *arg) {
-    int nid  = *((int *) arg);      // nid contains the node id.
-    int ntot = *(((int *) arg)+1);  // Total number of nodes. 
-    int msqid = msgget(M_ID, 0600); // msqid contains the message queue id.
-    MSG imsg;
-    struct fuchi_msg mmsg;
+// Prints the node's state, for debugging.
+static void dump_state(struct fuchi_ctx *f) {
+    int i;
+
+    printf("FUCHI: Current state information:\n");
+    printf("\tmyNode.number : %d \n", f->myNode.number);
+    printf("\tmyNode.timeStamp: %d\n", f->myNode.timeStamp);
+    printf("\tmyNode.members:\n");
+    for (i = 0; i < f->M; i++) printf("\t\t%d\n", f->myNode.member[i]);
+    printf("\tmyNode.requestTimes:\n");
+    for (i = 0; i < f->N; i++) printf("\t\t%d\n", f->myNode.requestTimes[i]);
+    printf("\tmyNode.finishTimes:\n");
+    for (i = 0; i < f->N; i++) printf("\t\t%d\n", f->myNode.finishTimes[i]);
+    printf("myNode.waitNode: %d\n", f->myNode.waitNode);
+    printf("myNode.waitTime: %d\n", f->myNode.waitTime);
+    printf("myNode.oldestStamp: %d\n", f->myNode.oldestStamp);
+    printf("myNode.haveToken: %d\n", f->myNode.haveToken);
+    printf("FUCHI: End current state information\n");
+    fflush(stdout);
+}
 
-    int M = voting_set_size[ntot];
-            
+// Sends the local request to the voting set.
+static void send_request(struct fuchi_ctx *f) {
+    struct fuchi_msg *mmsg = &f->mmsg;
     struct Request *request;
+    int i;
+
+    request = &mmsg->msg.request;
+    request->timeStamp = f->myNode.timeStamp;
+    request->sender = f->myNode.number;
+    request->oldestStamp = f->myNode.oldestStamp;
+    for (i=0; i<f->N; i++) request->requestTimes[i] = f->myNode.requestTimes[i];
+    for (i=0; i<f->N; i++) request->finishTimes[i]  = f->myNode.finishTimes[i];
+    // Send REQUEST to voting set.
+    mmsg->type = REQUEST;
+    for (i = 0; i < f->M; i++) {
+        printf("FUCHI: REQUEST sent to %d\n", f->myNode.member[i]);
+        fflush(stdout);
+        send_msg(f, *mmsg, f->myNode.member[i]);
+    }
+}
+
+// Hands the token kept here to the oldest request, or keeps it and tells the
+// voting set where it is.
+static void pass_token(struct fuchi_ctx *f) {
+    struct fuchi_msg *mmsg = &f->mmsg;
     struct Token *token;
     struct Finish *finish;
     int i;
     int nextNode;
 
-    if (msqid == -1) {
-        perror("msgget failed :\n");
-        exit(1);
+    token = &f->keepToken;
+    finish = &mmsg->msg.finish;
+    for (i = 0; i < f->N; i++)
+        token->requestTimes[i] = f->myNode.requestTimes[i];
+    for (i = 0; i < f->N; i++)
+        token->finishTimes[i] = f->myNode.finishTimes[i];
+    /* Searching the oldest exclusion request */
+    nextNode = searchOldestRequest(f);
+    f->myNode.timeStamp++;
+    /* The case where there is an exclusion request */
+    if (nextNode != NULLnode) {
+        f->myNode.oldestStamp = f->myNode.requestTimes[nextNode];
+        token->timeStamp = f->myNode.timeStamp;
+
+        mmsg->msg.token = f->keepToken;
+        
+        mmsg->type = TOKEN;
+        printf("FUCHI: TOKEN sent to %d\n", nextNode);
+        fflush(stdout);
+        send_msg(f, *mmsg, nextNode);
+        f->lastTo = nextNode;
     }
+    /* The case where there is no exclusion request */
+    else {
+        finish->timeStamp = f->myNode.timeStamp;
+        finish->sender = f->myNode.number;
+        for (i = 0; i < f->N; i++)
+            finish->finishTimes[i] = f->myNode.finishTimes[i];
+        f->myNode.oldestStamp = NULLtime;
+        f->myNode.waitNode = NULLnode;
+        f->myNode.waitTime = NULLtime;
+        f->myNode.haveToken = 1;
+        
+        mmsg->type = FINISH;
+        for (i = 0; i < f->M; i++) {
+            printf("FUCHI: FINISH sent to %d\n", f->myNode.member[i]);
+            fflush(stdout);
+            send_msg(f, *mmsg, f->myNode.member[i]);
+        }
+    }
+}
+
+// Chooses the voting set, avoiding nodes that are down. The token keeps the
+// exclusion, the sets only carry requests to it, so when every set has a node
+// that is down, all the nodes that are up will do.
+static void pick_members(struct fuchi_ctx *f) {
+    int i, n = quorum_pick(&f->vote, f->myNode.number, f->down, f->myNode.member);
+
+    if (n == 0) {
+        printf("FUCHI: every voting set has a node that is down, using all\n");
+        fflush(stdout);
+        for (i = 1; i < f->N; i++)
+            if (!f->down[i])
+                f->myNode.member[n++] = i;
+    }
+    f->M = n;
+}
+
+// Every node that is up has answered the PROBE. If none has the token, this
+// node makes one of the current generation and acts as if it had just left
+// the critical section, or enters it if its own request is the oldest.
+static void end_probe(struct fuchi_ctx *f) {
+    f->probing = 0;
+    if (f->found) {
+        printf("FUCHI: token of generation %d is still around\n", f->gen);
+        fflush(stdout);
+        return;
+    }
+    printf("FUCHI: token lost, generation %d made here\n", f->gen);
+    fflush(stdout);
+    f->keepToken.timeStamp = f->myNode.timeStamp;
+    if (searchOldestRequest(f) == f->myNode.number) {
+        printf("FUCHI: message sent to producer\n");
+        fflush(stdout);
+        f->inCS = 1;
+        f->env->grant(f->env->arg);
+        return;
+    }
+    pass_token(f);
+}
+
+// Asks every node that is up whether it has the token, with a new generation.
+// Only the lowest numbered node that is up does this, and not while it has the token.
+static void start_probe(struct fuchi_ctx *f) {
+    struct fuchi_msg *mmsg = &f->mmsg;
+    int i;
+
+    for (i = 1; f->down[i]; i++) ;
+    if (i != f->myNode.number || f->myNode.haveToken || f->inCS) {
+        f->probing = 0;
+        return;
+    }
+    f->gen++;
+    f->probing = 1;
+    f->found   = 0;
+    f->missing = 0;
+    mmsg->type = PROBE;
+    for (i = 1; i < f->N; i++) {
+        f->answered[i] = i == f->myNode.number || f->down[i];
+        if (f->answered[i])
+            continue;
+        f->missing++;
+        printf("FUCHI: PROBE sent to %d\n", i);
+        fflush(stdout);
+        send_msg(f, *mmsg, i);
+    }
+    if (f->missing == 0)
+        end_probe(f);
+}
+
+static void fuchi_init(void *ctx, const struct dme_env *env, int nid, int ntot) {
+    struct fuchi_ctx *f = (struct fuchi_ctx *) ctx;
+    struct fuchi_msg *mmsg = &f->mmsg;
+    struct Finish *finish;
+    int i;
 
     // prints are for logging information
     printf("Fuchi algorithm started with %d nodes\n", ntot); 
     fflush(stdout);
+
+    f->env = env;
+    f->N = ntot + 1;
+    quorum_report(&f->vote, quorum_maekawa(&f->vote, ntot));
+    if (!quorum_check(&f->vote)) {
+        fprintf(stderr, "FUCHI: no valid voting sets for %d nodes\n", ntot);
+        exit(1);
+    }
+    f->M = f->vote.size[nid];
+    f->down     = (int *) calloc(f->N, sizeof(int));
+    f->answered = (int *) calloc(f->N, sizeof(int));
+    f->myNode.member = (int *) malloc(sizeof(int) * ntot);
+    if (f->down == NULL || f->answered == NULL || f->myNode.member == NULL) {
+        perror("malloc failed :\n");
+        exit(1);
+    }
+    memcpy(f->myNode.member, f->vote.set[nid], sizeof(int) * f->M);
+    f->inCS    = 0;
+    f->gen     = 0;
+    f->lastTo  = NULLnode;
+    f->probing = 0;
+
+    f->myNode.requestTimes = vector_alloc(f);
+    f->myNode.finishTimes  = vector_alloc(f);
+    f->keepToken.requestTimes = vector_alloc(f);
+    f->keepToken.finishTimes  = vector_alloc(f);
+    f->msgReq  = vector_alloc(f);
+    f->msgFin  = vector_alloc(f);
+    f->sentReq = baseline_alloc(f);
+    f->sentFin = baseline_alloc(f);
+    f->recvReq = baseline_alloc(f);
+    f->recvFin = baseline_alloc(f);
+    if ((f->wire = (char *) malloc(FRAME_MAX)) == NULL) {
+        perror("malloc failed :\n");
+        exit(1);
+    }
+    msg_init(f, mmsg);
    
-    myNode.number = nid;
-    myNode.timeStamp = 0;
-    myNode.member = (int *) &voting_set[ntot][nid];
-    for (i = 0; i < N; i++) {
-        myNode.requestTimes[i] = NULLtime;
-        myNode.finishTimes[i] = NULLtime;
+    f->myNode.number = nid;
+    f->myNode.timeStamp = 0;
+    for (i = 0; i < f->N; i++) {
+        f->myNode.requestTimes[i] = NULLtime;
+        f->myNode.finishTimes[i] = NULLtime;
     }
-    myNode.waitNode = NULLnode;
-    myNode.waitTime = NULLtime;
-    myNode.oldestStamp = NULLtime;
-    myNode.haveToken = 0;
+    f->myNode.waitNode = NULLnode;
+    f->myNode.waitTime = NULLtime;
+    f->myNode.oldestStamp = NULLtime;
+    f->myNode.haveToken = 0;
     if (nid == 1) {
         /* Initialize token */
-        myNode.haveToken = 1;
-        keepToken.timeStamp = 0;
-        for (i = 0; i < N; i++) {
-            keepToken.requestTimes[i] = NULLtime;
-            keepToken.finishTimes[i] = NULLtime;
+        f->myNode.haveToken = 1;
+        f->keepToken.timeStamp = 0;
+        for (i = 0; i < f->N; i++) {
+            f->keepToken.requestTimes[i] = NULLtime;
+            f->keepToken.finishTimes[i] = NULLtime;
         }
         /* Send finishes to members of 1's voting set. */
-        finish = &mmsg.msg.finish;
+        finish = &mmsg->msg.finish;
         finish->timeStamp = 0;
         finish->sender = nid;
-        for (i = 0; i < N; i++) finish->finishTimes[i] = NULLtime; 
+        for (i = 0; i < f->N; i++) finish->finishTimes[i] = NULLtime; 
 
-        mmsg.type = FINISH;
-        for (i = 0; i < M; i++) {
-            printf("FUCHI: FINISH sent to %d\n", myNode.member[i]);
+        mmsg->type = FINISH;
+        for (i = 0; i < f->M; i++) {
+            printf("FUCHI: FINISH sent to %d\n", f->myNode.member[i]);
             fflush(stdout);
-            send_msg(msqid, mmsg, myNode.member[i]);
+            send_msg(f, *mmsg, f->myNode.member[i]);
         }
     }
+}
 
- 
-    for (;;) {
-
-
-        printf("FUCHI: Current state information:\n");
-        printf("\tmyNode.number : %d \n", myNode.number);
-        printf("\tmyNode.timeStamp: %d\n", myNode.timeStamp);
-        printf("\tmyNode.members:\n");
-        for (i = 0; i < M; i++) printf("\t\t%d\n", myNode.member[i]);
-        printf("\tmyNode.requestTimes:\n");
-        for (i = 0; i < N; i++) printf("\t\t%d\n", myNode.requestTimes[i]);
-        printf("\tmyNode.finishTimes:\n");
-        for (i = 0; i < N; i++) printf("\t\t%d\n", myNode.finishTimes[i]);
-        printf("myNode.waitNode: %d\n", myNode.waitNode);
-        printf("myNode.waitTime: %d\n", myNode.waitTime);
-        printf("myNode.oldestStamp: %d\n", myNode.oldestStamp);
-        printf("myNode.haveToken: %d\n", myNode.haveToken);
-        printf("FUCHI: End current state information\n");
+static void fuchi_message(void *ctx, int from, const void *buf, unsigned int len) {
+    struct fuchi_ctx *f = (struct fuchi_ctx *) ctx;
+    struct fuchi_msg *mmsg = &f->mmsg;
+    struct Request *request;
+    struct Token *token;
+    struct Finish *finish;
+    int i;
+    int nextNode, sender;
+
+    dump_state(f);
+    sender = decode_msg(f, (const char *) buf, len, mmsg);
+    if (sender == NULLnode) {
+        printf("FUCHI: malformed message of %u bytes from %d, ignored\n", len, from);
         fflush(stdout);
+        return;
+    }
 
-        
-        // Receiving next message
-        if (msgrcv(msqid, &imsg, sizeof(MSG), TO_DME, 0) == -1) {
-            perror("msgrcv failed :\n");
-            exit(1);
-        }
-        
-        printf("FUCHI: Message queue message received!\n");
+    // A TOKEN from a node that went down was handed over before it did,
+    // anything else it sent is out of date.
+    if (f->down[sender] && mmsg->type != TOKEN) {
+        printf("FUCHI: message from %d, which is down, ignored\n", sender);
         fflush(stdout);
-    
-        memcpy(&mmsg, &imsg.buf, sizeof(struct fuchi_msg));
+        return;
+    }
         
-        switch(mmsg.type) {
-        case REQUEST:
-	    printf("FUCHI: REQUEST received!\n");
-	    fflush(stdout);
-            /* Exclusion request receiving procedure */
-            request = &mmsg.msg.request;
-            /* Updating time stamp */
-            myNode.timeStamp = max(myNode.timeStamp, request->timeStamp);
-            /* Updating finish exclusion information */
-            for (i = 0; i < N; i++)
-                myNode.finishTimes[i] = max(myNode.finishTimes[i], request->finishTimes[i]);
-            /* Masking */
-            for (i = 0; i < N; i++) {
-                if (myNode.requestTimes[i] <= myNode.finishTimes[i])
-                    myNode.requestTimes[i] = NULLtime;
-                if (request->requestTimes[i] <= myNode.finishTimes[i])
-                    request->requestTimes[i] = NULLtime;
-            }
-            /* Updating exclusion request time information */
-            for (i = 0; i<N; i++)
-                myNode.requestTimes[i] = max(myNode.requestTimes[i], request->requestTimes[i]);
-            /* Processing for the case of waiting for finish message */
-            if (myNode.waitNode != NULLnode && searchOldestRequest(myNode.requestTimes) != NULLnode) {
-                /* If there is exclusion request */
-                if (myNode.waitTime > myNode.finishTimes[myNode.waitNode]) {
-                    /* If effective */
-                    myNode.timeStamp++;
-                    request->timeStamp = myNode.timeStamp;
-                    for (i = 0; i < N; i ++) request->requestTimes[i] = myNode.requestTimes[i];
-                    for (i = 0; i < N; i ++) request->finishTimes[i] = myNode.finishTimes[i];
-                    
-                    printf("FUCHI: REQUEST sent to %d\n", myNode.waitNode);
-                    fflush(stdout);
-                    send_msg(msqid, mmsg, myNode.waitNode);
-                }
-                myNode.waitNode = NULLnode;
-                myNode.waitTime = NULLtime;
-            }
-            /* Processing anti-starvation time stamp */
-            for (i = 0; i < N; i++) {
-                if (request->oldestStamp == NULLtime || request->sender == myNode.number)
-                    break;
-                if (request->oldestStamp >= myNode.requestTimes[i]) {
-                    myNode.timeStamp++;
-                    request->timeStamp = myNode.timeStamp;
-                    for (i = 0; i < N; i++) request->requestTimes[i] = myNode.requestTimes[i];
-                    for (i = 0; i < N; i++) request->finishTimes[i] = myNode.finishTimes[i];
-                    
-                    printf("FUCHI: (anti-starvation) REQUEST sent to %d\n", request->sender);
-                    fflush(stdout);
-                    send_msg(msqid, mmsg, request->sender);
-                    break;
-                }
+    switch(mmsg->type) {
+    case REQUEST:
+    printf("FUCHI: REQUEST received!\n");
+    fflush(stdout);
+        /* Exclusion request receiving procedure */
+        request = &mmsg->msg.request;
+        /* Updating time stamp */
+        f->myNode.timeStamp = max(f->myNode.timeStamp, request->timeStamp);
+        /* Updating finish exclusion information */
+        for (i = 0; i < f->N; i++)
+            f->myNode.finishTimes[i] = max(f->myNode.finishTimes[i], request->finishTimes[i]);
+        /* Masking */
+        for (i = 0; i < f->N; i++) {
+            if (f->myNode.requestTimes[i] <= f->myNode.finishTimes[i])
+                f->myNode.requestTimes[i] = NULLtime;
+            if (request->requestTimes[i] <= f->myNode.finishTimes[i])
+                request->requestTimes[i] = NULLtime;
+        }
+        /* Updating exclusion request time information */
+        for (i = 0; i<f->N; i++)
+            f->myNode.requestTimes[i] = max(f->myNode.requestTimes[i], request->requestTimes[i]);
+        /* Processing for the case of waiting for finish message */
+        if (f->myNode.waitNode != NULLnode && searchOldestRequest(f) != NULLnode) {
+            /* If there is exclusion request */
+            if (f->myNode.waitTime > f->myNode.finishTimes[f->myNode.waitNode]) {
+                /* If effective */
+                f->myNode.timeStamp++;
+                request->timeStamp = f->myNode.timeStamp;
+                for (i = 0; i < f->N; i ++) request->requestTimes[i] = f->myNode.requestTimes[i];
+                for (i = 0; i < f->N; i ++) request->finishTimes[i] = f->myNode.finishTimes[i];
+                
+                printf("FUCHI: REQUEST sent to %d\n", f->myNode.waitNode);
+                fflush(stdout);
+                send_msg(f, *mmsg, f->myNode.waitNode);
             }
-            /* If token is held */
-            if (myNode.haveToken) {
-                nextNode = searchOldestRequest(myNode.requestTimes);
-                if (nextNode != NULLnode) {
-                    myNode.timeStamp++;
-                    myNode.oldestStamp = myNode.requestTimes[nextNode];
-                    myNode.waitNode = NULLnode;
-                    myNode.waitTime = NULLtime;
-                    myNode.haveToken = 0;
-                    for (i = 0; i < N; i++) keepToken.requestTimes[i] = myNode.requestTimes[i];
-                    for (i = 0; i < N; i++) keepToken.finishTimes[i] = myNode.finishTimes[i];
-                    keepToken.timeStamp = myNode.timeStamp;
-                    
-                    mmsg.msg.token = keepToken;
-                    mmsg.type = TOKEN;
-                    
-                    printf("FUCHI: TOKEN sent to %d\n", nextNode);
-                    fflush(stdout);
-                    send_msg(msqid, mmsg, nextNode);
-                }
+            f->myNode.waitNode = NULLnode;
+            f->myNode.waitTime = NULLtime;
+        }
+        /* Processing anti-starvation time stamp */
+        for (i = 0; i < f->N; i++) {
+            if (request->oldestStamp == NULLtime || request->sender == f->myNode.number)
+                break;
+            if (f->myNode.requestTimes[i] != NULLtime && request->oldestStamp >= f->myNode.requestTimes[i]) {
+                f->myNode.timeStamp++;
+                request->timeStamp = f->myNode.timeStamp;
+                for (i = 0; i < f->N; i++) request->requestTimes[i] = f->myNode.requestTimes[i];
+                for (i = 0; i < f->N; i++) request->finishTimes[i] = f->myNode.finishTimes[i];
+                // This only passes on what we know, it must not be answered in turn.
+                request->oldestStamp = NULLtime;
+                
+                printf("FUCHI: (anti-starvation) REQUEST sent to %d\n", request->sender);
+                fflush(stdout);
+                send_msg(f, *mmsg, request->sender);
+                break;
             }
-            break;
-        case TOKEN:
-	    printf("FUCHI: TOKEN received!\n");
-	    fflush(stdout);
-            /* Token receiving procedure */
-            token = &mmsg.msg.token;
-            finish = &mmsg.msg.finish;
-            /* Updating time stamp */
-            myNode.timeStamp = max(myNode.timeStamp, token->timeStamp);
-            /* Updating finish exclusion information */
-            for (i = 0; i < N; i++) myNode.finishTimes[i] = max(myNode.finishTimes[i], token->finishTimes[i]); 
-            /* Masking */
-            for (i = 0; i < N; i++) {
-                if (myNode.requestTimes[i] <= myNode.finishTimes[i])
-                    myNode.requestTimes[i] = NULLtime;
-                if (token->requestTimes[i] <= myNode.finishTimes[i])
-                    token->requestTimes[i] = NULLtime;
+        }
+        /* If token is held */
+        if (f->myNode.haveToken) {
+            nextNode = searchOldestRequest(f);
+            if (nextNode != NULLnode) {
+                f->myNode.timeStamp++;
+                f->myNode.oldestStamp = f->myNode.requestTimes[nextNode];
+                f->myNode.waitNode = NULLnode;
+                f->myNode.waitTime = NULLtime;
+                f->myNode.haveToken = 0;
+                for (i = 0; i < f->N; i++) f->keepToken.requestTimes[i] = f->myNode.requestTimes[i];
+                for (i = 0; i < f->N; i++) f->keepToken.finishTimes[i] = f->myNode.finishTimes[i];
+                f->keepToken.timeStamp = f->myNode.timeStamp;
+                
+                mmsg->msg.token = f->keepToken;
+                mmsg->type = TOKEN;
+                
+                printf("FUCHI: TOKEN sent to %d\n", nextNode);
+                fflush(stdout);
+                send_msg(f, *mmsg, nextNode);
+                f->lastTo = nextNode;
             }
-            /* Updating exclusion request time information */
-            for (i = 0; i < N; i++)
-                myNode.requestTimes[i] = max(myNode.requestTimes[i], token->requestTimes[i]);
-            
-            /* Storing token locally */
-            keepToken = *token;
-            
-            /* Critical Section */
-            // Send process that called dme_down a message.
-            memcpy(&imsg.buf, &mmsg, sizeof(struct fuchi_msg));
-            imsg.size = sizeof(struct fuchi_msg);
-            imsg.type = TO_CON;
-            printf("FUCHI: message sent to producer\n");
+        }
+        break;
+    case TOKEN:
+    printf("FUCHI: TOKEN received!\n");
+    fflush(stdout);
+        if (mmsg->gen < f->gen) {
+            // Made before a PROBE this node answered, a newer one replaced it.
+            printf("FUCHI: TOKEN of generation %d dropped, %d is current\n", mmsg->gen, f->gen);
             fflush(stdout);
-            if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-                perror("Error on message send\n");
-                exit(1);
-            }	
             break;
-        case FINISH:
-	    printf("FUCHI: FINISH received!\n");
-	    fflush(stdout);
-            /* Finish exclusion procedure */
-            finish = &mmsg.msg.finish;
-            /* Updating time stamp */
-            myNode.timeStamp= max(myNode.timeStamp, finish->timeStamp);
-            /* Updating finish exclusion information */
-            for (i = 0; i < N; i++)
-                myNode.finishTimes[i] = max(myNode.finishTimes[i], finish->finishTimes[i]);
-            /* Masking */
-            for (i = 0; i < N; i++)
-                if (myNode.requestTimes[i] <= myNode.finishTimes[i])
-                    myNode.requestTimes[i] = NULLtime;
-            if (finish->timeStamp > myNode.finishTimes[finish->sender]) {
-                /* Case of effective finish message */
-                if (searchOldestRequest(myNode.requestTimes) != NULLnode) {
-                    /* If there is exclusion request */
-                    /* Forwarding exclusion request */
-                    myNode.timeStamp++;
-                    nextNode = finish->sender;
-                    request = &mmsg.msg.request;
-                    request->timeStamp = myNode.timeStamp;
-                    request->sender = myNode.number;
-                    for (i = 0; i < N; i++) {
-                        request->requestTimes[i] = myNode.requestTimes[i];
-                        request->finishTimes[i] = myNode.finishTimes[i];
-                    }
-                    request->oldestStamp = NULLtime;
-
-                    mmsg.type = REQUEST;
-                    printf("FUCHI: REQUEST sent to %d\n", nextNode);
-                    fflush(stdout);
-                    send_msg(msqid, mmsg, nextNode);
-
-                    if (myNode.waitTime <= myNode.finishTimes[myNode.waitNode]) {
-                        myNode.waitNode = NULLnode;
-                        myNode.waitTime = NULLtime;
-                    }
-                }
-                else {
-                    /* If there is no exclusion request */
-                    /* go into waiting state */
-                    myNode.waitNode = finish->sender;
-                    myNode.waitTime = finish->timeStamp;
-                }
-            }
-            break;
-        case LOCAL_REQUEST:
-	    printf("FUCHI: LOCAL_REQUEST received!\n");
-	    fflush(stdout);
-            request = &mmsg.msg.request;
-            if (myNode.haveToken) {
-                // Turning haveToken off so that it doesn't get sent out while running c.s.
-                // LOCAL_FINISH will turn it back on if there are no other requests.
-                myNode.haveToken = 0;
-				// Send process that called dme_down a message.
-				memcpy(&imsg.buf, &mmsg, sizeof(struct fuchi_msg));
-				imsg.size = sizeof(struct fuchi_msg);
-				imsg.type = TO_CON;
-                printf("FUCHI: message sent to producer\n");
-                fflush(stdout);
-				if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-					perror("Error on message send\n");
-					exit(1);
-				}	
-            }
-            else {
-                myNode.timeStamp++;
-                mmsg.msg.request.timeStamp = myNode.timeStamp;
-                myNode.requestTimes[myNode.number] = myNode.timeStamp;
-                request->sender = myNode.number;
-                request->oldestStamp = myNode.oldestStamp;
-                for (i=0; i<N; i++) request->requestTimes[i] = myNode.requestTimes[i];
-                for (i=0; i<N; i++) request->finishTimes[i]  = myNode.finishTimes[i];
-                // Send REQUEST to voting set.
-                mmsg.type = REQUEST;
-                for (i = 0; i < M; i++) {
-                    printf("FUCHI: REQUEST sent to %d\n", myNode.member[i]);
-                    fflush(stdout);
-                    send_msg(msqid, mmsg, myNode.member[i]);
+        }
+        f->gen = mmsg->gen;
+        /* Token receiving procedure */
+        token = &mmsg->msg.token;
+        finish = &mmsg->msg.finish;
+        /* Updating time stamp */
+        f->myNode.timeStamp = max(f->myNode.timeStamp, token->timeStamp);
+        /* Updating finish exclusion information */
+        for (i = 0; i < f->N; i++) f->myNode.finishTimes[i] = max(f->myNode.finishTimes[i], token->finishTimes[i]); 
+        /* Masking */
+        for (i = 0; i < f->N; i++) {
+            if (f->myNode.requestTimes[i] <= f->myNode.finishTimes[i])
+                f->myNode.requestTimes[i] = NULLtime;
+            if (token->requestTimes[i] <= f->myNode.finishTimes[i])
+                token->requestTimes[i] = NULLtime;
+        }
+        /* Updating exclusion request time information */
+        for (i = 0; i < f->N; i++)
+            f->myNode.requestTimes[i] = max(f->myNode.requestTimes[i], token->requestTimes[i]);
+        
+        /* Storing token locally */
+        f->keepToken.timeStamp = token->timeStamp;
+        memcpy(f->keepToken.requestTimes, token->requestTimes, sizeof(int) * f->N);
+        memcpy(f->keepToken.finishTimes, token->finishTimes, sizeof(int) * f->N);
+        
+        /* Critical Section */
+        // Let the process that called dme_down run.
+        printf("FUCHI: message sent to producer\n");
+        fflush(stdout);
+        f->inCS = 1;
+        f->env->grant(f->env->arg);
+        break;
+    case FINISH:
+    printf("FUCHI: FINISH received!\n");
+    fflush(stdout);
+        /* Finish exclusion procedure */
+        finish = &mmsg->msg.finish;
+        /* Updating time stamp */
+        f->myNode.timeStamp= max(f->myNode.timeStamp, finish->timeStamp);
+        /* Updating finish exclusion information */
+        for (i = 0; i < f->N; i++)
+            f->myNode.finishTimes[i] = max(f->myNode.finishTimes[i], finish->finishTimes[i]);
+        /* Masking */
+        for (i = 0; i < f->N; i++)
+            if (f->myNode.requestTimes[i] <= f->myNode.finishTimes[i])
+                f->myNode.requestTimes[i] = NULLtime;
+        if (finish->timeStamp > f->myNode.finishTimes[finish->sender]) {
+            /* Case of effective finish message */
+            if (searchOldestRequest(f) != NULLnode) {
+                /* If there is exclusion request */
+                /* Forwarding exclusion request */
+                f->myNode.timeStamp++;
+                nextNode = finish->sender;
+                request = &mmsg->msg.request;
+                request->timeStamp = f->myNode.timeStamp;
+                request->sender = f->myNode.number;
+                for (i = 0; i < f->N; i++) {
+                    request->requestTimes[i] = f->myNode.requestTimes[i];
+                    request->finishTimes[i] = f->myNode.finishTimes[i];
                 }
-            }
-            break;
-        case LOCAL_FINISH:
-	    printf("FUCHI: LOCAL_FINISH received!\n");
-	    fflush(stdout);
-            token = &keepToken;
-            finish = &mmsg.msg.finish;
-            
-            myNode.requestTimes[myNode.number] = NULLtime;
-            myNode.finishTimes[myNode.number] = myNode.timeStamp;
-            for (i = 0; i < N; i++)
-                token->requestTimes[i] = myNode.requestTimes[i];
-            for (i = 0; i < N; i++)
-                token->finishTimes[i] = myNode.finishTimes[i];
-            /* Searching the oldest exclusion request */
-            nextNode = searchOldestRequest(myNode.requestTimes);
-            myNode.timeStamp++;
-            /* The case where there is an exclusion request */
-            if (nextNode != NULLnode) {
-                myNode.oldestStamp = myNode.requestTimes[nextNode];
-                token->timeStamp = myNode.timeStamp;
+                request->oldestStamp = NULLtime;
 
-                mmsg.msg.token = keepToken;
-                
-                mmsg.type = TOKEN;
-                printf("FUCHI: TOKEN sent to %d\n", nextNode);
+                mmsg->type = REQUEST;
+                printf("FUCHI: REQUEST sent to %d\n", nextNode);
                 fflush(stdout);
-                send_msg(msqid, mmsg, nextNode);
+                send_msg(f, *mmsg, nextNode);
+
+                if (f->myNode.waitTime <= f->myNode.finishTimes[f->myNode.waitNode]) {
+                    f->myNode.waitNode = NULLnode;
+                    f->myNode.waitTime = NULLtime;
+                }
             }
-            /* The case where there is no exclusion request */
             else {
-                finish->timeStamp = myNode.timeStamp;
-                finish->sender = myNode.number;
-                for (i = 0; i < N; i++)
-                    finish->finishTimes[i] = myNode.finishTimes[i];
-                myNode.oldestStamp = NULLtime;
-                myNode.waitNode = NULLnode;
-                myNode.waitTime = NULLtime;
-                myNode.haveToken = 1;
-                
-                mmsg.type = FINISH;
-                for (i = 0; i < M; i++) {
-                    printf("FUCHI: FINISH sent to %d\n", myNode.member[i]);
-                    fflush(stdout);
-                    send_msg(msqid, mmsg, myNode.member[i]);
-                }
+                /* If there is no exclusion request */
+                /* go into waiting state */
+                f->myNode.waitNode = finish->sender;
+                f->myNode.waitTime = finish->timeStamp;
             }
+        }
+        break;
+    case PROBE:
+        printf("FUCHI: PROBE received from %d!\n", sender);
+        fflush(stdout);
+        // From now on older tokens are dropped.
+        f->gen = max(f->gen, mmsg->gen);
+        if (f->probing && sender < f->myNode.number)
+            f->probing = 0;
+        mmsg->type  = ANSWER;
+        mmsg->have  = f->myNode.haveToken || f->inCS;
+        mmsg->asked = f->myNode.requestTimes[f->myNode.number];
+        mmsg->done  = f->myNode.finishTimes[f->myNode.number];
+        send_msg(f, *mmsg, sender);
+        break;
+    case ANSWER:
+        printf("FUCHI: ANSWER received from %d!\n", sender);
+        fflush(stdout);
+        if (!f->probing || mmsg->gen < f->gen || f->answered[sender])
+            break;
+        if (mmsg->gen > f->gen) {
+            // It answered a newer PROBE, outbid it.
+            f->gen = mmsg->gen;
+            start_probe(f);
             break;
         }
+        f->answered[sender] = 1;
+        f->missing--;
+        if (mmsg->have)
+            f->found = 1;
+        // Its request may only have reached nodes that are down, and a
+        // request it already had served may look pending here.
+        f->myNode.finishTimes[sender] = max(f->myNode.finishTimes[sender], mmsg->done);
+        if (f->myNode.requestTimes[sender] <= f->myNode.finishTimes[sender])
+            f->myNode.requestTimes[sender] = NULLtime;
+        if (mmsg->asked > f->myNode.finishTimes[sender])
+            f->myNode.requestTimes[sender] = max(f->myNode.requestTimes[sender], mmsg->asked);
+        if (f->missing == 0)
+            end_probe(f);
+        break;
+    case LOST:
+        printf("FUCHI: LOST received from %d!\n", sender);
+        fflush(stdout);
+        // The token may have been found before it went, look again.
+        start_probe(f);
+        break;
     }
 }
 
-void dme_down() { 
-    int msqid = msgget(M_ID, 0600);
-    MSG imsg;
-    struct fuchi_msg mmsg;
+static void fuchi_acquire(void *ctx) {
+    struct fuchi_ctx *f = (struct fuchi_ctx *) ctx;
 
-    if (msqid == -1) {
-        perror("msgget failed :\n");
-        exit(1);
+    dump_state(f);
+    printf("FUCHI: LOCAL_REQUEST received!\n");
+    fflush(stdout);
+    if (f->myNode.haveToken) {
+        // Turning haveToken off so that it doesn't get sent out while running c.s.
+        // LOCAL_FINISH will turn it back on if there are no other requests.
+        f->myNode.haveToken = 0;
+        // Let the process that called dme_down run.
+        printf("FUCHI: message sent to producer\n");
+        fflush(stdout);
+        f->inCS = 1;
+        f->env->grant(f->env->arg);
     }
-    
-    mmsg.type = LOCAL_REQUEST;
-
-    memcpy(&imsg.buf, &mmsg, sizeof(struct fuchi_msg));
+    else {
+        f->myNode.timeStamp++;
+        f->myNode.requestTimes[f->myNode.number] = f->myNode.timeStamp;
+        send_request(f);
+    }
+}
 
-    // Place REQUEST in message queue, block until ready.
-    imsg.size = sizeof(struct fuchi_msg);
-    imsg.type = TO_DME;
-    if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-        perror("Error on message send\n");
-        exit(1);
-    }    
+static void fuchi_release(void *ctx) {
+    struct fuchi_ctx *f = (struct fuchi_ctx *) ctx;
 
-    // Wait to hear back from handler to start critical section. 
-    if (msgrcv(msqid, &imsg, sizeof(MSG), TO_CON, 0) == -1) {
-        perror("Error on message receive\n");
-        exit(1);
-    }    
+    dump_state(f);
+    printf("FUCHI: LOCAL_FINISH received!\n");
+    fflush(stdout);
+    f->inCS = 0;
+    f->myNode.requestTimes[f->myNode.number] = NULLtime;
+    f->myNode.finishTimes[f->myNode.number] = f->myNode.timeStamp;
+    pass_token(f);
 }
 
-void dme_up() {
-    // Tell handler critical section is complete
-    // This will allow it to send replies. 
-    int msqid = msgget(M_ID, 0600);
-    MSG imsg;
-    struct fuchi_msg mmsg;
+static void fuchi_fini(void *ctx) {
+    struct fuchi_ctx *f = (struct fuchi_ctx *) ctx;
+    int i;
 
-    if (msqid == -1) {
-        perror("msgget failed :\n");
-        exit(1);
+    for (i = 0; i < f->N; i++) {
+        free(f->sentReq[i]);
+        free(f->sentFin[i]);
+        free(f->recvReq[i]);
+        free(f->recvFin[i]);
     }
-    
-    mmsg.type = LOCAL_FINISH;
+    free(f->sentReq);
+    free(f->sentFin);
+    free(f->recvReq);
+    free(f->recvFin);
+    free(f->myNode.requestTimes);
+    free(f->myNode.finishTimes);
+    free(f->keepToken.requestTimes);
+    free(f->keepToken.finishTimes);
+    free(f->msgReq);
+    free(f->msgFin);
+    free(f->wire);
+    free(f->down);
+    free(f->answered);
+    free(f->myNode.member);
+    quorum_free(&f->vote);
+}
 
-    memcpy(&imsg.buf, &mmsg, sizeof(struct fuchi_msg));
+// Node nid crashed. A request that went through it is sent again to a voting
+// set without it, and the token is looked for in case it went down with it.
+static void fuchi_peer_down(void *ctx, int nid) {
+    struct fuchi_ctx *f = (struct fuchi_ctx *) ctx;
+    int i;
 
-    // Place RELEASE in message queue, block until ready.
-    imsg.size = sizeof(struct fuchi_msg);
-    imsg.type = TO_DME;
-    if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-        perror("Error on message send\n");
-        exit(1);
+    printf("FUCHI: node %d is down\n", nid);
+    fflush(stdout);
+    f->down[nid] = 1;
+    pick_members(f);
+    if (f->myNode.waitNode == nid) {
+        f->myNode.waitNode = NULLnode;
+        f->myNode.waitTime = NULLtime;
+    }
+    if (f->myNode.requestTimes[f->myNode.number] != NULLtime && !f->inCS) {
+        f->myNode.timeStamp++;
+        send_request(f);
+    }
+    // The node running the PROBE may have been told earlier and found the
+    // token here, before it was sent to the node that is down.
+    if (f->lastTo == nid) {
+        f->lastTo = NULLnode;
+        for (i = 1; f->down[i]; i++) ;
+        if (i != f->myNode.number) {
+            f->mmsg.type = LOST;
+            printf("FUCHI: LOST sent to %d\n", i);
+            fflush(stdout);
+            send_msg(f, f->mmsg, i);
+        }
     }
+    start_probe(f);
 }
+
+static void fuchi_peer_up(void *ctx, int nid) {
+    struct fuchi_ctx *f = (struct fuchi_ctx *) ctx;
+
+    printf("FUCHI: node %d is up\n", nid);
+    fflush(stdout);
+    f->down[nid] = 0;
+    pick_members(f);
+}
+
+const struct dme_ops dme_ops = {
+    DME_ABI_V2,
+    "fuchi",
+    sizeof(struct fuchi_ctx),
+    fuchi_init,
+    fuchi_message,
+    fuchi_acquire,
+    fuchi_release,
+    fuchi_fini,
+    fuchi_peer_down,
+    fuchi_peer_up,
+};
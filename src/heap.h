@@ -0,0 +1,128 @@
+#ifndef _HEAP
+#define _HEAP
+// Binary min-heap of requests keyed on (clock, node id), the order used by the
+// timestamp-based algorithms. Entries live in one contiguous array that only
+// grows, so insert and pop are O(log n) and the queue length is O(1).
+// Items are whatever the algorithm keeps per request (usually pool entries).
+// NOTE: Everything is static so each algorithm library gets its own copy.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Initial capacity unless the heap is told otherwise.
+#define HEAP_INIT 64
+
+struct heap_ent {
+    int clk;
+    int nid;
+    void *item;
+};
+
+struct heap {
+    struct heap_ent *v;
+    int n;      // Entries in the heap.
+    int cap;    // Entries v can hold.
+};
+
+// Predicate used to check if a preceeds b.
+static int heap_less(struct heap_ent *a, struct heap_ent *b) {
+    if (a->clk < b->clk)
+        return 1;
+    if (a->clk == b->clk && a->nid < b->nid)
+        return 1;
+    return 0;
+}
+
+static void heap_init(struct heap *h, int cap) {
+    h->n   = 0;
+    h->cap = cap > 0 ? cap : HEAP_INIT;
+    h->v   = (struct heap_ent *) malloc(sizeof(struct heap_ent) * h->cap);
+    if (h->v == NULL) {
+        perror("heap malloc failed :\n");
+        exit(1);
+    }
+}
+
+static void heap_sift_up(struct heap *h, int i) {
+    struct heap_ent e = h->v[i];
+
+    while (i > 0 && heap_less(&e, &h->v[(i - 1) / 2])) {
+        h->v[i] = h->v[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->v[i] = e;
+}
+
+static void heap_sift_down(struct heap *h, int i) {
+    struct heap_ent e = h->v[i];
+    int c;
+
+    while ((c = 2 * i + 1) < h->n) {
+        if (c + 1 < h->n && heap_less(&h->v[c + 1], &h->v[c]))
+            c++;
+        if (!heap_less(&h->v[c], &e))
+            break;
+        h->v[i] = h->v[c];
+        i = c;
+    }
+    h->v[i] = e;
+}
+
+static void heap_push(struct heap *h, int clk, int nid, void *item) {
+    if (h->n == h->cap) {
+        h->cap *= 2;
+        h->v = (struct heap_ent *) realloc(h->v, sizeof(struct heap_ent) * h->cap);
+        if (h->v == NULL) {
+            perror("heap realloc failed :\n");
+            exit(1);
+        }
+    }
+    h->v[h->n].clk  = clk;
+    h->v[h->n].nid  = nid;
+    h->v[h->n].item = item;
+    heap_sift_up(h, h->n++);
+}
+
+// Returns the first entry, or NULL if the heap is empty.
+static struct heap_ent *heap_top(struct heap *h) {
+    return h->n > 0 ? &h->v[0] : NULL;
+}
+
+// Removes the first entry and returns its item, or NULL if the heap is empty.
+static void *heap_pop(struct heap *h) {
+    void *item;
+
+    if (h->n == 0)
+        return NULL;
+    item = h->v[0].item;
+    h->v[0] = h->v[--h->n];
+    if (h->n > 0)
+        heap_sift_down(h, 0);
+    return item;
+}
+
+// Changes the key of the first entry and restores the heap order.
+static void heap_rekey_top(struct heap *h, int clk, int nid) {
+    h->v[0].clk = clk;
+    h->v[0].nid = nid;
+    heap_sift_down(h, 0);
+}
+
+// Removes entry i (an index into v) and returns its item. Used to drop the
+// requests of a node that failed, so finding i is left to the caller.
+static void *heap_remove(struct heap *h, int i) {
+    void *item = h->v[i].item;
+
+    h->v[i] = h->v[--h->n];
+    if (i < h->n) {
+        heap_sift_down(h, i);
+        heap_sift_up(h, i);
+    }
+    return item;
+}
+
+static int heap_size(struct heap *h) {
+    return h->n;
+}
+
+#endif
@@ -0,0 +1,329 @@
+/******************************************************************************/
+/*                                                                            */
+/* lamport.c - An implementation of Lamport's distributed mutual exclusion    */
+/*             algorithm described in:                                        */
+/*             "Time, Clocks, and the Ordering of Events in a Distributed     */
+/*              System" (Lamport, 1978).                                      */
+/*                                                                            */
+/*             Every critical section costs 3(N-1) messages: a REQUEST and a  */
+/*             RELEASE broadcast, and a REPLY from every other node.          */
+/*                                                                            */
+/*             Built against the v2 interface (see dme_v2.h). A node the      */
+/*             failure detector reports down is left out: its requests are    */
+/*             dropped and its REPLY is no longer waited for.                 */
+/*                                                                            */
+/*             A withdrawn local request (on_local_cancel) is RELEASEd like   */
+/*             one that ran. Only a REPLY stamped later than the request it   */
+/*             answers counts, so those still on their way for a withdrawn    */
+/*             request do not count for the next one.                         */
+/*                                                                            */
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+
+#include "dme_v2.h"
+#include "codec.h"
+#include "pool.h"
+
+typedef enum { REQUEST,
+               REPLY,
+               RELEASE     } l_type;
+
+struct lam_msg {
+    l_type type;
+	int clk;
+	int nid;
+};
+
+// Wire order of its fields, see codec.h.
+static const struct codec_field lam_schema[] = {
+    CODEC_FIELD(CODEC_TYPE, struct lam_msg, type),
+    CODEC_FIELD(CODEC_INT,  struct lam_msg, clk),
+    CODEC_FIELD(CODEC_UINT, struct lam_msg, nid),
+};
+
+// Request queue, ordered by (clk, nid). Every node keeps a copy.
+struct qent {
+    struct lam_msg lmsg;
+    struct qent *next;
+};
+
+// State of one instance.
+struct lam_ctx {
+    const struct dme_env *env;
+    int nid;
+    int ntot;
+    int clock;
+
+    // Queue for requests.
+    struct qent *lam_front;
+
+    int replies;    // REPLYs received for the local request.
+    int waiting;    // Set while the local request waits to enter the critical section.
+    struct lam_msg mine;  // The local request, while it is queued.
+    int queued;
+
+    // replied[j] is set once node j has answered the local request.
+    // down[j] is set while node j is reported down.
+    int *replied;
+    int *down;
+
+    // Queue entries come from a pool so the handler does not malloc per message.
+    struct pool qent_pool;
+};
+
+// Predicate used to check if clock a preceeds b.
+static int preceed(struct lam_msg a, struct lam_msg b) {
+    if (a.clk < b.clk)
+        return 1;
+    if (a.clk == b.clk && a.nid < b.nid)
+        return 1;
+    return 0;
+}
+
+static void send_msg(struct lam_ctx *l, struct lam_msg lmsg, int to) {
+    unsigned char wire[CODEC_FIELD_MAX * CODEC_FIELDS(lam_schema)];
+
+    l->env->send(l->env->arg, to, wire, codec_encode(lam_schema, CODEC_FIELDS(lam_schema), &lmsg, wire, sizeof(wire))); // 0 broadcasts.
+}
+
+// Adds a request to the queue.
+static void enqueue(struct lam_ctx *l, struct lam_msg lmsg) {
+    struct qent *temp1, *temp2;
+
+    temp1 = (struct qent *) pool_alloc(&l->qent_pool);
+    temp1->lmsg = lmsg;
+    temp1->lmsg.type = REQUEST;
+    if (l->lam_front == NULL || preceed(lmsg, l->lam_front->lmsg)) {
+        temp1->next = l->lam_front;
+        l->lam_front = temp1;
+    }
+    else {
+        for (temp2 = l->lam_front; temp2->next != NULL && preceed(temp2->next->lmsg, lmsg); temp2 = temp2->next) ;
+        temp1->next = temp2->next;
+        temp2->next = temp1;
+    }
+}
+
+// Removes node nid's request from the queue, if it has one there.
+static void dequeue(struct lam_ctx *l, int nid) {
+    struct qent *temp1, *temp2;
+
+    if (l->lam_front != NULL && l->lam_front->lmsg.nid == nid) {
+        temp1 = l->lam_front;
+        l->lam_front = l->lam_front->next;
+        pool_free(&l->qent_pool, temp1);
+    }
+    else {
+        for (temp2 = l->lam_front; temp2 != NULL && temp2->next != NULL && temp2->next->lmsg.nid != nid; temp2 = temp2->next) ;
+        if (temp2 != NULL && temp2->next != NULL) {
+            temp1 = temp2->next;
+            temp2->next = temp1->next;
+            pool_free(&l->qent_pool, temp1);
+        }
+    }
+}
+
+// Enter the critical section once the local request heads the queue
+// and every other node has answered with a later timestamp.
+static void check_enter(struct lam_ctx *l) {
+    if (l->waiting && l->replies == l->ntot-1 && l->lam_front != NULL && l->lam_front->lmsg.nid == l->nid) {
+        l->waiting = 0;
+        printf("LAMPORT: message sent to producer\n");
+        fflush(stdout);
+        l->env->grant(l->env->arg);
+    }
+}
+
+static void lam_init(void *ctx, const struct dme_env *env, int nid, int ntot) {
+    struct lam_ctx *l = (struct lam_ctx *) ctx;
+
+    l->env       = env;
+    l->nid       = nid;
+    l->ntot      = ntot;
+    l->clock     = 1;
+    l->lam_front = NULL;
+    l->replies   = 0;
+    l->waiting   = 0;
+    l->queued    = 0;
+    l->replied   = (int *) calloc(ntot + 1, sizeof(int));
+    l->down      = (int *) calloc(ntot + 1, sizeof(int));
+    if (l->replied == NULL || l->down == NULL) {
+        perror("calloc failed :\n");
+        exit(1);
+    }
+    pool_init(&l->qent_pool, "qent", sizeof(struct qent), POOL_SLAB);
+
+    printf("Lamport algorithm started with %d nodes\n", ntot); // prints are for logging information
+    fflush(stdout);
+}
+
+static void lam_message(void *ctx, int from, const void *buf, unsigned int len) {
+    struct lam_ctx *l = (struct lam_ctx *) ctx;
+    struct lam_msg lmsg;
+    int to;
+
+    if (codec_decode(lam_schema, CODEC_FIELDS(lam_schema), &lmsg, buf, len) != 0) {
+        printf("LAMPORT: malformed message of %u bytes from %d, ignored\n", len, from);
+        fflush(stdout);
+        return;
+    }
+
+    // Update clock
+    if (lmsg.clk >= l->clock)
+        l->clock = lmsg.clk + 1;
+
+    if (l->down[lmsg.nid]) {
+        // Sent before the node went down, its requests are gone.
+        printf("LAMPORT: message from %d, which is down, ignored\n", lmsg.nid);
+        fflush(stdout);
+        return;
+    }
+
+    switch(lmsg.type) {
+    case REQUEST:
+        enqueue(l, lmsg);
+
+        // Timestamped REPLY lets the requester know nothing older is in flight from us.
+        printf("LAMPORT: REPLY sent to %d\n", lmsg.nid);
+        fflush(stdout);
+        to = lmsg.nid;
+        lmsg.type = REPLY;
+        lmsg.nid  = l->nid;
+        lmsg.clk  = l->clock++;
+        send_msg(l, lmsg, to);
+        break;
+    case REPLY:
+        if (l->waiting && !l->replied[lmsg.nid] && preceed(l->mine, lmsg)) {
+            l->replied[lmsg.nid] = 1;
+            l->replies++;
+        }
+        break;
+    case RELEASE:
+        // Remove the releasing node's request from the queue.
+        printf("LAMPORT: RELEASE received from %d\n", lmsg.nid);
+        fflush(stdout);
+        dequeue(l, lmsg.nid);
+        break;
+    }
+    check_enter(l);
+}
+
+static void lam_acquire(void *ctx) {
+    struct lam_ctx *l = (struct lam_ctx *) ctx;
+    struct lam_msg lmsg;
+    int i;
+
+    lmsg.type = REQUEST;
+    lmsg.nid  = l->nid;
+    lmsg.clk  = l->clock++;
+    // Nodes that are down count as having answered.
+    l->replies = 0;
+    for (i = 1; i <= l->ntot; i++) {
+        l->replied[i] = i != l->nid && l->down[i];
+        l->replies += l->replied[i];
+    }
+    l->waiting = 1;
+    l->mine    = lmsg;
+    l->queued  = 1;
+    printf("LAMPORT: REQUEST broadcast with clock %d\n", lmsg.clk);
+    fflush(stdout);
+    send_msg(l, lmsg, 0);
+    // The local request is queued like any other.
+    enqueue(l, lmsg);
+    check_enter(l);
+}
+
+static void lam_release(void *ctx) {
+    struct lam_ctx *l = (struct lam_ctx *) ctx;
+    struct lam_msg lmsg;
+    struct qent *temp1;
+
+    // Local request is at the front of the queue while in the critical section.
+    temp1 = l->lam_front;
+    l->lam_front = l->lam_front->next;
+    pool_free(&l->qent_pool, temp1);
+    l->queued = 0;
+
+    lmsg.type = RELEASE;
+    lmsg.nid  = l->nid;
+    lmsg.clk  = l->clock++;
+    printf("LAMPORT: RELEASE broadcast\n");
+    fflush(stdout);
+    send_msg(l, lmsg, 0);
+}
+
+// The local request is withdrawn before it entered, the others drop it
+// from their queues as if it had run.
+static void lam_cancel(void *ctx) {
+    struct lam_ctx *l = (struct lam_ctx *) ctx;
+    struct lam_msg lmsg;
+
+    dequeue(l, l->nid);
+    l->waiting = 0;
+    l->queued  = 0;
+
+    lmsg.type = RELEASE;
+    lmsg.nid  = l->nid;
+    lmsg.clk  = l->clock++;
+    printf("LAMPORT: request withdrawn, RELEASE broadcast\n");
+    fflush(stdout);
+    send_msg(l, lmsg, 0);
+}
+
+static void lam_fini(void *ctx) {
+    struct lam_ctx *l = (struct lam_ctx *) ctx;
+
+    pool_report(&l->qent_pool);
+    pool_destroy(&l->qent_pool);
+    free(l->replied);
+    free(l->down);
+}
+
+// Node nid crashed: drop its request and stop waiting for its REPLY.
+static void lam_peer_down(void *ctx, int nid) {
+    struct lam_ctx *l = (struct lam_ctx *) ctx;
+
+    printf("LAMPORT: node %d is down\n", nid);
+    fflush(stdout);
+    l->down[nid] = 1;
+    dequeue(l, nid);
+    if (l->waiting && !l->replied[nid]) {
+        l->replied[nid] = 1;
+        l->replies++;
+    }
+    check_enter(l);
+}
+
+// Node nid is back. It has to see the local request again, whether it is
+// waiting or already in the critical section, and a waiting one needs its REPLY.
+static void lam_peer_up(void *ctx, int nid) {
+    struct lam_ctx *l = (struct lam_ctx *) ctx;
+
+    printf("LAMPORT: node %d is up\n", nid);
+    fflush(stdout);
+    l->down[nid] = 0;
+    if (l->queued) {
+        send_msg(l, l->mine, nid);
+        if (l->waiting && l->replied[nid]) {
+            l->replied[nid] = 0;
+            l->replies--;
+        }
+    }
+}
+
+const struct dme_ops dme_ops = {
+    DME_ABI_V2,
+    "lamport",
+    sizeof(struct lam_ctx),
+    lam_init,
+    lam_message,
+    lam_acquire,
+    lam_release,
+    lam_fini,
+    lam_peer_down,
+    lam_peer_up,
+    lam_cancel,
+};
@@ -5,15 +5,39 @@
 /*             "A sqrt(N) Algorithm for Mutual Exclusion in Decentralized     */
 /*              Systems" (Maekawa, 1985).                                     */
 /*                                                                            */
+/*             Built with -DGRID_QUORUM or -DTREE_QUORUM, the same protocol   */
+/*             runs over grid or Agrawal-El Abbadi tree quorums instead of    */
+/*             the projective plane voting sets (see quorum.h).               */
+/*                                                                            */
+/*             Built against the v2 interface (see dme_v2.h). When a node     */
+/*             is reported down its requests are dropped, and a request that  */
+/*             went to it is withdrawn and sent to another quorum of the same */
+/*             system that is all up (see quorum_pick() in quorum.h). A vote  */
+/*             the failed node gave is lost with it, so the detector's        */
+/*             timeout must outlast a critical section.                       */
+/*                                                                            */
+/*             A withdrawn local request (on_local_cancel) sends RELEASE the  */
+/*             same way, and LOCKs and FAILs still on their way for it are    */
+/*             told apart by their clock.                                     */
+/*                                                                            */
+/*             Built with -DREDUCED_TRAFFIC, a node yields a vote as soon as  */
+/*             it is INQUIRed, unless it already holds them all: an INQUIRY   */
+/*             only goes out for a request that precedes the one holding the  */
+/*             vote, so the earliest request still waiting is never INQUIRed */
+/*             and always wins. Nobody then waits for a FAIL, so arbiters     */
+/*             send none, and no INQUIRY waits for one either.                */
+/*                                                                            */
 /******************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
-#include <sys/msg.h>
-#include <netinet/in.h>
 
-#include "dme.h"
+#include "dme_v2.h"
+#include "codec.h"
+#include "pool.h"
+#include "heap.h"
+#include "quorum.h"
 
 // Data structures used by dme_msg_handler
 // Types of messages that can be received
@@ -22,9 +46,7 @@ typedef enum { REQUEST,
                FAIL,
                INQUIRY,
                RELINQUISH,
-               RELEASE,
-               LOCAL_REQUEST,
-               LOCAL_RELEASE     } m_type;
+               RELEASE     } m_type;
 
 // Message holds type and Lamport clock
 struct mae_msg {
@@ -33,10 +55,18 @@ struct mae_msg {
 	int nid;
 };
 
-// Queue is a collection of qents ordered by clock.
+// Wire order of its fields, see codec.h.
+static const struct codec_field mae_schema[] = {
+    CODEC_FIELD(CODEC_TYPE, struct mae_msg, type),
+    CODEC_FIELD(CODEC_INT,  struct mae_msg, clk),
+    CODEC_FIELD(CODEC_UINT, struct mae_msg, nid),
+};
+
+// The locked request is kept apart from the waiting ones, which sit in a
+// heap ordered by (clk, nid), see heap.h.
 struct qent {
     struct mae_msg mmsg;
-    struct qent *next;
+    int failed;          // Set once the requester has been sent a FAIL.
 };
 
 // Inquery list entry.
@@ -45,32 +75,83 @@ struct ient {
     struct ient *next;
 };
 
-// Fail flag set to 1 if FAIL received.
-int fflag; 
-int lock_count = 0;
-int inq_sent = 0;
-
-// The voting set must have the following properties:
-// 1. All node's sets have a non-null intersection (optimally of size 1). 
-// 2. Node i's set always contains i.
-// 3. The size of i's set is K, for any i.
-// 4. All nodes apear in an equal number of sets. 
-// NOTE: Ideally this should be automated, but are currently pre-computed.
-int voting_set[8][8][3] = {{{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of zero nodes
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of one node
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of two nodes
-                           {{0,0,0},{1,2,0},{2,3,0},{1,3,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of three nodes
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of four nodes
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of five nodes
-                           {{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0}}, // Set of six nodes
-                           {{0,0,0},{1,2,3},{2,4,6},{3,5,6},{1,4,5},{2,5,7},{1,6,7},{3,4,7}}, // Set of seven nodes
-                       };
-int voting_set_size[] = { 0, 1, 2,
-			  2,        // Set of three nodes
-			  4, 5, 6,
-			  3,        // Set of seven nodes
-			  8, 9, 10, 11, 12,
-			  4 };	    // Set of thirteen nodes
+// Clock of the outstanding local request, NULLtime when there is none.
+#define NULLtime -1
+
+// State of one instance.
+struct mae_ctx {
+    const struct dme_env *env;
+    int nid;
+    int ntot;
+    int clock;
+
+    // Fail flag set to 1 if FAIL received.
+    int fflag;
+    int lock_count;
+    int inq_sent;
+    int req_clk;
+
+    // The voting set must have the following properties:
+    // 1. All node's sets have a non-null intersection (optimally of size 1). 
+    // 2. Node i's set always contains i.
+    // 3. The size of i's set is K, for any i.
+    // 4. All nodes apear in an equal number of sets. 
+    // They are generated when the handler starts (see quorum_maekawa() in quorum.h),
+    // and my_set is the set the local request goes to: this node's own unless
+    // one of its members is down.
+    struct quorum vote;
+    int *my_set;
+    int my_size;
+    int *down;     // down[j] is set while node j is reported down.
+
+    // Request holding this node's vote, and the requests waiting for it.
+    struct qent *current;
+    struct heap waiting;
+
+    // List of Inquirys, will be emptied when a FAIL or RELEASE is received. 
+    struct ient *inq_front;
+
+    // Queue and inquiry list entries come from pools so the handler does not malloc per message.
+    struct pool qent_pool;
+    struct pool ient_pool;
+};
+
+// Builds every node's quorum for ntot nodes.
+static void build_quorum(struct mae_ctx *m, int ntot) {
+#if defined(GRID_QUORUM)
+    quorum_grid(&m->vote, ntot);
+    quorum_report(&m->vote, "Grid");
+#elif defined(TREE_QUORUM)
+    quorum_tree(&m->vote, ntot);
+    quorum_report(&m->vote, "Tree");
+#else
+    quorum_report(&m->vote, quorum_maekawa(&m->vote, ntot));
+#endif
+    if (!quorum_check(&m->vote)) {
+        fprintf(stderr, "MAEKAWA: no valid voting sets for %d nodes\n", ntot);
+        exit(1);
+    }
+}
+
+// Chooses the voting set for the next request, avoiding nodes that are down.
+// Keeps the current one if there is no other.
+static void pick_set(struct mae_ctx *m) {
+    int n;
+
+    n = quorum_pick(&m->vote, m->nid, m->down, m->my_set);
+#if defined(TREE_QUORUM)
+    // With the root down no path is left, but paths through both subtrees are.
+    if (n == 0 && !quorum_tree_avoid(m->ntot, m->down, 1, m->my_set, &n))
+        n = 0;
+#endif
+    if (n == 0) {
+        printf("MAEKAWA: every voting set has a node that is down\n");
+        fflush(stdout);
+        return;
+    }
+    m->my_size = n;
+}
+
 // Predicate used to check if clock a preceeds b.
 static int preceed(struct mae_msg a, struct mae_msg b) {
     if (a.clk < b.clk)
@@ -80,334 +161,448 @@ static int preceed(struct mae_msg a, struct mae_msg b) {
     return 0;
 }
 
-static void send_msg(int msqid, struct mae_msg mmsg, int to) {
-	MSG imsg;
-
-	// If destination is local node, place directly in that queue.
-	if (mmsg.nid == to)
-		imsg.type = TO_DME;
-	else
-		imsg.type = TO_SND;
-	imsg.network = to;
-	memcpy(&imsg.buf, &(mmsg), sizeof(struct mae_msg));
-	imsg.size = sizeof(struct mae_msg);
-
-	if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-		perror("Error on message send\n");
-		exit(1);
-	}
+static void send_msg(struct mae_ctx *m, struct mae_msg mmsg, int to) {
+	unsigned char wire[CODEC_FIELD_MAX * CODEC_FIELDS(mae_schema)];
+
+	m->env->send(m->env->arg, to, wire, codec_encode(mae_schema, CODEC_FIELDS(mae_schema), &mmsg, wire, sizeof(wire)));
 }
 
-void *dme_msg_handler(void *arg) {
-    static int clock = 1;
-    int nid  = *((int *) arg);      // nid contains the node id.
-    int ntot = *(((int *) arg)+1);  // Total number of nodes. 
-	int msqid = msgget(M_ID, 0600); // msqid contains the message queue id.
-	struct mae_msg mmsg;
+static int in_set(struct mae_ctx *m, int nid) {
+    int i;
 
-    // Queue for requests.
-    struct qent *mae_front = NULL;
-    struct qent *temp1, *temp2;
+    for (i = 0; i < m->my_size; i++)
+        if (m->my_set[i] == nid)
+            return 1;
+    return 0;
+}
 
-    // List of Inquirys, will be emptied when a FAIL or RELEASE is received. 
-    struct ient *inq_front = NULL;
-    struct ient *itemp;	
+// The vote is free: LOCK the earliest waiting request, if there is one.
+static void lock_next(struct mae_ctx *m) {
+    struct mae_msg mmsg;
+
+    // Reset INQUIRY sent
+    m->inq_sent = 0;
+    m->current = (struct qent *) heap_pop(&m->waiting);
+    if (m->current != NULL) {
+        // A LOCK carries the clock of the request it answers, so the
+        // requester can tell it from one for a request it withdrew.
+        mmsg.nid  = m->nid;
+        mmsg.clk  = m->current->mmsg.clk;
+        mmsg.type = LOCK;
+        printf("MAEKAWA: LOCK sent to %d\n", m->current->mmsg.nid);
+        fflush(stdout);
+        send_msg(m, mmsg, m->current->mmsg.nid);
+    }
+}
+
+// Drops node nid's request from the waiting ones, if it has one there.
+static void drop_waiting(struct mae_ctx *m, int nid) {
     int i;
-	MSG imsg;
 
-    fflag = 0;
+    for (i = heap_size(&m->waiting) - 1; i >= 0; i--)
+        if (m->waiting.v[i].nid == nid)
+            pool_free(&m->qent_pool, heap_remove(&m->waiting, i));
+}
 
-	if (msqid == -1) {
-		perror("msgget failed :\n");
-		exit(1);
-	}
+static void clear_inquiries(struct mae_ctx *m) {
+    struct ient *itemp;
+
+    for (itemp = m->inq_front; itemp != NULL; itemp = m->inq_front) {
+        m->inq_front = itemp->next;
+        pool_free(&m->ient_pool, itemp);
+    }
+}
 
+// Sends the local request, with a new clock, to the voting set.
+static void send_request(struct mae_ctx *m) {
+    struct mae_msg mmsg;
+    int i;
+
+    mmsg.nid = m->nid;
+    mmsg.clk = m->clock++;
+    m->req_clk = mmsg.clk;
+	mmsg.type = REQUEST;
+	for (i = 0; i < m->my_size; i++) {
+        printf("MAEKAWA: REQUEST sent to %d\n", m->my_set[i]);
+        fflush(stdout);
+		send_msg(m, mmsg, m->my_set[i]);
+    }
+}
+
+// Sends RELEASE to the voting set, which frees the votes the local request
+// holds and withdraws it where it is still waiting.
+static void send_release(struct mae_ctx *m) {
+    struct mae_msg mmsg;
+    int i;
+
+    mmsg.nid = m->nid;
+    mmsg.clk = m->clock++;
+	mmsg.type = RELEASE;
+	for (i = 0; i < m->my_size; i++) {
+        printf("MAEKAWA: RELEASE sent to %d\n", m->my_set[i]);
+        fflush(stdout);
+		send_msg(m, mmsg, m->my_set[i]);
+    }
+}
+
+static void mae_init(void *ctx, const struct dme_env *env, int nid, int ntot) {
+    struct mae_ctx *m = (struct mae_ctx *) ctx;
+
+    m->env        = env;
+    m->nid        = nid;
+    m->ntot       = ntot;
+    m->clock      = 1;
+    m->fflag      = 0;
+    m->lock_count = 0;
+    m->inq_sent   = 0;
+    m->req_clk    = NULLtime;
+    m->current    = NULL;
+    m->inq_front  = NULL;
+
+    build_quorum(m, ntot);
+    m->down   = (int *) calloc(ntot + 1, sizeof(int));
+    m->my_set = (int *) malloc(sizeof(int) * ntot);
+    if (m->down == NULL || m->my_set == NULL) {
+        perror("malloc failed :\n");
+        exit(1);
+    }
+    pick_set(m);
+
+    pool_init(&m->qent_pool, "qent", sizeof(struct qent), POOL_SLAB);
+    pool_init(&m->ient_pool, "ient", sizeof(struct ient), POOL_SLAB);
+    heap_init(&m->waiting, HEAP_INIT);
     printf("Maekawa algorithm started with %d nodes\n", ntot); // prints are for logging information
     fflush(stdout);
+}
+
+static void mae_message(void *ctx, int from, const void *buf, unsigned int len) {
+    struct mae_ctx *m = (struct mae_ctx *) ctx;
+	struct mae_msg mmsg;
+    struct heap_ent *top;
+    struct qent *temp1;
+    struct ient *itemp;
+    int i;
+
+    // For debugging
+    printf("MAEKAWA: ");
+    if (m->current != NULL) printf("%d ", m->current->mmsg.nid);
+    for( i = 0; i < heap_size(&m->waiting); i++) printf("%d ", m->waiting.v[i].nid);
+    printf("MAEKAWA: %d entries in request queue.\n", heap_size(&m->waiting) + (m->current != NULL));
+    printf("MAEKAWA: ");
+    for( i = 0, itemp = m->inq_front; itemp != NULL; itemp = itemp->next, i++) printf("%d ", itemp->node);
+    printf("MAEKAWA: %d entries in inquiry queue.\n", i);
+    printf("\nMAEKAWA lock count: %d\n", m->lock_count);
+    fflush(stdout);
+
+	if (codec_decode(mae_schema, CODEC_FIELDS(mae_schema), &mmsg, buf, len) != 0) {
+		printf("MAEKAWA: malformed message of %u bytes from %d, ignored\n", len, from);
+		fflush(stdout);
+		return;
+	}
     
-    for (;;) {
-        // For debugging
-        printf("MAEKAWA: ");
-        for( i = 0, temp1 = mae_front; temp1 != NULL; temp1 = temp1->next, i++) printf("%d ", temp1->mmsg.nid);
-        printf("MAEKAWA: %d entries in request queue.\n", i);
-        printf("MAEKAWA: ");
-        for( i = 0, itemp = inq_front; itemp != NULL; itemp = itemp->next, i++) printf("%d ", itemp->node);
-        printf("MAEKAWA: %d entries in inquiry queue.\n", i);
-        printf("\nMAEKAWA lock count: %d\n", lock_count);
+    // Update clock
+    if (mmsg.clk > m->clock) {
+        m->clock = mmsg.clk;
+    }
+
+    switch(mmsg.type) {
+    case REQUEST:
+        printf("MAEKAWA: REQUEST received.\n");
         fflush(stdout);
-        
-        // Receiving next message
-		if (msgrcv(msqid, &imsg, sizeof(MSG), TO_DME, 0) == -1) {
-			perror("msgrcv failed :\n");
-			exit(1);
-		}
-		
-        printf("MAEKAWA: Message queue message received!\n");
-        fflush(stdout);
-    
-		memcpy(&mmsg, &imsg.buf, sizeof(struct mae_msg));
-        
-        // Update clock
-        if (mmsg.clk > clock) {
-            clock = mmsg.clk;
-        }
-
-        switch(mmsg.type) {
-        case REQUEST:
-            printf("MAEKAWA: REQUEST received.\n", i);
+        if (m->down[mmsg.nid]) {
+            // Sent before the node went down, its vote would never come back.
+            printf("MAEKAWA: REQUEST from %d, which is down, ignored\n", mmsg.nid);
             fflush(stdout);
-            // Add to queue.
-            temp1 = (struct qent *) malloc(sizeof(struct qent));
-            temp1->mmsg       = mmsg;
-            temp1->next       = NULL;
-            if (mae_front == NULL) {
-                mae_front = temp1;
-				// This request is now the current.
-				// Send LOCK 
-				mmsg.nid = nid;
-				mmsg.clk = clock;
-				mmsg.type = LOCK;
-                printf("MAEKAWA: LOCK sent to %d\n", temp1->mmsg.nid);
-                fflush(stdout);
-				send_msg(msqid, mmsg, temp1->mmsg.nid);
-            }
-            else {
-                for (temp2 = mae_front; temp2->next != NULL && preceed(temp2->next->mmsg, temp1->mmsg); temp2=temp2->next) ;
-                // Does the current locking request preceed this request?
-                // Does any of the requests preceed this request?
-                if (preceed(temp1->mmsg, mae_front->mmsg) && preceed(temp1->mmsg, temp2->mmsg)) {
-                    if (!inq_sent) {
-                        // Send INQUIRY to current
-                        mmsg.nid = nid;
-                        mmsg.clk = mae_front->mmsg.clk;
-                        mmsg.type = INQUIRY;
-                        printf("MAEKAWA: INQUIRY sent to %d\n", mae_front->mmsg.nid);
-                        fflush(stdout);
-                        send_msg(msqid, mmsg, mae_front->mmsg.nid);
-                        inq_sent = 1;
-                    }
-                    else {
-                        printf("MAEKAWA: INQUIRY already sent.\n");
-                        fflush(stdout);
-                    }
-				}
-				else {
-					// Send FAIL to requesting node
-					mmsg.nid = nid;
-					mmsg.type = FAIL;
-                    printf("MAEKAWA: FAIL sent to %d\n", temp1->mmsg.nid);
-                    fflush(stdout);
-                    send_msg(msqid, mmsg, temp1->mmsg.nid);
-				}
-				temp1->next = temp2->next;
-				temp2->next = temp1;
-            }
             break;
-        case LOCK:
-            printf("MAEKAWA: LOCK received.\n", i);
+        }
+        // Add to queue.
+        temp1 = (struct qent *) pool_alloc(&m->qent_pool);
+        temp1->mmsg       = mmsg;
+        temp1->failed     = 0;
+        if (m->current == NULL) {
+            m->current = temp1;
+			// This request is now the current.
+			// Send LOCK, with the request's clock (see lock_next()).
+			mmsg.nid = m->nid;
+			mmsg.type = LOCK;
+            printf("MAEKAWA: LOCK sent to %d\n", temp1->mmsg.nid);
             fflush(stdout);
-			lock_count++;
-			if (lock_count == voting_set_size[ntot]) {
-				// Ready to do critial section
-				// Reset fail flag and Inquiry list.
-				fflag = 0;
-				for (itemp = inq_front; itemp != NULL; itemp = inq_front) {
-					inq_front = itemp->next;
-					free(itemp);
-				}
-				// Send process that called dme_down a message.
-				memcpy(&imsg.buf, &mmsg, sizeof(struct mae_msg));
-				imsg.size = sizeof(struct mae_msg);
-				imsg.type = TO_CON;
-                printf("MAEKAWA: message sent to producer\n");
-                fflush(stdout);
-				if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-					perror("Error on message send\n");
-					exit(1);
-				}	
+			send_msg(m, mmsg, temp1->mmsg.nid);
+        }
+        else {
+            // Does the current locking request preceed this request?
+            // Does any of the waiting requests preceed this request?
+            top = heap_top(&m->waiting);
+            if (preceed(temp1->mmsg, m->current->mmsg) &&
+                (top == NULL || preceed(temp1->mmsg, ((struct qent *) top->item)->mmsg))) {
+                if (!m->inq_sent) {
+                    // Send INQUIRY to current
+                    mmsg.nid = m->nid;
+                    mmsg.clk = m->current->mmsg.clk;
+                    mmsg.type = INQUIRY;
+                    printf("MAEKAWA: INQUIRY sent to %d\n", m->current->mmsg.nid);
+                    fflush(stdout);
+                    send_msg(m, mmsg, m->current->mmsg.nid);
+                    m->inq_sent = 1;
+                }
+                else {
+                    printf("MAEKAWA: INQUIRY already sent.\n");
+                    fflush(stdout);
+                }
+#ifndef REDUCED_TRAFFIC
+                // The request this one overtook must give up its votes too,
+                // or it can hold them while waiting for ours (Sanders, 1987).
+                if (top != NULL && !((struct qent *) top->item)->failed) {
+                    struct qent *temp2 = (struct qent *) top->item;
+
+                    mmsg.nid = m->nid;
+                    mmsg.clk = temp2->mmsg.clk;
+                    mmsg.type = FAIL;
+                    printf("MAEKAWA: FAIL sent to %d\n", temp2->mmsg.nid);
+                    fflush(stdout);
+                    send_msg(m, mmsg, temp2->mmsg.nid);
+                    temp2->failed = 1;
+                }
+#endif
 			}
-            break;
-        case FAIL:
-            printf("MAEKAWA: FAIL received.\n", i);
-            fflush(stdout);
-			fflag = 1;
-			mmsg.nid  = nid;
-			mmsg.type = RELINQUISH;
-			while (inq_front != NULL) {
-				itemp = inq_front;
-				inq_front = inq_front->next;
-
-                printf("MAEKAWA: RELINQUISH sent to %d\n", itemp->node);
+			else {
+#ifndef REDUCED_TRAFFIC
+				// Send FAIL to requesting node
+				mmsg.nid = m->nid;
+				mmsg.type = FAIL;
+                printf("MAEKAWA: FAIL sent to %d\n", temp1->mmsg.nid);
                 fflush(stdout);
-				send_msg(msqid, mmsg, itemp->node); 
-
-				free(itemp);
-				// For every RELINQUISH sent, decrement lock_count
-				lock_count--;
+                send_msg(m, mmsg, temp1->mmsg.nid);
+                temp1->failed = 1;
+#endif
 			}
-            break;
-        case INQUIRY:
-            printf("MAEKAWA: INQUIRY received.\n", i);
+			heap_push(&m->waiting, temp1->mmsg.clk, temp1->mmsg.nid, temp1);
+        }
+        break;
+    case LOCK:
+        printf("MAEKAWA: LOCK received.\n");
+        fflush(stdout);
+        if (mmsg.clk != m->req_clk) {
+            printf("MAEKAWA: LOCK for a withdrawn request ignored.\n");
             fflush(stdout);
-           
-            // Find request that INQUIRY is asking about by matching the clock.
-            for (temp2 = mae_front; temp2 != NULL && temp2->mmsg.nid != nid; temp2=temp2->next) ;
-            // Ignore INQUIRY if asking for a previous request, or already in critical section.
-            if (temp2 == NULL || 
-                temp2->mmsg.nid != nid ||
-                temp2->mmsg.clk != mmsg.clk ||
-                lock_count == voting_set_size[ntot]) {
-                printf("MAEKAWA: INQUIRY ignored.\n");
-                fflush(stdout);
-                break;
-            }
-
-			// Add to inquiry list
-			itemp = (struct ient *) malloc(sizeof(struct ient));
-			itemp->node = mmsg.nid;
-			itemp->next = inq_front;
-			
-			inq_front = itemp;
-			
-			if (fflag) {
-				mmsg.nid  = nid;
-				mmsg.type = RELINQUISH;
-				while (inq_front != NULL) {
-					itemp = inq_front;
-					inq_front = inq_front->next;
-
-                    printf("MAEKAWA: RELINQUISH sent to %d\n", itemp->node);
-                    fflush(stdout);
-				    send_msg(msqid, mmsg, itemp->node); 
-
-					free(itemp);
-				    // For every RELINQUISH sent, decrement lock_count
-					lock_count--;
-				}
-		    }
             break;
-        case RELINQUISH:
-            printf("MAEKAWA: RELINQUISH received.\n", i);
+        }
+		m->lock_count++;
+		if (m->lock_count == m->my_size) {
+			// Ready to do critial section
+			// Reset fail flag and Inquiry list.
+			m->fflag = 0;
+			clear_inquiries(m);
+			// Let the process that called dme_down run.
+            printf("MAEKAWA: message sent to producer\n");
             fflush(stdout);
-			// Requeue the current 
-			temp1 = mae_front;
-		    mae_front = mae_front->next;	
-			for (temp2 = mae_front; temp2->next != NULL && preceed(temp2->next->mmsg, temp1->mmsg); temp2=temp2->next) ;
-			temp1->next = temp2->next;
-			temp2->next = temp1;
-            // Reset INQUIRY sent
-            inq_sent = 0;
-			// Send LOCK to new current.
-			mmsg.nid = nid;
-		    mmsg.type = LOCK;
-            printf("MAEKAWA: LOCK sent to %d\n", mae_front->mmsg.nid);
+			m->env->grant(m->env->arg);
+		}
+        break;
+    case FAIL:
+        printf("MAEKAWA: FAIL received.\n");
+        fflush(stdout);
+        if (mmsg.clk != m->req_clk) {
+            printf("MAEKAWA: FAIL for a withdrawn request ignored.\n");
             fflush(stdout);
-			send_msg(msqid, mmsg, mae_front->mmsg.nid);
             break;
-        case RELEASE:
-            printf("MAEKAWA: RELEASE received.\n", i);
+        }
+		m->fflag = 1;
+		mmsg.nid  = m->nid;
+		mmsg.type = RELINQUISH;
+		while (m->inq_front != NULL) {
+			itemp = m->inq_front;
+			m->inq_front = m->inq_front->next;
+
+            printf("MAEKAWA: RELINQUISH sent to %d\n", itemp->node);
             fflush(stdout);
-            // Reset INQUIRY sent
-            inq_sent = 0;
-            // Reset lock count. 
-            if (mae_front->mmsg.nid == nid)
-                lock_count = 0;
-			// Pop next current from queue.
-			temp1 = mae_front;
-			mae_front = mae_front->next;
-			free(temp1);
-			// send LOCK to new current.
-			if (mae_front != NULL) {
-                mmsg.nid = nid;
-                mmsg.type = LOCK;
-                printf("MAEKAWA: LOCK sent to %d\n", mae_front->mmsg.nid);
-                fflush(stdout);
-                send_msg(msqid, mmsg, mae_front->mmsg.nid);
-            }
-			break;
-        case LOCAL_REQUEST:
-            printf("MAEKAWA: LOCAL_REQUEST received.\n", i);
+			send_msg(m, mmsg, itemp->node); 
+
+			pool_free(&m->ient_pool, itemp);
+			// For every RELINQUISH sent, decrement lock_count
+			m->lock_count--;
+		}
+        break;
+    case INQUIRY:
+        printf("MAEKAWA: INQUIRY received.\n");
+        fflush(stdout);
+       
+        // Ignore INQUIRY if asking for a previous request, or already in critical section.
+        // The local request is matched by clock, since this node need not
+        // be in its own quorum.
+        if (m->req_clk == NULLtime ||
+            m->req_clk != mmsg.clk ||
+            m->lock_count == m->my_size) {
+            printf("MAEKAWA: INQUIRY ignored.\n");
             fflush(stdout);
-            // Local request received.
-            mmsg.nid = nid;
-            mmsg.clk = clock++;
-            // Send REQUEST to voting set.
-			mmsg.type = REQUEST;
-			for (i = 0; i < voting_set_size[ntot]; i++) {
-                printf("MAEKAWA: REQUEST sent to %d\n", voting_set[ntot][nid][i]);
-                fflush(stdout);
-				send_msg(msqid, mmsg, voting_set[ntot][nid][i]);
-            }
             break;
-        case LOCAL_RELEASE:
-            printf("MAEKAWA: LOCAL_RELEASE received.\n", i);
-            fflush(stdout);
-            mmsg.nid = nid;
-            mmsg.clk = clock++;
-            // Send RELEASE to voting set.
-			mmsg.type = RELEASE;
-			for (i = 0; i < voting_set_size[ntot]; i++) {
-                printf("MAEKAWA: RELEASE sent to %d\n", voting_set[ntot][nid][i]);
+        }
+
+#ifdef REDUCED_TRAFFIC
+		// Yield at once, an earlier request is waiting for the vote.
+		mmsg.nid  = m->nid;
+		mmsg.type = RELINQUISH;
+		printf("MAEKAWA: RELINQUISH sent to %d\n", from);
+		fflush(stdout);
+		send_msg(m, mmsg, from);
+		m->lock_count--;
+		break;
+#endif
+		// Add to inquiry list
+		itemp = (struct ient *) pool_alloc(&m->ient_pool);
+		itemp->node = mmsg.nid;
+		itemp->next = m->inq_front;
+		
+		m->inq_front = itemp;
+		
+		if (m->fflag) {
+			mmsg.nid  = m->nid;
+			mmsg.type = RELINQUISH;
+			while (m->inq_front != NULL) {
+				itemp = m->inq_front;
+				m->inq_front = m->inq_front->next;
+
+                printf("MAEKAWA: RELINQUISH sent to %d\n", itemp->node);
                 fflush(stdout);
-				send_msg(msqid, mmsg, voting_set[ntot][nid][i]);
-            }
+			    send_msg(m, mmsg, itemp->node); 
+
+				pool_free(&m->ient_pool, itemp);
+			    // For every RELINQUISH sent, decrement lock_count
+				m->lock_count--;
+			}
+	    }
+        break;
+    case RELINQUISH:
+        printf("MAEKAWA: RELINQUISH received.\n");
+        fflush(stdout);
+        if (m->current == NULL || m->current->mmsg.nid != mmsg.nid) {
+            // Its request was dropped when the node was reported down.
+            printf("MAEKAWA: RELINQUISH from %d ignored.\n", mmsg.nid);
+            fflush(stdout);
             break;
         }
-	}
+		// Requeue the current, the earliest waiting request becomes current.
+		// It only relinquishes after a FAIL, so it needs no other.
+		m->current->failed = 1;
+		heap_push(&m->waiting, m->current->mmsg.clk, m->current->mmsg.nid, m->current);
+		// Send LOCK to new current.
+		lock_next(m);
+        break;
+    case RELEASE:
+        printf("MAEKAWA: RELEASE received.\n");
+        fflush(stdout);
+        if (m->current == NULL || m->current->mmsg.nid != mmsg.nid) {
+            // A request withdrawn before it got this node's vote.
+            drop_waiting(m, mmsg.nid);
+            break;
+        }
+		// Pop next current from queue and send it LOCK.
+		pool_free(&m->qent_pool, m->current);
+		lock_next(m);
+		break;
+    }
 }
 
-void dme_down() { 
-	int msqid = msgget(M_ID, 0600);
-	MSG imsg;
-	struct mae_msg mmsg;
+static void mae_acquire(void *ctx) {
+    struct mae_ctx *m = (struct mae_ctx *) ctx;
 
-	if (msqid == -1) {
-		perror("msgget failed :\n");
-		exit(1);
-	}
-    
-    mmsg.type = LOCAL_REQUEST;
-    mmsg.clk = 0; // Handler will fill in the clock value
-    mmsg.nid = 0; // nid of 0 implies local node.
-
-	memcpy(&imsg.buf, &mmsg, sizeof(struct mae_msg));
-
-    // Place REQUEST in message queue, block until ready.
-    imsg.size = sizeof(struct mae_msg);
-	imsg.type = TO_DME;
-	if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-		perror("Error on message send\n");
-		exit(1);
-	}	
-
-    // Wait to hear back from handler to start critical section. 
-	if (msgrcv(msqid, &imsg, sizeof(MSG), TO_CON, 0) == -1) {
-		perror("Error on message receive\n");
-		exit(1);
-	}	
+    printf("MAEKAWA: LOCAL_REQUEST received.\n");
+    fflush(stdout);
+    // Local request received, send REQUEST to voting set.
+    pick_set(m);
+    send_request(m);
 }
 
-void dme_up() {
-    // Tell handler critical section is complete
-    // This will allow it to send replies. 
-	int msqid = msgget(M_ID, 0600);
-	MSG imsg;
-	struct mae_msg mmsg;
+static void mae_release(void *ctx) {
+    struct mae_ctx *m = (struct mae_ctx *) ctx;
 
-	if (msqid == -1) {
-		perror("msgget failed :\n");
-		exit(1);
-	}
-    
-    mmsg.type = LOCAL_RELEASE;
+    printf("MAEKAWA: LOCAL_RELEASE received.\n");
+    fflush(stdout);
+    m->req_clk = NULLtime;
+    m->lock_count = 0;
+    // Send RELEASE to voting set.
+    send_release(m);
+}
 
-	memcpy(&imsg.buf, &mmsg, sizeof(struct mae_msg));
+// The local request is withdrawn before it entered: the votes it holds are
+// given back and it leaves the queues where it is still waiting.
+static void mae_cancel(void *ctx) {
+    struct mae_ctx *m = (struct mae_ctx *) ctx;
 
-    // Place RELEASE in message queue, block until ready.
-    imsg.size = sizeof(struct mae_msg);
-	imsg.type = TO_DME;
-	if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-		perror("Error on message send\n");
-		exit(1);
-	}
+    printf("MAEKAWA: LOCAL_CANCEL received.\n");
+    fflush(stdout);
+    m->req_clk = NULLtime;
+    m->lock_count = 0;
+    m->fflag = 0;
+    clear_inquiries(m);
+    send_release(m);
+}
+
+static void mae_fini(void *ctx) {
+    struct mae_ctx *m = (struct mae_ctx *) ctx;
+
+    quorum_free(&m->vote);
+    free(m->down);
+    free(m->my_set);
+    free(m->waiting.v);
+    pool_report(&m->qent_pool);
+    pool_report(&m->ient_pool);
+    pool_destroy(&m->qent_pool);
+    pool_destroy(&m->ient_pool);
 }
+
+// Node nid crashed. Its vote and its request go, and a local request that is
+// still waiting for its vote is sent to a voting set without it.
+static void mae_peer_down(void *ctx, int nid) {
+    struct mae_ctx *m = (struct mae_ctx *) ctx;
+
+    printf("MAEKAWA: node %d is down\n", nid);
+    fflush(stdout);
+    m->down[nid] = 1;
+
+    drop_waiting(m, nid);
+    if (m->current != NULL && m->current->mmsg.nid == nid) {
+        pool_free(&m->qent_pool, m->current);
+        lock_next(m);
+    }
+
+    if (m->req_clk != NULLtime && m->lock_count < m->my_size && in_set(m, nid)) {
+        send_release(m);
+        m->lock_count = 0;
+        m->fflag = 0;
+        clear_inquiries(m);
+        pick_set(m);
+        send_request(m);
+    }
+}
+
+// Node nid is back, the next request can use this node's own set again.
+static void mae_peer_up(void *ctx, int nid) {
+    struct mae_ctx *m = (struct mae_ctx *) ctx;
+
+    printf("MAEKAWA: node %d is up\n", nid);
+    fflush(stdout);
+    m->down[nid] = 0;
+}
+
+const struct dme_ops dme_ops = {
+    DME_ABI_V2,
+#if defined(GRID_QUORUM)
+    "grid",
+#elif defined(TREE_QUORUM)
+    "tree",
+#elif defined(REDUCED_TRAFFIC)
+    "maekawa_rt",
+#else
+    "maekawa",
+#endif
+    sizeof(struct mae_ctx),
+    mae_init,
+    mae_message,
+    mae_acquire,
+    mae_release,
+    mae_fini,
+    mae_peer_down,
+    mae_peer_up,
+    mae_cancel,
+};
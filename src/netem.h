@@ -0,0 +1,202 @@
+#ifndef _NETEM
+#define _NETEM
+// Network emulation on the node controller's send path, so WAN and multi-zone
+// topologies can be tried on one host without root or tc.
+//
+// The links leaving a node are described by a matrix file (DME_NETEM), one
+// line per rule:
+//     from  to  delay_ms  jitter_ms  kbit/s  loss_%
+// from and to are a node id, a range such as 4-6, or * for every node, and
+// later lines override earlier ones. kbit/s 0 means unlimited.
+//
+// Frames to an emulated peer are queued and written by that link's own thread
+// when they are due: after waiting for the frames ahead of them to be
+// serialized at the link's bandwidth, plus the delay and a uniform jitter of
+// up to jitter_ms either way. The peers talk over TCP, so a lost frame is not
+// dropped but resent after NETEM_RTO_MS, and frames never overtake each other:
+// one that is due earlier than the frame before it waits for it.
+// NOTE: Everything is static, like frame.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+// Retransmission timeout added to a lost frame, on top of a round trip.
+#define NETEM_RTO_MS 200
+
+struct netem_pkt {
+    struct netem_pkt *next;
+    long due;                 // When it may be written (us).
+    unsigned int len;
+    unsigned char data[];     // Frame header and payload.
+};
+
+struct netem_link {
+    int on;                   // Set if the link is emulated.
+    int nid;                  // Node at the other end.
+    double delay, jitter;     // One-way latency and its spread (ms).
+    double kbps;              // Bandwidth, 0 for unlimited.
+    double loss;              // Chance a frame has to be resent.
+    unsigned short seed[3];   // For erand48, so runs can be repeated.
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct netem_pkt *head, *tail;
+    long busy_until;          // When the link has serialized what is queued (us).
+    long last_due;            // When the last queued frame is due (us).
+    int queued, high;         // Frames waiting, and the most there have been.
+
+    // Writes a due frame to the peer.
+    void (*out)(int nid, unsigned char *buf, unsigned int len);
+};
+
+static long netem_now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+// Parses a node id, a range or *. Returns 0 if s is none of them.
+static int netem_nodes(const char *s, int ntot, int *lo, int *hi) {
+    if (strcmp(s, "*") == 0) {
+        *lo = 1;
+        *hi = ntot;
+        return 1;
+    }
+    if (sscanf(s, "%d-%d", lo, hi) == 2)
+        return *lo <= *hi;
+    if (sscanf(s, "%d", lo) == 1) {
+        *hi = *lo;
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the matrix in path and sets up links[1..ntot] for node self.
+// Returns the number of emulated links, or -1 if the file cannot be used.
+static int netem_load(const char *path, int self, int ntot, struct netem_link *links,
+                      void (*out)(int nid, unsigned char *buf, unsigned int len)) {
+    char line[256], from[32], to[32];
+    double delay, jitter, kbps, loss;
+    int flo, fhi, tlo, thi, i, n, lineno = 0, count = 0;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    for (i = 1; i <= ntot; i++) {
+        memset(&links[i], 0, sizeof(struct netem_link));
+        links[i].nid     = i;
+        links[i].out     = out;
+        links[i].seed[0] = (unsigned short) self;
+        links[i].seed[1] = (unsigned short) i;
+        links[i].seed[2] = 0x330E;
+        pthread_mutex_init(&links[i].lock, NULL);
+        pthread_cond_init(&links[i].cond, NULL);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        n = sscanf(line, "%31s %31s %lf %lf %lf %lf", from, to, &delay, &jitter, &kbps, &loss);
+        if (n != 6 || !netem_nodes(from, ntot, &flo, &fhi) || !netem_nodes(to, ntot, &tlo, &thi) ||
+            delay < 0 || jitter < 0 || kbps < 0 || loss < 0 || loss >= 100) {
+            fprintf(stderr, "%s:%d: expected from to delay_ms jitter_ms kbit/s loss_%%\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        if (self < flo || self > fhi)
+            continue;
+        for (i = tlo; i <= thi && i <= ntot; i++) {
+            if (i == self)
+                continue;
+            links[i].delay  = delay;
+            links[i].jitter = jitter;
+            links[i].kbps   = kbps;
+            links[i].loss   = loss / 100;
+            links[i].on     = delay > 0 || jitter > 0 || kbps > 0 || loss > 0;
+        }
+    }
+    fclose(f);
+    for (i = 1; i <= ntot; i++)
+        count += links[i].on;
+    return count;
+}
+
+// Queues a frame, header and payload, to go out on link l when it is due.
+static void netem_send(struct netem_link *l, unsigned char *hdr, int hlen, char *payload, unsigned int len) {
+    struct netem_pkt *p;
+    long now = netem_now(), due;
+
+    p = (struct netem_pkt *) malloc(sizeof(struct netem_pkt) + hlen + len);
+    if (p == NULL) {
+        perror("netem malloc failed :\n");
+        exit(1);
+    }
+    p->next = NULL;
+    p->len  = hlen + len;
+    memcpy(p->data, hdr, hlen);
+    if (len > 0)
+        memcpy(p->data + hlen, payload, len);
+
+    pthread_mutex_lock(&l->lock);
+    if (l->busy_until < now)
+        l->busy_until = now;
+    if (l->kbps > 0)
+        l->busy_until += (long) (p->len * 8 * 1000 / l->kbps);
+    due = l->busy_until + (long) (l->delay * 1000);
+    if (l->jitter > 0)
+        due += (long) ((erand48(l->seed) * 2 - 1) * l->jitter * 1000);
+    if (l->loss > 0 && erand48(l->seed) < l->loss)
+        due += (NETEM_RTO_MS + 2 * (long) l->delay) * 1000;
+    if (due < l->last_due)
+        due = l->last_due;
+    p->due = l->last_due = due;
+
+    if (l->tail == NULL)
+        l->head = p;
+    else
+        l->tail->next = p;
+    l->tail = p;
+    if (++l->queued > l->high)
+        l->high = l->queued;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+}
+
+// Thread of one emulated link, writes each frame once it is due.
+static void *netem_thread(void *arg) {
+    struct netem_link *l = (struct netem_link *) arg;
+    struct netem_pkt *p;
+    struct timespec ts;
+    long now;
+
+    pthread_mutex_lock(&l->lock);
+    for (;;) {
+        if (l->head == NULL) {
+            pthread_cond_wait(&l->cond, &l->lock);
+            continue;
+        }
+        if ((now = netem_now()) < l->head->due) {
+            ts.tv_sec  = l->head->due / 1000000;
+            ts.tv_nsec = (l->head->due % 1000000) * 1000;
+            pthread_cond_timedwait(&l->cond, &l->lock, &ts);
+            continue;
+        }
+        p = l->head;
+        if ((l->head = p->next) == NULL)
+            l->tail = NULL;
+        l->queued--;
+        pthread_mutex_unlock(&l->lock);
+        l->out(l->nid, p->data, p->len);
+        free(p);
+        pthread_mutex_lock(&l->lock);
+    }
+    return NULL;
+}
+
+#endif
@@ -1,3 +1,6 @@
+// For CPU affinity (see affinity.h), before any header
+#define _GNU_SOURCE
+
 // Standard headers
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,6 +13,7 @@
 
 // For message queue
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 
@@ -22,35 +26,51 @@
 // For rand48
 #include <sys/time.h>
 
+// For writev
+#include <sys/uio.h>
+
+// For the phi accrual failure detector
+#include <math.h>
+
 // Socket headers
 #include <sys/socket.h> // Socket structure declarations
 #include <netinet/in.h> // Structures needed for internet domain addresses
 #include <netdb.h>      // Defines structure hostnet
+#include <sys/un.h>     // For the control socket
 
 #include "dme.h"
+#include "dme_v2.h"
+#include "netem.h"
+#include "affinity.h"
+#include "donut.h"
+#include "flow.h"
+#include "codec.h"
 
 // Node Controller port
 #define NC_PORT 2017
 
-// There are the hostnames expected in order to make connects
-// TODO find a more dynamic approach.
-static char *MY_NODES[] = {
-  "Hostnames",
-  "dme-1",
-  "dme-2",
-  "dme-3",
-  "dme-4",
-  "dme-5",
-  "dme-6",
-} ;
+// Nodes are expected at dme-<node id>:NC_PORT, the hostnames the docker scripts
+// give them, unless DME_HOSTS lists host[:port] for every node in order,
+// separated by commas (for instance to run them all on one host).
+#define NC_HOST "dme-%d"
+
+// Times a connect is retried, 100 ms apart, while the other node starts up.
+#define CONNECT_TRIES 50
+
+// Producer started once the node is connected, and the donuts it makes,
+// unless DME_PROD and DME_DONUTS say otherwise.
+#define PROD_PATH "/bin/prod"
+#define DONUTS    100
 
 // message queue variable
 // This is global because it will be read by multiple threads.
 int msqid;
 
 // These threads are responsible for keeping lifetime connection to other nodes.
-// This will receive messages from message queue and send them out the socket.
+// One per peer, this will take the frames for it off its flow and send them out the socket.
 void *sender_thread(void *arg);
+// For v1 libraries, this will receive messages from message queue and put them on the flows.
+void *relay_thread(void *arg);
 // This will listen to the socket and place messages on message queue.
 void *receiver_thread(void *arg);
 
@@ -58,6 +78,221 @@ void *receiver_thread(void *arg);
 int n_tot;
 int *sock_fds;
 
+// Frames that received payloads are read into. The dme thread returns them.
+struct frame_pool rx_pool = FRAME_POOL_INITIALIZER;
+
+// Set when the library is a v2 one (see dme_v2.h). The receiver threads then
+// call it directly, and dme_thread only handles the producer's requests and
+// messages the node sends itself. dme_lock serializes calls into it.
+const struct dme_ops *dme_ops;
+void *dme_ctx;
+struct dme_env dme_env;
+pthread_mutex_t dme_lock = PTHREAD_MUTEX_INITIALIZER;
+int my_nid;
+// Frames for the messages the library sends, on their way through the flows.
+struct frame_pool tx_pool = FRAME_POOL_INITIALIZER;
+void *dme_thread(void *arg);
+static void dme_send(void *arg, int to, const void *buf, unsigned int len);
+static void dme_grant(void *arg);
+static void give_back(void);
+static void delegated_frame(int type, int from, unsigned char *payload, unsigned int len);
+
+// Flows (DME_FLOW_CAP)
+// Frames for each peer wait in a flow of their own (see flow.h) until the
+// peer's sender thread writes them, so a slow peer holds up no other. The flow
+// of this node itself takes the messages a v2 library sends itself to the
+// loopback thread. A flow to a peer holds at most DME_FLOW_CAP frames, 1024
+// unless set, but nothing that calls the library waits on one. Input waits
+// instead (see wait_room): while a flow to a peer is at capacity, the
+// receiver threads read nothing more from their sockets, and the producer's
+// requests, the messages to this node itself and, for a v1 library, the
+// messages it queues for sending are left where they are. A flow goes past
+// its capacity only by what one call of the library sends the peer, or what
+// is sent on events that are not input, such as a lease running out. Two
+// nodes whose flows to each other are full wait for each other, but only once
+// the socket buffers in both directions are full as well.
+// A receiver for a v1 library also reads no further while the message queue
+// holds DME_FLOW_CAP messages or is more than half full, leaving the rest to
+// the library.
+// DME_SOCK_BUF sets the socket buffers of the connections to the peers, so a
+// slow peer backs up into the flows sooner, for instance to test this.
+#define FLOW_CAP 1024
+struct flow *out_flows;        // Indexed by node id.
+int flow_cap;
+pthread_cond_t room_cond = PTHREAD_COND_INITIALIZER;  // A flow went below capacity (dme_lock).
+long flow_waits;               // Times input waited for room in the flows.
+long rx_waits;                 // Times a receiver waited for room in the queue.
+void *loopback_thread(void *arg);
+
+// Failure detection
+// Every node sends a heartbeat frame to each peer every DME_HEARTBEAT_MS.
+// A peer is suspected down when nothing has been heard for DME_FD_TIMEOUT_MS,
+// or, if DME_FD_PHI is set, when the phi accrual suspicion level
+// (Hayashibara et al., 2004) computed over recent heartbeat arrivals exceeds it.
+// A connection that closes marks the peer down for good. Nodes are assumed to
+// crash and stay down, so the timeout must outlast a critical section: a slow
+// node that is wrongly suspected may still be holding the lock.
+#define HEARTBEAT_MS  100
+#define FD_TIMEOUT_MS 1000
+// Heartbeat intervals the phi detector remembers.
+#define FD_WINDOW     100
+
+struct peer {
+	long last;                 // When the last heartbeat arrived (ms).
+	int suspected;             // Reported down to the library.
+	int closed;                // The connection is gone.
+	int paused;                // Its receiver waits for room in the flows, so it is not heard.
+	double win[FD_WINDOW];     // Recent heartbeat intervals (ms).
+	int nwin, wpos;
+};
+
+struct peer *peers;            // Indexed by node id.
+pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+// One writer at a time per socket, the heartbeat thread shares them with the sender.
+// A heartbeat never waits on a socket, which would hold up those to the other
+// peers behind one that reads nothing: it is skipped while the sender is
+// writing, and left for the next frame, and it goes out only as far as the
+// socket buffer takes it, the rest being written ahead of the next frame.
+pthread_mutex_t *sock_locks;
+struct beat {
+	int due;                   // Skipped while the sender wrote, send with the next frame.
+	unsigned char buf[FRAME_HDR_MAX];
+	int off, len;              // What is left to write of one begun (sock_locks).
+} *beats;                      // Indexed by node id - 1, like sock_fds.
+int hb_ms, fd_timeout_ms;
+double fd_phi;                 // 0 uses the plain timeout.
+void *heartbeat_thread(void *arg);
+void *detector_thread(void *arg);
+
+// Leases (DME_LEASE_MS, v2 libraries only)
+// The producer holds the lock for at most lease_ms, then the node controller
+// releases it on the producer's behalf so a paused holder cannot stall the others.
+// Each grant carries a fencing token for the buffer manager to turn away writes
+// from a holder whose lease ran out. Tokens are a Lamport clock of grants: every
+// message the library sends goes out as FRAME_FENCED with the highest token
+// this node has issued or seen, and the next holder always hears from the last
+// one before it enters, so its token is larger.
+// The lease variables are protected by dme_lock.
+int lease_ms;
+unsigned int fence;            // Highest token issued or seen.
+int lease_held;                // The producer holds an unexpired lease.
+long lease_until;              // When it runs out (ms).
+unsigned int lease_token;      // The token it was granted with.
+
+// The producer's acquire (v2 libraries), protected by dme_lock.
+// An acquire may carry a timeout (see dme_v2.h). When it runs out, or the
+// producer cancels, the library withdraws the request. One without
+// on_local_cancel cannot, so the acquire is ABANDONED instead: its grant is
+// given back as soon as it arrives, unless the producer asks again first.
+enum { L_IDLE, L_WAITING, L_HELD, L_ABANDONED, L_RETURNING } local_state;
+long acquire_until;            // When a waiting acquire is withdrawn (ms), 0 for never.
+
+// Wakes the timer thread, which ends leases and acquires that run out.
+pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+void *timer_thread(void *arg);
+
+// Delegation (DME_DELEGATE, v2 libraries only)
+// Producers hand their donut to the node controller instead of taking the lock,
+// and it goes on to the combiner node named by DME_DELEGATE. Its combiner thread
+// takes the lock once for every donut waiting, writes them all to the buffer
+// manager, releases the lock and sends each answer back. It takes the lock
+// through the library like that node's producer would, so with leases its
+// writes are fenced the same way.
+int combiner;                  // Node id of the combiner, 0 when off.
+struct delegated {
+	struct delegated *next;
+	int from;                  // Node whose producer it came from.
+	int result;                // The buffer manager's answer.
+	struct msg donut;
+};
+struct delegated *combine_head, *combine_tail;
+int combine_waiting;           // Donuts in combine_head, for the metrics.
+// Donuts and answers go between nodes encoded like the libraries' messages
+// (see codec.h), the answer as one CODEC_INT.
+static const struct codec_field donut_schema[] = {
+	CODEC_FIELD(CODEC_UINT, struct msg, node_id),
+	CODEC_FIELD(CODEC_INT,  struct msg, donut_number),
+	CODEC_FIELD(CODEC_UINT, struct msg, token),
+};
+pthread_mutex_t combine_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t combine_cond = PTHREAD_COND_INITIALIZER;
+long combine_msgs, combine_bytes;   // Delegation frames sent.
+long combined, batches;             // Donuts written and locks taken for them.
+// Set while the combiner waits for the grant or holds the lock (dme_lock).
+int combining, combine_granted;
+unsigned int combine_token;
+pthread_cond_t granted_cond = PTHREAD_COND_INITIALIZER;
+void *combiner_thread(void *arg);
+
+// Library swaps (DME_CONTROL, v2 libraries only)
+// DME_CONTROL names a Unix socket on which the node controller answers HTTP
+// requests, GET /metrics (see below) and, for a v2 library, swaps.
+// POST /swap?library=<path>[&donuts=<n>] waits for the producer to
+// finish, puts another library in place of the running one while the
+// connections stay up, and starts a new producer. Each library loaded is a
+// generation. The node puts a FRAME_SWAP on every flow behind the last frame
+// of the old library, its own included, so what arrives is known to be of the
+// generation that came before it. Frames of older generations are dropped, and those of a
+// newer one, from peers that swapped first, are held until this node swaps
+// too. Before it swaps, a node waits for its producer to finish and its lock
+// to be idle, and tells the peers with a FRAME_DONE. Its old library keeps
+// answering them until every peer that is not suspected down has sent one as
+// well, so no request of the old generation is left waiting on it, and what
+// is dropped afterwards nobody waits for. The swap is refused if that takes
+// longer than SWAP_WAIT_MS, so every node has to be asked within that time.
+#define SWAP_WAIT_MS 20000
+char *control_path;
+void *dme_handle;
+int generation;                // Libraries loaded before the running one (dme_lock).
+int *peer_gen;                 // FRAME_SWAPs received from each peer (dme_lock).
+int *peer_done;                // Generation after the last each peer is done with (dme_lock).
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+struct held {
+	struct held *next;
+	int from, gen;
+	unsigned int off, len;     // Payload of the frame in ref.
+	struct frame *ref;
+};
+struct held *held_head, *held_tail;  // Frames of a newer generation (dme_lock).
+pid_t prod_pid;                // 0 once it has exited.
+static void start_producer(const char *library, int donuts);
+void *control_thread(void *arg);
+
+// Metrics (GET /metrics on the DME_CONTROL socket)
+// Counted with relaxed atomic adds by the threads that do the work, and read
+// without locks when asked for, so they cost the hot path no lock. Latencies
+// of the last LATENCIES grants are kept in a ring written under dme_lock,
+// which the acquire and the grant hold already.
+#define LATENCIES 1024
+struct peer_stats {
+	long frames_in, bytes_in;      // Written by the peer's receiver thread only.
+	long frames_out, bytes_out;
+};
+struct peer_stats *peer_stats;     // Indexed by node id.
+long handled;                      // Messages handed to the library.
+int held_count;                    // Frames in held_head.
+long acquired_us;                  // When the waiting acquire was made (dme_lock).
+long latency[LATENCIES];           // Acquire to grant (us), latency_count % LATENCIES is next.
+long latency_count, latency_sum;
+
+// Emulated links to each peer, indexed by node id, when DME_NETEM names a matrix
+// file (see netem.h). NULL otherwise.
+struct netem_link *links;
+static void write_delayed(int nid, unsigned char *buf, unsigned int len);
+
+// Frames and bytes (headers included) sent for the running library, reported
+// on SIGTERM and when it is swapped out, which starts them again from 0.
+// Counted with relaxed atomic adds, by whichever thread runs the library.
+long sent_msgs, sent_bytes;
+
+// Buffered reader used by a receiver thread, so headers do not cost a read() per byte.
+struct reader {
+	int fd;
+	int node;
+	int pos, len;
+	unsigned char buf[4096];
+};
+
 // Signal thread
 // This will remain blocked until a signal arrives 
 // (recommended technique when dealing with threads and signals)
@@ -85,11 +320,72 @@ void error(int error_code, char *msg, ...) {
 	exit(error_code);
 }
 
+// Reads a positive integer from the environment, or returns def.
+static int env_int(const char *name, int def) {
+	char *env = getenv(name);
+	int v;
+
+	if (env == NULL)
+		return def;
+	if ((v = atoi(env)) <= 0) {
+		fprintf(stderr, "Invalid %s %s, using %d\n", name, env, def);
+		return def;
+	}
+	return v;
+}
+
+// Finds the host and port of node nid (see NC_HOST).
+static void node_addr(int nid, char *host, int len, int *port) {
+	char *env = getenv("DME_HOSTS");
+	char *p, *c;
+	int i;
+
+	snprintf(host, len, NC_HOST, nid);
+	*port = NC_PORT;
+	if (env == NULL)
+		return;
+	for (p = env, i = 1; i < nid && p != NULL; i++)
+		if ((p = strchr(p, ',')) != NULL)
+			p++;
+	if (p == NULL)
+		error(1, "DME_HOSTS has no entry for node %d\n", nid);
+	snprintf(host, len, "%.*s", (int) strcspn(p, ","), p);
+	if ((c = strchr(host, ':')) != NULL) {
+		*c = '\0';
+		*port = atoi(c + 1);
+	}
+}
+
+// Sets the buffers of a socket to the peers to DME_SOCK_BUF bytes, if set.
+static void sock_buf(int fd) {
+	int size = env_int("DME_SOCK_BUF", 0);
+
+	if (size > 0 && (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0 ||
+	                 setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0))
+		perror("Cannot set socket buffers ");
+}
+
+// Monotonic clock in microseconds, for latencies.
+static long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Wall clock in milliseconds.
+static long now_ms(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
 int main(int argc, char *argv[]) { 
 	// Command line arguments
 	// General variables
-	int n_id, i, n;
-	char buffer[256];
+	int n_id, i, n, peer, port, tries, one = 1;
+	char buffer[256], host[256];
 
 	// Socket variables
 	int sockfd_c, sockfd_l, newsockfd;
@@ -100,13 +396,13 @@ int main(int argc, char *argv[]) {
 	sigset_t all_signals;
 	struct sigaction new_act;
 	int nsigs;
-	int sigs[] = { SIGTERM, SIGBUS, SIGSEGV, SIGFPE };
+	// SIGTERM and SIGINT stay blocked, sig_waiter takes them.
+	int sigs[] = { SIGBUS, SIGSEGV, SIGFPE };
 
 	// Thread variables
 	pthread_t thread_id;
 
 	// dynamic library variables
-	void *handle;
 	void *(*dme_msg_handler)(void*);
     int msg_args[2]; // arguments for msg_handler (node id and total nodes)
 
@@ -116,13 +412,20 @@ int main(int argc, char *argv[]) {
 
 	n_id  = atoi(argv[1]);
 	n_tot = atoi(argv[2]);
+	my_nid = n_id;
 	// Open shared library and define functions functions
-	handle = dlopen(argv[3], RTLD_LAZY);
-	if (!handle) {
+	dme_handle = dlopen(argv[3], RTLD_LAZY);
+	if (!dme_handle) {
 		fprintf(stderr, "%s\n", dlerror());
 		exit(1);
 	}
-	dme_msg_handler = dlsym(handle, "dme_msg_handler");
+	// v2 libraries export their entry points in one table, v1 ones a handler thread.
+	dme_ops = dlsym(dme_handle, DME_OPS_SYMBOL);
+	if (dme_ops != NULL && dme_ops->version != DME_ABI_V2)
+		error(1, "Unsupported library version %d\n", dme_ops->version);
+	dme_msg_handler = dlsym(dme_handle, "dme_msg_handler");
+	if (dme_ops == NULL && dme_msg_handler == NULL)
+		error(1, "%s has neither %s nor dme_msg_handler\n", argv[3], DME_OPS_SYMBOL);
 	
 	
 	// Setup for managing signals	
@@ -149,25 +452,63 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "pthread_create failed\n");
 		exit(1);
 	}
+	place(thread_id, "io", "signal thread");
 
 	// Creating message queue.
 	// This will be used to relay messages from:
 	// 1. Processes that want to execute a critical section to the dme thread
 	// 2. The receiver thread to the dme thread
 	// 3. The dme thread to process waiting to execute critical section
-	// 4. The dme thread to sender thread
-	if ((msqid = msgget(M_ID, (IPC_CREAT | 0600))) == -1) {
+	// 4. A v1 library to the relay thread
+	if ((msqid = msgget(dme_queue_key(), (IPC_CREAT | 0600))) == -1) {
 		perror("msgget failed :\n");
 		exit(1);
 	}
 	
+	// The flows take messages from the library as soon as it starts.
+	flow_cap = env_int("DME_FLOW_CAP", FLOW_CAP);
+	if ((out_flows = (struct flow *) calloc(n_tot + 1, sizeof(struct flow))) == NULL)
+		error(1, "ERROR on malloc\n");
+	for (i = 1; i <= n_tot; i++)
+		flow_init(&out_flows[i], flow_cap);
+
 	// Start distributed mutual exclusion message handler.
 	msg_args[0] = n_id;
     msg_args[1] = n_tot;
+	lease_ms = env_int("DME_LEASE_MS", 0);
+	if (lease_ms > 0 && dme_ops == NULL) {
+		fprintf(stderr, "Leases need a v2 library, DME_LEASE_MS ignored\n");
+		lease_ms = 0;
+	}
+	if (dme_ops != NULL) {
+		// Set up the instance before any receiver thread can call it.
+		if ((dme_ctx = calloc(1, dme_ops->ctx_size)) == NULL)
+			error(1, "ERROR on malloc\n");
+		dme_env.arg   = NULL;
+		dme_env.send  = dme_send;
+		dme_env.grant = dme_grant;
+		dme_ops->init(dme_ctx, &dme_env, n_id, n_tot);
+		printf("Running %s (v2 library)\n", dme_ops->name);
+		if (lease_ms > 0)
+			printf("Leases of %d ms\n", lease_ms);
+		fflush(stdout);
+		dme_msg_handler = dme_thread;
+		if (pthread_create(&thread_id, NULL, timer_thread, NULL) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+		place(thread_id, "handler", "timer thread");
+		if (pthread_create(&thread_id, NULL, loopback_thread, NULL) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+		place(thread_id, "handler", "loopback");
+	}
     if (pthread_create(&thread_id, NULL, (*dme_msg_handler), (void *) &msg_args) != 0) {
 		fprintf(stderr, "pthread_create failed\n");
 		exit(1);
 	}
+	place(thread_id, "handler", "dme handler");
 
 	// Begin socket connection
 	// After binding the listening socket, socket connections are created for each node with a smaller node id.
@@ -175,18 +516,23 @@ int main(int argc, char *argv[]) {
 	// and a sender/receiver thread is created to perform read()s and write()s on that fd. 
 	// There will be one socket that listens for connections from other nodes with larger node ids.
 	// When an accept() comes in, a receiver thread is created.
-	// The sender thread looks at the message queue and write()s to the socket file descriptor matching the node the message is intended for.
+	// The sender thread of each node takes its frames off its flow and write()s them to its socket file descriptor.
 	// The receiver thread reads() from the socket file descriptor and places the message in the message queue. 
 	printf("Creating socket...\n");
         fflush(stdout);
 	if ((sockfd_l = socket(AF_INET, SOCK_STREAM, 0)) == -1)
 		error(1, "Error on socket creation\n");
+	// A node restarted right after a run can bind while old connections linger.
+	setsockopt(sockfd_l, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	// Accepted connections take the listening socket's buffers.
+	sock_buf(sockfd_l);
 
 	// Set up host address
+	node_addr(n_id, host, sizeof(host), &port);
 	bzero((char*) &host_addr, sizeof(host_addr));
 	host_addr.sin_family      = AF_INET;
 	host_addr.sin_addr.s_addr = INADDR_ANY;
-	host_addr.sin_port        = htons(NC_PORT);
+	host_addr.sin_port        = htons(port);
 
 	if (bind(sockfd_l, (struct sockaddr *) & host_addr, sizeof(host_addr)) < 0)
 		error(2, "Error on bind\n");
@@ -196,20 +542,25 @@ int main(int argc, char *argv[]) {
 
 	// Allocate array for socket file descriptors
 	sock_fds = (int *) malloc(sizeof(int) * n_tot);
-	for (i = 0; i < n_tot; i++)
-		sock_fds[i] = -1;
-	if (sock_fds == NULL) 
+	sock_locks = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t) * n_tot);
+	beats = (struct beat *) calloc(n_tot, sizeof(struct beat));
+	peers = (struct peer *) calloc(n_tot + 1, sizeof(struct peer));
+	peer_gen = (int *) calloc(n_tot + 1, sizeof(int));
+	peer_done = (int *) calloc(n_tot + 1, sizeof(int));
+	peer_stats = (struct peer_stats *) calloc(n_tot + 1, sizeof(struct peer_stats));
+	if (sock_fds == NULL || sock_locks == NULL || beats == NULL || peers == NULL || peer_gen == NULL || peer_done == NULL || peer_stats == NULL)
 		error(2, "ERROR on malloc\n");
+	for (i = 0; i < n_tot; i++) {
+		sock_fds[i] = -1;
+		pthread_mutex_init(&sock_locks[i], NULL);
+	}
 
 	printf("Connecting to other nodes...\n");
         fflush(stdout);
 	for (i = 1; i < n_id; i++) {
-		// Creating new socket for connection
-		if ((sockfd_c = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-			error(2, "Error on socket creation\n");
-		
 		// Getting host information in order to connect.
-		server = gethostbyname(MY_NODES[i]);
+		node_addr(i, host, sizeof(host), &port);
+		server = gethostbyname(host);
 
 		if (server == NULL)
 			error(2, "Failed on hostname resolution\n");
@@ -217,10 +568,21 @@ int main(int argc, char *argv[]) {
 		bzero((char *) &serv_addr, sizeof(serv_addr));
 		serv_addr.sin_family = AF_INET;
 		bcopy((char *) server->h_addr, (char *) &serv_addr.sin_addr.s_addr, server->h_length);
-		serv_addr.sin_port = htons(NC_PORT);
+		serv_addr.sin_port = htons(port);
 
-		if (connect(sockfd_c, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
-			error(2, "Failed on node_controller connection.\n");
+		// The other node may still be starting, so a refused connect is retried.
+		for (tries = 1; ; tries++) {
+			// Creating new socket for connection
+			if ((sockfd_c = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+				error(2, "Error on socket creation\n");
+			sock_buf(sockfd_c);
+			if (connect(sockfd_c, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == 0)
+				break;
+			close(sockfd_c);
+			if (tries == CONNECT_TRIES)
+				error(2, "Failed on node_controller connection.\n");
+			usleep(100000);
+		}
 
 		// Once the connection has been made, provide a node id to the connected server, and read its node id.
 		n = write(sockfd_c, argv[1], strlen(argv[1]));
@@ -240,6 +602,8 @@ int main(int argc, char *argv[]) {
 			perror("Error on thread creation\n");
 			exit(1);
 		}	
+		sprintf(buffer, "receiver for node %d", i);
+		place(thread_id, "io", buffer);
 	}
 
 	printf("Accepting calls from other nodes...\n");
@@ -253,46 +617,130 @@ int main(int argc, char *argv[]) {
 		n = read(newsockfd,buffer, 255);
 		if (n < 0)
 			error(2, "Error reading from socket\n");
-		n = atoi(buffer);
-		printf("Accepted connection from node %d.\n", n);
+		peer = atoi(buffer);
+		// Nodes that start together may call in any order.
+		if (peer <= n_id || peer > n_tot || sock_fds[peer-1] != -1)
+			error(2, "Unexpected connection from node %d.\n", peer);
+		printf("Accepted connection from node %d.\n", peer);
                 fflush(stdout);
 		n = write(newsockfd, argv[1], strlen(argv[1]));
 		if (n < 0)
 			error(2, "Error reading from socket\n");
 		
-		sock_fds[i-1] = newsockfd;
+		sock_fds[peer-1] = newsockfd;
 	        // TODO keep thread ids for closing later
-		if (pthread_create(&thread_id, NULL, receiver_thread, (void *) &sock_fds[i-1]) != 0) {
+		if (pthread_create(&thread_id, NULL, receiver_thread, (void *) &sock_fds[peer-1]) != 0) {
 			perror("Error on thread creation\n");
 			exit(1);
 		}	
+		sprintf(buffer, "receiver for node %d", peer);
+		place(thread_id, "io", buffer);
 
 	}
 	
-	// Start sender thread.
-	if (pthread_create(&thread_id, NULL, sender_thread, NULL) != 0) {
-		fprintf(stderr, "pthread_create failed\n");
-		exit(1);
+	// Emulated links start before anything is sent.
+	if (getenv("DME_NETEM") != NULL) {
+		if ((links = (struct netem_link *) calloc(n_tot + 1, sizeof(struct netem_link))) == NULL)
+			error(2, "ERROR on malloc\n");
+		if ((n = netem_load(getenv("DME_NETEM"), n_id, n_tot, links, write_delayed)) < 0)
+			error(2, "Cannot emulate links from %s\n", getenv("DME_NETEM"));
+		printf("Emulating %d links from %s\n", n, getenv("DME_NETEM"));
+		for (i = 1; i <= n_tot; i++) {
+			if (!links[i].on)
+				continue;
+			printf("NETEM: to node %d, %.1f ms delay, %.1f ms jitter, %.0f kbit/s, %.2f%% loss\n",
+			       i, links[i].delay, links[i].jitter, links[i].kbps, links[i].loss * 100);
+			if (pthread_create(&thread_id, NULL, netem_thread, &links[i]) != 0) {
+				fprintf(stderr, "pthread_create failed\n");
+				exit(1);
+			}
+			sprintf(buffer, "link to node %d", i);
+			place(thread_id, "io", buffer);
+		}
+		fflush(stdout);
+	}
+
+	// Start sender threads, and the relay that feeds them for a v1 library.
+	for (i = 1; i <= n_tot; i++) {
+		if (i == n_id)
+			continue;
+		if (pthread_create(&thread_id, NULL, sender_thread, &out_flows[i]) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+		sprintf(buffer, "sender for node %d", i);
+		place(thread_id, "io", buffer);
 	}
+	if (dme_ops == NULL) {
+		if (pthread_create(&thread_id, NULL, relay_thread, NULL) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+		place(thread_id, "io", "relay");
+	}
+	printf("Flows of %d frames\n", flow_cap);
 	printf("Fully connected!\n");
         fflush(stdout);
 
-	switch( fork() ) {
-		case -1:
-			error(2, "Error forking");
-		case  0:
-            printf("Setting up producer process.\n");
-            fflush(stdout);
-            // The number of donuts this producer should create.
-			sprintf(buffer, "%d", 100); 
-			execl("/bin/prod", "prod", argv[1], buffer, argv[3], NULL);
-            perror("Error running producer\n");
-            exit(1);
+	// Start failure detection once every peer is connected.
+	hb_ms         = env_int("DME_HEARTBEAT_MS", HEARTBEAT_MS);
+	fd_timeout_ms = env_int("DME_FD_TIMEOUT_MS", FD_TIMEOUT_MS);
+	fd_phi        = getenv("DME_FD_PHI") != NULL ? atof(getenv("DME_FD_PHI")) : 0;
+	pthread_mutex_lock(&fd_lock);
+	for (i = 1; i <= n_tot; i++)
+		peers[i].last = now_ms();
+	pthread_mutex_unlock(&fd_lock);
+	if (fd_phi > 0)
+		printf("Heartbeat every %d ms, phi detector with threshold %.1f\n", hb_ms, fd_phi);
+	else
+		printf("Heartbeat every %d ms, peers suspected after %d ms\n", hb_ms, fd_timeout_ms);
+	fflush(stdout);
+	if (pthread_create(&thread_id, NULL, heartbeat_thread, NULL) != 0) {
+		fprintf(stderr, "pthread_create failed\n");
+		exit(1);
+	}
+	place(thread_id, "io", "heartbeat");
+	if (pthread_create(&thread_id, NULL, detector_thread, NULL) != 0) {
+		fprintf(stderr, "pthread_create failed\n");
+		exit(1);
 	}
-	// Run forever.
-	for(;;);
+	place(thread_id, "io", "failure detector");
 
-	dlclose(handle);
+	// The combiner starts once it can send answers back.
+	combiner = env_int("DME_DELEGATE", 0);
+	if (combiner != 0 && dme_ops == NULL) {
+		fprintf(stderr, "Delegation needs a v2 library, DME_DELEGATE ignored\n");
+		combiner = 0;
+	}
+	if (combiner < 0 || combiner > n_tot)
+		error(2, "DME_DELEGATE names node %d, there are %d\n", combiner, n_tot);
+	if (combiner == n_id) {
+		printf("Combining the donuts of every node\n");
+		fflush(stdout);
+		if (pthread_create(&thread_id, NULL, combiner_thread, NULL) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+		place(thread_id, "handler", "combiner");
+	}
+
+	// The control socket is up before the producer can finish.
+	if ((control_path = getenv("DME_CONTROL")) != NULL && *control_path == '\0')
+		control_path = NULL;
+	if (control_path != NULL) {
+		if (pthread_create(&thread_id, NULL, control_thread, NULL) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+		place(thread_id, "io", "control");
+	}
+
+	start_producer(argv[3], env_int("DME_DONUTS", DONUTS));
+	// Run forever, sig_waiter ends the process.
+	for(;;)
+		pause();
+
+	dlclose(dme_handle);
 
 	return 0;
 }
@@ -302,94 +750,1332 @@ void sig_handler(int sig) {
 }
 
 void *sig_waiter(void *arg) {
+	// Waits for SIGTERM or SIGINT, which every thread blocks, then reports
+	// what was sent for the library and for delegation, and exits.
+	sigset_t stop;
+	int sig;
+
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGTERM);
+	sigaddset(&stop, SIGINT);
+	sigwait(&stop, &sig);
+	printf("NC: %ld messages, %ld bytes sent\n",
+		__atomic_load_n(&sent_msgs, __ATOMIC_RELAXED) + __atomic_load_n(&combine_msgs, __ATOMIC_RELAXED),
+		__atomic_load_n(&sent_bytes, __ATOMIC_RELAXED) + __atomic_load_n(&combine_bytes, __ATOMIC_RELAXED));
+	pthread_mutex_lock(&combine_lock);
+	if (combiner == my_nid)
+		printf("NC: combined %ld donuts under %ld locks\n", combined, batches);
+	pthread_mutex_unlock(&combine_lock);
+	fflush(stdout);
+	exit(0);
+}
+
+// Starts a producer that makes donuts donuts, taking the lock through library.
+static void start_producer(const char *library, int donuts) {
+	char id[16], count[16];
+	sigset_t all_signals;
+
+	sprintf(id, "%d", my_nid);
+	sprintf(count, "%d", donuts);
+	printf("Setting up producer process.\n");
+	fflush(stdout);
+	switch (prod_pid = fork()) {
+		case -1:
+			error(2, "Error forking");
+		case  0:
+			// The producer gets the signals this process leaves to sig_waiter.
+			sigfillset(&all_signals);
+			sigprocmask(SIG_UNBLOCK, &all_signals, NULL);
+			// Its placement survives the exec.
+			place(pthread_self(), "producer", "producer");
+			execl(getenv("DME_PROD") != NULL ? getenv("DME_PROD") : PROD_PATH, "prod", id, count, library, NULL);
+			perror("Error running producer\n");
+			_exit(1);
+	}
+}
+
+// Refills the reader's buffer. Returns -1 on EOF or error.
+static int reader_fill(struct reader *r) {
+	int x;
+
+	if ((x = read(r->fd, r->buf, sizeof(r->buf))) == -1) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
+	if (x == 0)
+		return -1;
+	r->pos = 0;
+	r->len = x;
+	return 0;
+}
+
+// Returns the next byte, or -1 on EOF or error.
+static int reader_byte(struct reader *r) {
+	if (r->pos == r->len && reader_fill(r) == -1)
+		return -1;
+	return r->buf[r->pos++];
+}
+
+static int reader_varint(struct reader *r, unsigned int *v) {
+	int b, shift;
+
+	*v = 0;
+	for (shift = 0; shift < 35; shift += 7) {
+		if ((b = reader_byte(r)) == -1)
+			return -1;
+		*v |= (unsigned int) (b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	fprintf(stderr, "Malformed frame from node %d\n", r->node);
+	return -1;
+}
+
+// Reads n bytes, first from the buffer and then straight from the socket.
+static int reader_bytes(struct reader *r, unsigned char *dst, unsigned int n) {
+	unsigned int i;
+	int x;
+
+	for (i = 0; i < n && r->pos < r->len; )
+		dst[i++] = r->buf[r->pos++];
+	while (i < n) {
+		if ((x = read(r->fd, dst + i, n - i)) == -1) {
+			fprintf(stderr, "%s\n", strerror(errno));
+			return -1;
+		}
+		if (x == 0)
+			return -1;
+		i += x;
+	}
+	return 0;
+}
+
+// Writes the whole frame, header then payload. Returns -1 if the peer is gone
+// (SIGPIPE is blocked, so a closed connection shows up as EPIPE).
+static int write_frame(int fd, unsigned char *hdr, int hlen, char *payload, unsigned int len) {
+	struct iovec iov[2];
+	ssize_t x;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len  = hlen;
+	iov[1].iov_base = payload;
+	iov[1].iov_len  = len;
+	while (iov[0].iov_len + iov[1].iov_len > 0) {
+		if ((x = writev(fd, iov, 2)) == -1)
+			return -1;
+		if (x >= iov[0].iov_len) {
+			x -= iov[0].iov_len;
+			iov[0].iov_len = 0;
+			iov[1].iov_base = (char *) iov[1].iov_base + x;
+			iov[1].iov_len -= x;
+		}
+		else {
+			iov[0].iov_base = (char *) iov[0].iov_base + x;
+			iov[0].iov_len -= x;
+		}
+	}
+	return 0;
+}
+
+// Writes node nid the rest of a heartbeat, and one that is due. Without wait,
+// only what the socket buffer takes is written and the rest is kept. Called
+// with sock_locks[nid-1] held. Returns -1 if the peer is gone.
+static int write_beat(int nid, int wait) {
+	struct beat *b = &beats[nid-1];
+	ssize_t x;
+
+	if (b->len == 0 && __atomic_exchange_n(&b->due, 0, __ATOMIC_RELAXED)) {
+		b->off = 0;
+		b->len = frame_header(b->buf, 0, FRAME_HEARTBEAT, nid);
+		__atomic_fetch_add(&peer_stats[nid].frames_out, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&peer_stats[nid].bytes_out, b->len, __ATOMIC_RELAXED);
+	}
+	while (b->len > 0) {
+		if ((x = send(sock_fds[nid-1], b->buf + b->off, b->len, wait ? 0 : MSG_DONTWAIT)) == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		b->off += x;
+		b->len -= x;
+	}
+	return 0;
+}
+
+// Writes a frame to node nid, unless its connection is gone.
+static void write_peer(int nid, unsigned char *hdr, int hlen, char *payload, unsigned int len) {
+	pthread_mutex_lock(&sock_locks[nid-1]);
+	if (sock_fds[nid-1] != -1 && (write_beat(nid, 1) == -1 || write_frame(sock_fds[nid-1], hdr, hlen, payload, len) == -1)) {
+		printf("Error writing to node %d: %s\n", nid, strerror(errno));
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&sock_locks[nid-1]);
+	__atomic_fetch_add(&peer_stats[nid].frames_out, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&peer_stats[nid].bytes_out, hlen + len, __ATOMIC_RELAXED);
+}
+
+// Writes a frame an emulated link held back.
+static void write_delayed(int nid, unsigned char *buf, unsigned int len) {
+	write_peer(nid, buf, len, NULL, 0);
+}
+
+// Sends a frame to node nid, through the emulated link if there is one.
+static void send_frame(int nid, unsigned char *hdr, int hlen, char *payload, unsigned int len) {
+	if (links != NULL && links[nid].on)
+		netem_send(&links[nid], hdr, hlen, payload, len);
+	else
+		write_peer(nid, hdr, hlen, payload, len);
+}
+
+// Tells the library about a change in a peer's state. v1 libraries cannot be
+// told, so for them it is only logged.
+static void report_peer(int nid, int up) {
+	printf("NC: node %d is %s\n", nid, up ? "up again" : "suspected down");
+	fflush(stdout);
+	if (dme_ops == NULL)
+		return;
+	pthread_mutex_lock(&dme_lock);
+	if (up && dme_ops->on_peer_up != NULL)
+		dme_ops->on_peer_up(dme_ctx, nid);
+	if (!up && dme_ops->on_peer_down != NULL)
+		dme_ops->on_peer_down(dme_ctx, nid);
+	give_back();
+	pthread_mutex_unlock(&dme_lock);
+}
+
+// A heartbeat arrived from node nid.
+static void heard(int nid) {
+	struct peer *p = &peers[nid];
+	long now = now_ms();
+	int up;
+
+	pthread_mutex_lock(&fd_lock);
+	if (p->last != 0) {
+		p->win[p->wpos] = now - p->last;
+		p->wpos = (p->wpos + 1) % FD_WINDOW;
+		if (p->nwin < FD_WINDOW)
+			p->nwin++;
+	}
+	p->last = now;
+	up = p->suspected && !p->closed;
+	if (up)
+		p->suspected = 0;
+	pthread_mutex_unlock(&fd_lock);
+	if (up)
+		report_peer(nid, 1);
+}
+
+// Suspicion level of a peer not heard from for t ms: -log10 of the chance that
+// a heartbeat comes this late, taking the intervals to be normally distributed.
+static double phi(struct peer *p, long t) {
+	double mean = 0, var = 0, sd, later;
+	int i;
+
+	for (i = 0; i < p->nwin; i++)
+		mean += p->win[i];
+	mean /= p->nwin;
+	for (i = 0; i < p->nwin; i++)
+		var += (p->win[i] - mean) * (p->win[i] - mean);
+	sd = sqrt(var / p->nwin);
+	// Steady heartbeats would otherwise make any delay look fatal.
+	if (sd < hb_ms / 10.0)
+		sd = hb_ms / 10.0;
+	later = 0.5 * erfc((t - mean) / (sd * sqrt(2)));
+	return later > 1e-300 ? -log10(later) : 300;
+}
+
+void *heartbeat_thread(void *arg) {
+	// Sends every peer an empty heartbeat frame every hb_ms, without waiting
+	// on its socket (see sock_locks). An emulated link has a thread to wait.
+	unsigned char hdr[FRAME_HDR_MAX];
+	int i, hlen;
+
+	for (;;) {
+		for (i = 1; i <= n_tot; i++) {
+			if (i == my_nid)
+				continue;
+			if (links != NULL && links[i].on) {
+				hlen = frame_header(hdr, 0, FRAME_HEARTBEAT, i);
+				send_frame(i, hdr, hlen, NULL, 0);
+				continue;
+			}
+			__atomic_store_n(&beats[i-1].due, 1, __ATOMIC_RELAXED);
+			if (pthread_mutex_trylock(&sock_locks[i-1]) != 0)
+				continue;
+			if (sock_fds[i-1] != -1 && write_beat(i, 0) == -1) {
+				printf("Error writing to node %d: %s\n", i, strerror(errno));
+				fflush(stdout);
+			}
+			pthread_mutex_unlock(&sock_locks[i-1]);
+		}
+		usleep(hb_ms * 1000);
+	}
+	return NULL;
+}
+
+void *detector_thread(void *arg) {
+	// Checks every peer twice per heartbeat interval.
+	struct peer *p;
+	long now;
+	int i, down;
+
+	for (;;) {
+		usleep(hb_ms * 500);
+		for (i = 1; i <= n_tot; i++) {
+			if (i == my_nid)
+				continue;
+			p = &peers[i];
+			pthread_mutex_lock(&fd_lock);
+			now  = now_ms();
+			down = 0;
+			if (!p->suspected && !p->paused) {
+				// Until there are a few intervals to go on, the timeout applies.
+				if (fd_phi > 0 && p->nwin >= 3)
+					down = phi(p, now - p->last) > fd_phi;
+				else
+					down = now - p->last > fd_timeout_ms;
+				p->suspected = down;
+			}
+			pthread_mutex_unlock(&fd_lock);
+			if (down)
+				report_peer(i, 0);
+		}
+	}
+	return NULL;
+}
+
+// Keeps a frame of a generation this node has not reached. Called with dme_lock held.
+static void hold(int from, MSG *qmsg, unsigned int off, unsigned int len) {
+	struct held *h;
+
+	if ((h = (struct held *) malloc(sizeof(struct held))) == NULL)
+		error(0, "Error on malloc\n");
+	h->next = NULL;
+	h->from = from;
+	h->gen  = peer_gen[from];
+	h->off  = off;
+	h->len  = len;
+	h->ref  = qmsg->ref;
+	qmsg->ref = NULL;
+	if (held_tail == NULL)
+		held_head = h;
+	else
+		held_tail->next = h;
+	held_tail = h;
+	__atomic_fetch_add(&held_count, 1, __ATOMIC_RELAXED);
+}
+
+// The connection to node nid closed: the node is down for good.
+static void peer_lost(struct reader *r) {
+	int report;
+
+	printf("Connection to node %d lost\n", r->node);
+	fflush(stdout);
+	pthread_mutex_lock(&sock_locks[r->node-1]);
+	close(r->fd);
+	sock_fds[r->node-1] = -1;
+	pthread_mutex_unlock(&sock_locks[r->node-1]);
+
+	pthread_mutex_lock(&fd_lock);
+	report = !peers[r->node].suspected;
+	peers[r->node].suspected = 1;
+	peers[r->node].closed    = 1;
+	pthread_mutex_unlock(&fd_lock);
+	if (report)
+		report_peer(r->node, 0);
+}
+
+// Whether a flow to a peer is at capacity.
+static int flows_full(void) {
+	int i;
+
+	for (i = 1; i <= n_tot; i++)
+		if (i != my_nid && __atomic_load_n(&out_flows[i].depth, __ATOMIC_RELAXED) >= flow_cap)
+			return 1;
+	return 0;
+}
+
+// Waits until every flow to a peer has room before input is taken, from node
+// from or locally (0). Called with dme_lock held, which the sender threads
+// take to say a flow went below capacity, and every call of the library holds.
+static void wait_room(int from) {
+	if (!flows_full())
+		return;
+	__atomic_fetch_add(&flow_waits, 1, __ATOMIC_RELAXED);
+	if (from != 0) {
+		pthread_mutex_lock(&fd_lock);
+		peers[from].paused = 1;
+		pthread_mutex_unlock(&fd_lock);
+	}
+	while (flows_full())
+		pthread_cond_wait(&room_cond, &dme_lock);
+	if (from != 0) {
+		// Its heartbeats were waiting behind the frame.
+		pthread_mutex_lock(&fd_lock);
+		peers[from].paused = 0;
+		peers[from].last   = now_ms();
+		pthread_mutex_unlock(&fd_lock);
+	}
+}
+
+// Whether a receiver for a v1 library should wait before queueing a message,
+// which it counts.
+static int queue_full(void) {
+	struct msqid_ds q;
+
+	if (msgctl(msqid, IPC_STAT, &q) == -1)
+		error(0, "Error in message queue\n");
+	if (q.msg_qnum < (msgqnum_t) flow_cap && q.__msg_cbytes <= q.msg_qbytes / 2)
+		return 0;
+	__atomic_fetch_add(&rx_waits, 1, __ATOMIC_RELAXED);
+	return 1;
 }
 
 void *receiver_thread(void *arg) {
 	// Receiver gets message from socket and places it in the message queue. 
 	int sockfd = *((int *) arg);
-	int i, x, node = -1;
-	char header;
+	int i, type, off;
+	unsigned int len, dest, token, gen;
+	unsigned char hdr[FRAME_HDR_MAX];
+	struct reader *r;
+	struct peer_stats *st;
 	MSG qmsg; 
 
+	if ((r = (struct reader *) malloc(sizeof(struct reader))) == NULL)
+		error(0, "Error on malloc\n");
+	r->fd  = sockfd;
+	r->pos = r->len = 0;
+
 	// Figure out which node this is the receiver thread for.
-	// This is mostly for logging purposes.
+	// This tells the dme thread who sent each message.
+	r->node = -1;
 	for (i = 0; i < n_tot; i++)
 		if (sock_fds[i] == sockfd) {
-			node = i+1;
+			r->node = i+1;
 			break;
 		}
-	if (node == -1)
+	if (r->node == -1)
 		error(0, "Sockfd error\n");
-	printf("Receiver thread for node %d started\n", node, sockfd);
+	st = &peer_stats[r->node];
+	printf("Receiver thread for node %d started\n", r->node);
 	fflush(stdout);
 
 	for (;;) {
 		// Read messages from socket.
-		// Each message has a header that tells the number of bytes in the actual message.
-		if ((x = read(sockfd, &header, 1)) == -1) {
-			fprintf(stderr, "%s\n", strerror(errno));
-			error(0, "Error on read\n");
+		// Each frame has a header with the payload length, frame type and destination (see frame.h).
+		if (reader_varint(r, &len) == -1 || (type = reader_byte(r)) == -1 || reader_varint(r, &dest) == -1)
+			break;
+		if (len > FRAME_MAX) {
+			fprintf(stderr, "Frame of %u bytes from node %d is too large\n", len, r->node);
+			break;
+		}
+		__atomic_store_n(&st->frames_in, st->frames_in + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&st->bytes_in, st->bytes_in + frame_header(hdr, len, type, dest) + len, __ATOMIC_RELAXED);
+		if (type == FRAME_HEARTBEAT && len == 0) {
+			heard(r->node);
+			continue;
+		}
+		if (type == FRAME_SWAP && len == 0) {
+			pthread_mutex_lock(&dme_lock);
+			peer_gen[r->node]++;
+			pthread_mutex_unlock(&dme_lock);
+			printf("Node %d swapped its library\n", r->node);
+			fflush(stdout);
+			continue;
 		}
 
-		if (x == 0)
-			error(0, "EOF on socket\n");
-
-		qmsg.size = header;
-		printf("Receiving message from %d of size %d\n", node, qmsg.size);
-		for (i = 0; i < qmsg.size; i++) {
-			if ((x = read(sockfd, &qmsg.buf[i], 1)) == -1) {
-				fprintf(stderr, "%s\n", strerror(errno));
-				error(0, "Error on read\n");
+		printf("Receiving message from %d of size %u\n", r->node, len);
+		fflush(stdout);
+
+		// The payload is read straight into a pooled frame and handed over by reference.
+		qmsg.ref = frame_get(&rx_pool, len);
+		if (reader_bytes(r, qmsg.ref->data, len) == -1) {
+			msg_release(&qmsg);
+			break;
+		}
+		// Fenced frames only come from v2 libraries in lease mode.
+		off = 0;
+		if (type == FRAME_FENCED && dme_ops != NULL)
+			off = varint_get(qmsg.ref->data, len, &token);
+		// The peer is done with a library (see swap_library).
+		if (type == FRAME_DONE) {
+			if (len > 0 && varint_get(qmsg.ref->data, len, &gen) == (int) len) {
+				pthread_mutex_lock(&dme_lock);
+				if ((int) gen >= peer_done[r->node])
+					peer_done[r->node] = gen + 1;
+				pthread_cond_broadcast(&done_cond);
+				pthread_mutex_unlock(&dme_lock);
 			}
-            printf("%d ", qmsg.buf[i]);
-			if (x == 0)
-				error(0, "EOF on socket\n");
+			msg_release(&qmsg);
+			continue;
 		}
-		printf("Message from %d received\n", node);
-		fflush(stdout);
-		
+		if ((type == FRAME_DELEGATE && combiner == my_nid) || type == FRAME_RESULT) {
+			delegated_frame(type, r->node, qmsg.ref->data, len);
+			msg_release(&qmsg);
+			continue;
+		}
+		if (type != FRAME_DME && off == 0) {
+			printf("Ignoring frame of type %d from %d\n", type, r->node);
+			fflush(stdout);
+			msg_release(&qmsg);
+			continue;
+		}
+
+		// A v2 library is called from here, without going through the queue.
+		if (dme_ops != NULL) {
+			pthread_mutex_lock(&dme_lock);
+			wait_room(r->node);
+			if (off > 0 && token > fence)
+				fence = token;
+			if (peer_gen[r->node] == generation) {
+				dme_ops->on_message(dme_ctx, r->node, qmsg.ref->data + off, len - off);
+				give_back();
+				__atomic_fetch_add(&handled, 1, __ATOMIC_RELAXED);
+			}
+			else if (peer_gen[r->node] > generation)
+				hold(r->node, &qmsg, off, len);
+			else {
+				printf("Dropping a message of the last library from %d\n", r->node);
+				fflush(stdout);
+			}
+			pthread_mutex_unlock(&dme_lock);
+			msg_release(&qmsg);
+			continue;
+		}
+
 		qmsg.type = TO_DME;
-		// This is used to check whether the structure needs its byte order to be changed. 
-		qmsg.network = 1;
+		qmsg.size = len;
+		// The sending node, which also tells the dme thread the message came from the network.
+		qmsg.network = r->node;
+		// Read nothing more while the library, or a peer, is behind (see flow_cap).
+		pthread_mutex_lock(&dme_lock);
+		wait_room(r->node);
+		pthread_mutex_unlock(&dme_lock);
+		while (queue_full())
+			usleep(1000);
 		// Place message on message queue for distributed mutual exclusion algorithm to process.
-		// NOTE: the dme thread that receives this 
-		// will have to convert from network byte order to host byte order (htohl)
-		if (msgsnd(msqid, &qmsg, sizeof(MSG), 0) == -1)
+		// v2 libraries encode their messages portably (see codec.h), v1 ones send raw structs.
+		if (msgsnd(msqid, &qmsg, msg_size(&qmsg), 0) == -1)
 			error(0, "Error in message queue\n");
+		__atomic_fetch_add(&handled, 1, __ATOMIC_RELAXED);
 	}
+	peer_lost(r);
+	free(r);
 	return NULL;
 }
 
+// Puts a frame for node nid on its flow and, for a peer, counts it as sent.
+static void queue_frame(int nid, int type, struct frame *f, unsigned int len) {
+	unsigned char hdr[FRAME_HDR_MAX];
+
+	if (flow_push(&out_flows[nid], type, f, len)) {
+		printf("NC: flow to node %d reached its capacity of %d frames\n", nid, flow_cap);
+		fflush(stdout);
+	}
+	if (nid != my_nid) {
+		__atomic_fetch_add(&sent_msgs, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sent_bytes, frame_header(hdr, len, type, nid) + len, __ATOMIC_RELAXED);
+	}
+}
+
 void *sender_thread(void *arg) {
-	// Sender thread listens to the message queue, and then writes its message to all sockets.
-	// Before actually sending the message, a header must be sent specifying the message size, and type (producer vs. consumer)
-	// Assuming that the dme sender thread handles converting from hardware byte order to network byte order.
-	int i,j;
-	MSG omsg;
+	// Sender thread takes frames off the flow of one node and writes them to its socket.
+	// Before actually sending the message, a header must be sent specifying the message size, type and destination.
+	// Payloads are passed on as they are, the library chose their encoding.
+	struct flow *f = (struct flow *) arg;
+	struct flow_item it;
+	unsigned char hdr[FRAME_HDR_MAX];
+	int nid = f - out_flows, hlen;
 
 	for (;;) {
-		// Blocks until a message for sending is received from the queue
-		// First a message stating what type of process is going to send a request is received,
-		// Then the actuall message will be given. 
-		// The ordering is guaranteed because only the dme_sender thread is writing to this message queue.
-		if (msgrcv(msqid, &omsg, sizeof(MSG), TO_SND, 0) == -1)
-			error(0, "NC: Error on message queue receive\n");
+		// Blocks until there is a frame for the node
+		if (flow_pop(f, &it)) {
+			pthread_mutex_lock(&dme_lock);
+			pthread_cond_broadcast(&room_cond);
+			pthread_mutex_unlock(&dme_lock);
+		}
+		if (it.ref == NULL) {
+			hlen = frame_header(hdr, 0, it.type, nid);
+			send_frame(nid, hdr, hlen, NULL, 0);
+			continue;
+		}
 
-		printf("SENDER: sending message of size %d\n", omsg.size);
+		printf("SENDER: sending message of size %u\n", it.len);
 		fflush(stdout);
 
-		for (i = 0; i < n_tot; i++) {
-			if (sock_fds[i] == -1)
+		hlen = frame_header(hdr, it.len, it.type, nid);
+		send_frame(nid, hdr, hlen, (char *) it.ref->data, it.len);
+		frame_put(it.ref);
+	}
+	return NULL;
+}
+
+void *relay_thread(void *arg) {
+	// Relay thread listens to the message queue, and puts a copy of each message on the flows it is for.
+	struct frame *f;
+	int i;
+	MSG omsg;
+
+	for (;;) {
+		pthread_mutex_lock(&dme_lock);
+		wait_room(0);
+		pthread_mutex_unlock(&dme_lock);
+		// Blocks until a message for sending is received from the queue
+		if (msgrcv(msqid, &omsg, sizeof(MSG) - sizeof(long), TO_SND, 0) == -1)
+			error(0, "NC: Error on message queue receive\n");
+		for (i = 1; i <= n_tot; i++) {
+			if (i == my_nid)
 				continue;
             // omsg.network says whether to broadcast, or send to specific node. 
-            if (omsg.network != 0 && omsg.network != i+1)
+            if (omsg.network != 0 && omsg.network != i)
                 continue;
-			if (write(sock_fds[i], &omsg.size, 1) == -1)
-				error(0, "Error on write\n");
-			for (j = 0; j < omsg.size; j++)
-				if (write(sock_fds[i], &omsg.buf[j], 1) == -1)
-					error(0, "Error on write\n");
+			f = frame_get(&tx_pool, omsg.size);
+			memcpy(f->data, msg_payload(&omsg), omsg.size);
+			queue_frame(i, FRAME_DME, f, omsg.size);
+		}
+		msg_release(&omsg);
+	}
+	return NULL;
+}
+
+// Send callback of a v2 library. Each peer it is for gets a copy on its flow.
+// Messages to this node go to the loopback thread, so the library is never
+// called from inside itself.
+static void dme_send(void *arg, int to, const void *buf, unsigned int len) {
+	struct frame *f;
+	int i, n;
+
+	for (i = 1; i <= n_tot; i++) {
+		if (to == 0 ? i == my_nid : to != i)
+			continue;
+		if ((f = frame_get(&tx_pool, len + 5)) == NULL)
+			error(0, "Message of %u bytes is too large\n", len);
+		// In lease mode the payload goes out behind the fencing token (see lease_ms).
+		n = lease_ms > 0 && i != my_nid ? varint_put(f->data, fence) : 0;
+		memcpy(f->data + n, buf, len);
+		queue_frame(i, n > 0 ? FRAME_FENCED : FRAME_DME, f, len + n);
+	}
+}
+
+// Tells the producer its acquire was not granted (see dme_v2.h).
+static void answer_cancel(void) {
+	MSG omsg;
+
+	omsg.type    = TO_CON;
+	omsg.network = 0;
+	omsg.size    = 1;
+	omsg.ref     = NULL;
+	omsg.buf[0]  = DME_LOCAL_CANCEL;
+	if (msgsnd(msqid, &omsg, msg_size(&omsg), 0) == -1)
+		error(0, "Error in message queue\n");
+}
+
+// Withdraws the waiting acquire and answers the producer. Called with dme_lock held.
+static void withdraw(const char *why) {
+	printf("NC: acquire %s, withdrawn\n", why);
+	fflush(stdout);
+	if (dme_ops->on_local_cancel != NULL) {
+		local_state = L_IDLE;
+		dme_ops->on_local_cancel(dme_ctx);
+	}
+	else
+		local_state = L_ABANDONED;
+	answer_cancel();
+}
+
+// Releases the grant of an abandoned acquire, once the library call that
+// granted it has returned. Called with dme_lock held after every call.
+static void give_back(void) {
+	if (local_state != L_RETURNING)
+		return;
+	printf("NC: grant of a withdrawn acquire given back\n");
+	fflush(stdout);
+	local_state = L_IDLE;
+	dme_ops->on_local_release(dme_ctx);
+}
+
+// Keeps the latency of a grant for the metrics. Called with dme_lock held.
+static void record_latency(long us) {
+	__atomic_store_n(&latency[latency_count % LATENCIES], us, __ATOMIC_RELAXED);
+	__atomic_store_n(&latency_sum, latency_sum + us, __ATOMIC_RELAXED);
+	__atomic_store_n(&latency_count, latency_count + 1, __ATOMIC_RELEASE);
+}
+
+// Grant callback of a v2 library, unblocks the producer waiting in dme_down.
+// In lease mode the grant carries the lease (see dme_v2.h).
+static void dme_grant(void *arg) {
+	struct dme_lease lease;
+	MSG omsg;
+
+	if (local_state == L_ABANDONED) {
+		local_state = L_RETURNING;
+		return;
+	}
+	record_latency(now_us() - acquired_us);
+	local_state  = L_HELD;
+	lease.token  = 0;
+	omsg.type    = TO_CON;
+	omsg.network = 0;
+	omsg.size    = 0;
+	omsg.ref     = NULL;
+	if (lease_ms > 0) {
+		lease.token   = ++fence;
+		lease.expires = now_ms() + lease_ms;
+		lease_held    = 1;
+		lease_until   = lease.expires;
+		lease_token   = lease.token;
+		pthread_cond_signal(&timer_cond);
+		printf("NC: lease with token %u granted\n", lease.token);
+		fflush(stdout);
+		msg_attach(&omsg, &tx_pool, &lease, sizeof(struct dme_lease));
+	}
+	if (combining) {
+		// The combiner asked, not the producer.
+		combine_granted = 1;
+		combine_token   = lease.token;
+		pthread_cond_signal(&granted_cond);
+		msg_release(&omsg);
+		return;
+	}
+	if (msgsnd(msqid, &omsg, msg_size(&omsg), 0) == -1)
+		error(0, "Error in message queue\n");
+}
+
+// The producer, or the combiner, left the critical section. Unless the lease
+// ran out and the lock was released already. Called with dme_lock held.
+static void local_release(void) {
+	if (local_state == L_HELD)
+		dme_ops->on_local_release(dme_ctx);
+	local_state = L_IDLE;
+	lease_held  = 0;
+}
+
+// Sends a delegation frame, already encoded, to node nid.
+static void send_delegated(int nid, int type, void *payload, unsigned int len) {
+	unsigned char hdr[FRAME_HDR_MAX];
+	int hlen;
+
+	hlen = frame_header(hdr, len, type, nid);
+	send_frame(nid, hdr, hlen, payload, len);
+	__atomic_fetch_add(&combine_msgs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&combine_bytes, hlen + len, __ATOMIC_RELAXED);
+}
+
+// Gives the producer of node from the answer to its donut.
+static void answer_delegated(int from, int result) {
+	unsigned char buf[CODEC_FIELD_MAX];
+	struct codec c;
+	MSG omsg;
+
+	if (from != my_nid) {
+		codec_init(&c, buf, sizeof(buf));
+		codec_put_int(&c, result);
+		send_delegated(from, FRAME_RESULT, buf, c.pos);
+		return;
+	}
+	omsg.type    = TO_CON;
+	omsg.network = 0;
+	omsg.ref     = NULL;
+	omsg.size    = sizeof(int);
+	memcpy(omsg.buf, &result, sizeof(int));
+	if (msgsnd(msqid, &omsg, msg_size(&omsg), 0) == -1)
+		error(0, "Error in message queue\n");
+}
+
+// Queues the donut of node from's producer for the combiner, or sends it there.
+static void delegate(int from, struct msg *donut) {
+	unsigned char buf[CODEC_FIELDS(donut_schema) * CODEC_FIELD_MAX];
+	struct delegated *d;
+	int len;
+
+	if (combiner != my_nid) {
+		if ((len = codec_encode(donut_schema, CODEC_FIELDS(donut_schema), donut, buf, sizeof(buf))) < 0)
+			error(0, "Donut cannot be encoded\n");
+		send_delegated(combiner, FRAME_DELEGATE, buf, len);
+		return;
+	}
+	if ((d = (struct delegated *) malloc(sizeof(struct delegated))) == NULL)
+		error(0, "ERROR on malloc\n");
+	d->next  = NULL;
+	d->from  = from;
+	d->donut = *donut;
+	pthread_mutex_lock(&combine_lock);
+	if (combine_tail == NULL)
+		combine_head = d;
+	else
+		combine_tail->next = d;
+	combine_tail = d;
+	__atomic_store_n(&combine_waiting, combine_waiting + 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&combine_cond);
+	pthread_mutex_unlock(&combine_lock);
+}
+
+// A delegation frame of len bytes arrived from node from.
+static void delegated_frame(int type, int from, unsigned char *payload, unsigned int len) {
+	struct msg donut;
+	struct codec c;
+	int result;
+
+	if (type == FRAME_DELEGATE) {
+		if (codec_decode(donut_schema, CODEC_FIELDS(donut_schema), &donut, payload, len) == 0) {
+			delegate(from, &donut);
+			return;
+		}
+	}
+	else {
+		codec_init(&c, payload, len);
+		result = codec_get_int(&c);
+		if (!c.err && c.pos == (int) len) {
+			answer_delegated(my_nid, result);
+			return;
+		}
+	}
+	printf("Ignoring malformed delegation frame from %d\n", from);
+	fflush(stdout);
+}
+
+void *combiner_thread(void *arg) {
+	// Writes every donut waiting under one acquisition of the lock.
+	struct sockaddr_in bm;
+	struct delegated *batch, *d;
+	long n;
+
+	if (!bm_addr(&bm))
+		error(0, "Cannot find the buffer manager\n");
+	for (;;) {
+		pthread_mutex_lock(&combine_lock);
+		while (combine_head == NULL)
+			pthread_cond_wait(&combine_cond, &combine_lock);
+		batch = combine_head;
+		combine_head = combine_tail = NULL;
+		__atomic_store_n(&combine_waiting, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&combine_lock);
+
+		pthread_mutex_lock(&dme_lock);
+		wait_room(0);
+		combining       = 1;
+		combine_granted = 0;
+		local_state     = L_WAITING;
+		acquire_until   = 0;
+		acquired_us     = now_us();
+		dme_ops->on_local_acquire(dme_ctx);
+		while (!combine_granted)
+			pthread_cond_wait(&granted_cond, &dme_lock);
+		pthread_mutex_unlock(&dme_lock);
+
+		for (n = 0, d = batch; d != NULL; d = d->next, n++) {
+			d->donut.token = combine_token;
+			if ((d->result = bm_put(&bm, &d->donut)) == -2)
+				error(0, "Cannot write to the buffer manager: %s\n", strerror(errno));
+		}
+
+		pthread_mutex_lock(&dme_lock);
+		local_release();
+		combining = 0;
+		pthread_mutex_unlock(&dme_lock);
+		printf("NC: combined %ld donuts under one lock\n", n);
+		fflush(stdout);
+
+		pthread_mutex_lock(&combine_lock);
+		combined += n;
+		batches++;
+		pthread_mutex_unlock(&combine_lock);
+		while (batch != NULL) {
+			d = batch;
+			batch = d->next;
+			answer_delegated(d->from, d->result);
+			free(d);
+		}
+	}
+	return NULL;
+}
+
+void *timer_thread(void *arg) {
+	// Takes the lock back from a producer that outlives its lease, and
+	// withdraws an acquire that is not granted in time.
+	struct timespec ts;
+	long next;
+
+	pthread_mutex_lock(&dme_lock);
+	for (;;) {
+		if (lease_held && now_ms() >= lease_until) {
+			printf("NC: lease with token %u expired, releasing the lock\n", lease_token);
+			fflush(stdout);
+			lease_held  = 0;
+			local_state = L_IDLE;
+			dme_ops->on_local_release(dme_ctx);
+		}
+		if (local_state == L_WAITING && acquire_until > 0 && now_ms() >= acquire_until)
+			withdraw("timed out");
+
+		next = lease_held ? lease_until : 0;
+		if (local_state == L_WAITING && acquire_until > 0 && (next == 0 || acquire_until < next))
+			next = acquire_until;
+		if (next == 0) {
+			pthread_cond_wait(&timer_cond, &dme_lock);
+			continue;
+		}
+		ts.tv_sec  = next / 1000;
+		ts.tv_nsec = (next % 1000) * 1000000;
+		pthread_cond_timedwait(&timer_cond, &dme_lock, &ts);
+	}
+	return NULL;
+}
+
+void *dme_thread(void *arg) {
+	// Takes the producer's requests (network 0, see dme_v2.h) off the queue
+	// and hands them to the library.
+	MSG imsg;
+	char *payload;
+	int timeout;
+
+	for (;;) {
+		if (msgrcv(msqid, &imsg, sizeof(MSG) - sizeof(long), TO_DME, 0) == -1)
+			error(0, "NC: Error on message queue receive\n");
+
+		payload = msg_payload(&imsg);
+		if (imsg.network == 0 && imsg.size == 1 + sizeof(struct msg) && payload[0] == DME_LOCAL_DELEGATE) {
+			// Nothing for the library, the donut goes to the combiner.
+			delegate(my_nid, (struct msg *) (payload + 1));
+			msg_release(&imsg);
+			continue;
+		}
+		pthread_mutex_lock(&dme_lock);
+		wait_room(0);
+		if (imsg.size > 0 && payload[0] == DME_LOCAL_ACQUIRE) {
+			timeout = -1;
+			if (imsg.size >= 1 + sizeof(int))
+				memcpy(&timeout, payload + 1, sizeof(int));
+			acquire_until = timeout > 0 ? now_ms() + timeout : 0;
+			acquired_us = now_us();
+			// An abandoned acquire is still on its way, it will do.
+			if (local_state == L_ABANDONED)
+				local_state = L_WAITING;
+			else {
+				local_state = L_WAITING;
+				dme_ops->on_local_acquire(dme_ctx);
+			}
+			if (local_state == L_WAITING && timeout == 0)
+				withdraw("not granted at once");
+			else if (acquire_until > 0)
+				pthread_cond_signal(&timer_cond);
+		}
+		else if (imsg.size > 0 && payload[0] == DME_LOCAL_RELEASE)
+			local_release();
+		else if (imsg.size > 0 && payload[0] == DME_LOCAL_CANCEL) {
+			// Otherwise the grant, or a timeout, answered the producer already.
+			if (local_state == L_WAITING)
+				withdraw("cancelled");
+		}
+		give_back();
+		pthread_mutex_unlock(&dme_lock);
+		msg_release(&imsg);
+	}
+	return NULL;
+}
+
+void *loopback_thread(void *arg) {
+	// Takes the messages the library sent this node off its flow and hands
+	// them back to it, unless they were for the library swapped out.
+	struct flow_item it;
+	int self_gen = 0;
+
+	for (;;) {
+		flow_pop(&out_flows[my_nid], &it);
+		// Messages after the mark are for the library swapped to.
+		if (it.type == FRAME_SWAP) {
+			self_gen++;
+			continue;
+		}
+		pthread_mutex_lock(&dme_lock);
+		wait_room(0);
+		if (self_gen == generation) {
+			dme_ops->on_message(dme_ctx, my_nid, it.ref->data, it.len);
+			give_back();
+			__atomic_fetch_add(&handled, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&dme_lock);
+		frame_put(it.ref);
+	}
+	return NULL;
+}
+
+// Waits up to five seconds for the producer to exit. Returns 0 if it has not.
+static int producer_done(void) {
+	int i;
+
+	for (i = 0; prod_pid != 0 && i < 50; i++) {
+		if (waitpid(prod_pid, NULL, WNOHANG) != 0)
+			prod_pid = 0;
+		else
+			usleep(100000);
+	}
+	return prod_pid == 0;
+}
+
+// Tells every peer that this node's producer has finished and its lock is
+// idle, so it will not take it again under the running library. Called with
+// dme_lock held.
+static void send_done(void) {
+	struct frame *f;
+	int i;
+
+	for (i = 1; i <= n_tot; i++) {
+		if (i == my_nid)
+			continue;
+		f = frame_get(&tx_pool, 5);
+		flow_push(&out_flows[i], FRAME_DONE, f, varint_put(f->data, generation));
+	}
+}
+
+// Whether every peer is done with the running library, or suspected down.
+// Called with dme_lock held.
+static int peers_done(void) {
+	int i;
+
+	for (i = 1; i <= n_tot; i++)
+		if (i != my_nid && peer_done[i] <= generation && !peers[i].suspected)
+			return 0;
+	return 1;
+}
+
+// Puts the library at path in place of the running one and starts a producer
+// for it (see DME_CONTROL). Writes what happened to reply and returns 0, or -1
+// if the running library stays.
+static int swap_library(const char *path, int donuts, char *reply, int len) {
+	const struct dme_ops *ops;
+	struct held *h, **hp;
+	struct timespec ts;
+	void *handle, *ctx;
+	const char *busy;
+	long until, next;
+	int i;
+
+	if (dme_ops == NULL) {
+		snprintf(reply, len, "Swaps need a v2 library\n");
+		return -1;
+	}
+	if (!producer_done()) {
+		snprintf(reply, len, "The producer is still running\n");
+		return -1;
+	}
+	if ((handle = dlopen(path, RTLD_LAZY)) == NULL) {
+		snprintf(reply, len, "%s\n", dlerror());
+		return -1;
+	}
+	ops = dlsym(handle, DME_OPS_SYMBOL);
+	if (ops == NULL || ops->version != DME_ABI_V2) {
+		dlclose(handle);
+		snprintf(reply, len, "%s is not a v2 library\n", path);
+		return -1;
+	}
+	if ((ctx = calloc(1, ops->ctx_size)) == NULL)
+		error(0, "ERROR on malloc\n");
+
+	pthread_mutex_lock(&dme_lock);
+	busy = local_state != L_IDLE || lease_held ? "The lock is in use" : NULL;
+	if (busy == NULL) {
+		// The old library answers the peers while they finish.
+		send_done();
+		until = now_ms() + SWAP_WAIT_MS;
+		while (!peers_done() && (next = now_ms()) < until) {
+			// Waking every heartbeat for the peers suspected down meanwhile.
+			next = next + hb_ms < until ? next + hb_ms : until;
+			ts.tv_sec  = next / 1000;
+			ts.tv_nsec = (next % 1000) * 1000000;
+			pthread_cond_timedwait(&done_cond, &dme_lock, &ts);
+		}
+		if (local_state != L_IDLE || lease_held)
+			busy = "The lock is in use";
+		else if (!peers_done())
+			busy = "Peers are still running the library";
+	}
+	if (busy != NULL) {
+		pthread_mutex_unlock(&dme_lock);
+		free(ctx);
+		dlclose(handle);
+		snprintf(reply, len, "%s\n", busy);
+		return -1;
+	}
+	printf("NC: swapping %s for %s\n", dme_ops->name, ops->name);
+	fflush(stdout);
+	dme_ops->fini(dme_ctx);
+	free(dme_ctx);
+	dlclose(dme_handle);
+
+	// What was sent for the old library, then the marks behind it.
+	generation++;
+	printf("NC: %ld messages, %ld bytes sent\n", __atomic_exchange_n(&sent_msgs, 0, __ATOMIC_RELAXED),
+		__atomic_exchange_n(&sent_bytes, 0, __ATOMIC_RELAXED));
+	fflush(stdout);
+	for (i = 1; i <= n_tot; i++)
+		flow_push(&out_flows[i], FRAME_SWAP, NULL, 0);
+
+	dme_handle = handle;
+	dme_ops    = ops;
+	dme_ctx    = ctx;
+	dme_ops->init(dme_ctx, &dme_env, my_nid, n_tot);
+	if (dme_ops->on_peer_down != NULL)
+		for (i = 1; i <= n_tot; i++)
+			if (i != my_nid && peers[i].suspected)
+				dme_ops->on_peer_down(dme_ctx, i);
+	printf("Running %s (v2 library), generation %d\n", dme_ops->name, generation);
+	fflush(stdout);
+
+	// Frames from the peers that swapped first.
+	for (hp = &held_head; (h = *hp) != NULL; ) {
+		if (h->gen != generation) {
+			hp = &h->next;
+			continue;
+		}
+		dme_ops->on_message(dme_ctx, h->from, h->ref->data + h->off, h->len - h->off);
+		give_back();
+		__atomic_fetch_add(&handled, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&held_count, 1, __ATOMIC_RELAXED);
+		*hp = h->next;
+		frame_put(h->ref);
+		free(h);
+	}
+	for (held_tail = NULL, h = held_head; h != NULL; h = h->next)
+		held_tail = h;
+	pthread_mutex_unlock(&dme_lock);
+
+	start_producer(path, donuts);
+	snprintf(reply, len, "Running %s, generation %d\n", ops->name, generation);
+	return 0;
+}
+
+// Appends to the metrics text, growing it as needed.
+struct text {
+	char *buf;
+	int len, cap;
+};
+
+static void put(struct text *t, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+		if (n < t->cap - t->len)
+			break;
+		t->cap = 2 * t->cap + n;
+		if ((t->buf = (char *) realloc(t->buf, t->cap)) == NULL)
+			error(0, "ERROR on malloc\n");
+	}
+	t->len += n;
+}
+
+static int cmp_long(const void *a, const void *b) {
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Writes the metrics in the Prometheus text format. The caller frees the text.
+static char *metrics(void) {
+	static const char *states[] = { "idle", "waiting", "held", "abandoned", "returning" };
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	static long last_handled, last_us;
+	struct text t = { NULL, 0, 0 };
+	struct msqid_ds q;
+	long lat[LATENCIES], count, now = now_us(), h;
+	int i, n, state;
+
+	put(&t, "# HELP nc_peer_frames_total Frames sent to and received from each peer, heartbeats included.\n");
+	put(&t, "# TYPE nc_peer_frames_total counter\n");
+	for (i = 1; i <= n_tot; i++) {
+		if (i == my_nid)
+			continue;
+		put(&t, "nc_peer_frames_total{peer=\"%d\",direction=\"in\"} %ld\n", i, __atomic_load_n(&peer_stats[i].frames_in, __ATOMIC_RELAXED));
+		put(&t, "nc_peer_frames_total{peer=\"%d\",direction=\"out\"} %ld\n", i, __atomic_load_n(&peer_stats[i].frames_out, __ATOMIC_RELAXED));
+	}
+	put(&t, "# HELP nc_peer_bytes_total Bytes sent to and received from each peer, headers included.\n");
+	put(&t, "# TYPE nc_peer_bytes_total counter\n");
+	for (i = 1; i <= n_tot; i++) {
+		if (i == my_nid)
+			continue;
+		put(&t, "nc_peer_bytes_total{peer=\"%d\",direction=\"in\"} %ld\n", i, __atomic_load_n(&peer_stats[i].bytes_in, __ATOMIC_RELAXED));
+		put(&t, "nc_peer_bytes_total{peer=\"%d\",direction=\"out\"} %ld\n", i, __atomic_load_n(&peer_stats[i].bytes_out, __ATOMIC_RELAXED));
+	}
+	if (links != NULL) {
+		put(&t, "# HELP nc_link_queued_frames Frames an emulated link holds back (see DME_NETEM).\n");
+		put(&t, "# TYPE nc_link_queued_frames gauge\n");
+		for (i = 1; i <= n_tot; i++)
+			if (links[i].on)
+				put(&t, "nc_link_queued_frames{peer=\"%d\"} %d\n", i, __atomic_load_n(&links[i].queued, __ATOMIC_RELAXED));
+	}
+
+	put(&t, "# HELP nc_flow_frames Frames waiting on the flow to each node, its own for messages to itself.\n");
+	put(&t, "# TYPE nc_flow_frames gauge\n");
+	for (i = 1; i <= n_tot; i++)
+		put(&t, "nc_flow_frames{peer=\"%d\"} %d\n", i, __atomic_load_n(&out_flows[i].depth, __ATOMIC_RELAXED));
+	put(&t, "# HELP nc_flow_frames_max Most frames the flow to each node has held (high-water mark).\n");
+	put(&t, "# TYPE nc_flow_frames_max gauge\n");
+	for (i = 1; i <= n_tot; i++)
+		put(&t, "nc_flow_frames_max{peer=\"%d\"} %d\n", i, __atomic_load_n(&out_flows[i].high, __ATOMIC_RELAXED));
+	put(&t, "# HELP nc_flow_capacity_frames Most frames a flow to a peer holds (DME_FLOW_CAP).\n");
+	put(&t, "# TYPE nc_flow_capacity_frames gauge\n");
+	put(&t, "nc_flow_capacity_frames %d\n", flow_cap);
+	put(&t, "# HELP nc_flow_frames_total Frames put on the flow to each node.\n");
+	put(&t, "# TYPE nc_flow_frames_total counter\n");
+	for (i = 1; i <= n_tot; i++)
+		put(&t, "nc_flow_frames_total{peer=\"%d\"} %ld\n", i, __atomic_load_n(&out_flows[i].pushed, __ATOMIC_RELAXED));
+	put(&t, "# HELP nc_flow_full_total Times the flow to each node filled up to capacity.\n");
+	put(&t, "# TYPE nc_flow_full_total counter\n");
+	for (i = 1; i <= n_tot; i++)
+		put(&t, "nc_flow_full_total{peer=\"%d\"} %ld\n", i, __atomic_load_n(&out_flows[i].full, __ATOMIC_RELAXED));
+	put(&t, "# HELP nc_input_waits_total Times input waited for room in the flows to the peers, or a receiver for room in the message queue.\n");
+	put(&t, "# TYPE nc_input_waits_total counter\n");
+	put(&t, "nc_input_waits_total{room=\"flows\"} %ld\n", __atomic_load_n(&flow_waits, __ATOMIC_RELAXED));
+	put(&t, "nc_input_waits_total{room=\"queue\"} %ld\n", __atomic_load_n(&rx_waits, __ATOMIC_RELAXED));
+
+	// The queue carries the producer's requests and answers, and a v1 library's messages.
+	if (msgctl(msqid, IPC_STAT, &q) == 0) {
+		put(&t, "# HELP nc_queue_messages Messages in the node's message queue.\n");
+		put(&t, "# TYPE nc_queue_messages gauge\n");
+		put(&t, "nc_queue_messages %lu\n", (unsigned long) q.msg_qnum);
+		put(&t, "# HELP nc_queue_bytes Bytes in the node's message queue.\n");
+		put(&t, "# TYPE nc_queue_bytes gauge\n");
+		put(&t, "nc_queue_bytes %lu\n", (unsigned long) q.__msg_cbytes);
+		put(&t, "# HELP nc_queue_bytes_max Most bytes the node's message queue takes (msgmnb).\n");
+		put(&t, "# TYPE nc_queue_bytes_max gauge\n");
+		put(&t, "nc_queue_bytes_max %lu\n", (unsigned long) q.msg_qbytes);
+	}
+
+	h = __atomic_load_n(&handled, __ATOMIC_RELAXED);
+	put(&t, "# HELP nc_handler_messages_total Messages handed to the library.\n");
+	put(&t, "# TYPE nc_handler_messages_total counter\n");
+	put(&t, "nc_handler_messages_total %ld\n", h);
+	put(&t, "# HELP nc_handler_messages_per_second Messages handed to the library per second since the last scrape.\n");
+	put(&t, "# TYPE nc_handler_messages_per_second gauge\n");
+	put(&t, "nc_handler_messages_per_second %.3f\n", last_us == 0 || now == last_us ? 0 : (h - last_handled) * 1e6 / (now - last_us));
+	last_handled = h;
+	last_us = now;
+	// A gauge, since a swap starts it again from 0.
+	put(&t, "# HELP nc_library_messages_sent Frames sent for the library by the running generation.\n");
+	put(&t, "# TYPE nc_library_messages_sent gauge\n");
+	put(&t, "nc_library_messages_sent %ld\n", __atomic_load_n(&sent_msgs, __ATOMIC_RELAXED));
+
+	// Reading the state, which the library's callers change under dme_lock, as it is now.
+	state = dme_ops != NULL ? __atomic_load_n(&local_state, __ATOMIC_RELAXED) : -1;
+	put(&t, "# HELP nc_pending_requests Acquires waiting, donuts waiting for the combiner, and held frames of a later library.\n");
+	put(&t, "# TYPE nc_pending_requests gauge\n");
+	put(&t, "nc_pending_requests{kind=\"acquire\"} %d\n", state == L_WAITING);
+	put(&t, "nc_pending_requests{kind=\"delegated\"} %d\n", __atomic_load_n(&combine_waiting, __ATOMIC_RELAXED));
+	put(&t, "nc_pending_requests{kind=\"held\"} %d\n", __atomic_load_n(&held_count, __ATOMIC_RELAXED));
+	if (dme_ops != NULL) {
+		put(&t, "# HELP nc_lock_state State of this node's acquire, 1 for the current one.\n");
+		put(&t, "# TYPE nc_lock_state gauge\n");
+		for (i = 0; i < 5; i++)
+			put(&t, "nc_lock_state{state=\"%s\"} %d\n", states[i], state == i);
+		put(&t, "# HELP nc_generation Libraries swapped in since the start.\n");
+		put(&t, "# TYPE nc_generation gauge\n");
+		put(&t, "nc_generation %d\n", __atomic_load_n(&generation, __ATOMIC_RELAXED));
+	}
+
+	// Quantiles of the last grants. A slot being written may be read either way.
+	count = __atomic_load_n(&latency_count, __ATOMIC_ACQUIRE);
+	n = count < LATENCIES ? count : LATENCIES;
+	for (i = 0; i < n; i++)
+		lat[i] = __atomic_load_n(&latency[i], __ATOMIC_RELAXED);
+	qsort(lat, n, sizeof(long), cmp_long);
+	put(&t, "# HELP nc_acquire_latency_seconds Time from acquire to grant, quantiles of the last %d.\n", LATENCIES);
+	put(&t, "# TYPE nc_acquire_latency_seconds summary\n");
+	for (i = 0; n > 0 && i < 3; i++)
+		put(&t, "nc_acquire_latency_seconds{quantile=\"%g\"} %.6f\n", quantiles[i],
+		    lat[(int) (quantiles[i] * (n - 1) + 0.5)] / 1e6);
+	put(&t, "nc_acquire_latency_seconds_sum %.6f\n", __atomic_load_n(&latency_sum, __ATOMIC_RELAXED) / 1e6);
+	put(&t, "nc_acquire_latency_seconds_count %ld\n", count);
+	return t.buf;
+}
+
+// Copies the value of parameter name in the query of target to out, decoding
+// %XX escapes. Returns 0 if it is not there.
+static int query_param(const char *target, const char *name, char *out, int len) {
+	const char *p = strchr(target, '?');
+	int n = strlen(name), i = 0;
+	unsigned int c;
+
+	while (p != NULL) {
+		p++;
+		if (strncmp(p, name, n) == 0 && p[n] == '=') {
+			for (p += n + 1; *p != '\0' && *p != '&' && i < len - 1; p++) {
+				if (*p == '%' && sscanf(p + 1, "%2x", &c) == 1) {
+					out[i++] = c;
+					p += 2;
+				}
+				else
+					out[i++] = *p == '+' ? ' ' : *p;
+			}
+			out[i] = '\0';
+			return 1;
+		}
+		p = strchr(p, '&');
+	}
+	return 0;
+}
+
+// Answers an HTTP request and closes the connection.
+static void http_reply(int fd, int code, const char *type, const char *body) {
+	char hdr[256];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n",
+	             code, code == 200 ? "OK" : code == 404 ? "Not Found" : "Conflict", type, (int) strlen(body));
+	if (write(fd, hdr, n) != n || write(fd, body, strlen(body)) != (ssize_t) strlen(body)) {
+		printf("NC: control request answered in part\n");
+		fflush(stdout);
+	}
+	close(fd);
+}
+
+void *control_thread(void *arg) {
+	// Answers requests on the DME_CONTROL socket one at a time.
+	struct sockaddr_un addr;
+	char req[2048], method[8], target[1024], path[512], donuts[16], reply[512], *text;
+	int fd, conn, n, len;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		error(2, "Error on socket creation\n");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", control_path);
+	unlink(control_path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 5) < 0)
+		error(2, "Cannot listen on %s\n", control_path);
+	printf("Control requests on %s\n", control_path);
+	fflush(stdout);
+
+	for (;;) {
+		if ((conn = accept(fd, NULL, NULL)) < 0)
+			continue;
+		// The request line is all that matters, the headers are read and ignored.
+		for (len = 0; len < (int) sizeof(req) - 1; ) {
+			if ((n = read(conn, req + len, sizeof(req) - 1 - len)) <= 0)
+				break;
+			len += n;
+			req[len] = '\0';
+			if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+				break;
+		}
+		req[len] = '\0';
+		if (sscanf(req, "%7s %1023s", method, target) != 2) {
+			close(conn);
+			continue;
+		}
+		if (strcmp(method, "POST") == 0 && strncmp(target, "/swap", 5) == 0 && query_param(target, "library", path, sizeof(path))) {
+			if (!query_param(target, "donuts", donuts, sizeof(donuts)))
+				snprintf(donuts, sizeof(donuts), "%d", env_int("DME_DONUTS", DONUTS));
+			n = swap_library(path, atoi(donuts) > 0 ? atoi(donuts) : DONUTS, reply, sizeof(reply));
+			http_reply(conn, n == 0 ? 200 : 409, "text/plain", reply);
+		}
+		else if (strcmp(method, "GET") == 0 && strcmp(target, "/metrics") == 0) {
+			text = metrics();
+			http_reply(conn, 200, "text/plain; version=0.0.4", text);
+			free(text);
 		}
+		else
+			http_reply(conn, 404, "text/plain", "Try GET /metrics or POST /swap?library=<path>[&donuts=<n>]\n");
 	}
 	return NULL;
 }
@@ -0,0 +1,59 @@
+/******************************************************************************/
+/*                                                                            */
+/* none.c - No mutual exclusion at all: every acquire is granted at once and  */
+/*          nothing is ever sent. With the buffer manager in ring mode        */
+/*          (DME_BM_RING) it gives the throughput of the system without a     */
+/*          distributed mutex, the upper bound the other algorithms are       */
+/*          measured against. bin/sim reports it as unsafe, as it is.         */
+/*                                                                            */
+/*          Built against the v2 interface (see dme_v2.h).                    */
+/*                                                                            */
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dme_v2.h"
+
+// State of one instance.
+struct none_ctx {
+    const struct dme_env *env;
+};
+
+static void none_init(void *ctx, const struct dme_env *env, int nid, int ntot) {
+    struct none_ctx *c = (struct none_ctx *) ctx;
+
+    c->env = env;
+    printf("No mutual exclusion, node %d of %d\n", nid, ntot);
+    fflush(stdout);
+}
+
+static void none_message(void *ctx, int from, const void *buf, unsigned int len) {
+}
+
+static void none_acquire(void *ctx) {
+    struct none_ctx *c = (struct none_ctx *) ctx;
+
+    c->env->grant(c->env->arg);
+}
+
+static void none_release(void *ctx) {
+}
+
+static void none_fini(void *ctx) {
+}
+
+// Nothing is waited for, so nodes going down change nothing, and there is
+// never a request to withdraw.
+const struct dme_ops dme_ops = {
+    DME_ABI_V2,
+    "none",
+    sizeof(struct none_ctx),
+    none_init,
+    none_message,
+    none_acquire,
+    none_release,
+    none_fini,
+    NULL,
+    NULL,
+    NULL,
+};
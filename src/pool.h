@@ -0,0 +1,110 @@
+#ifndef _POOL
+#define _POOL
+// Fixed-size object pool used by the algorithm handlers for queue entries.
+// Objects are carved out of slabs and recycled through a free list, so once a
+// handler has seen its deepest queue it stops calling malloc() and free().
+// A pool belongs to one handler thread and is not locked.
+// NOTE: Everything is static so each algorithm library gets its own copy.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Objects per slab unless the pool is told otherwise.
+#define POOL_SLAB 64
+
+struct pool_obj {
+    struct pool_obj *next;    // Free list link, overlaps the object when free.
+};
+
+struct pool_slab {
+    struct pool_slab *next;
+};
+
+struct pool {
+    const char *name;         // Used in log messages.
+    size_t size;              // Object size, rounded up to pointer alignment.
+    int per_slab;             // Objects per slab.
+    struct pool_obj *free;    // Free objects.
+    struct pool_slab *slabs;  // Every slab, for pool_destroy().
+    int used;                 // Objects handed out.
+    int high;                 // High-water mark of used.
+    int total;                // Objects in all slabs.
+};
+
+static void pool_init(struct pool *p, const char *name, size_t size, int per_slab) {
+    p->name     = name;
+    p->size     = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    if (p->size < sizeof(struct pool_obj))
+        p->size = sizeof(struct pool_obj);
+    p->per_slab = per_slab > 0 ? per_slab : POOL_SLAB;
+    p->free     = NULL;
+    p->slabs    = NULL;
+    p->used     = 0;
+    p->high     = 0;
+    p->total    = 0;
+}
+
+// Adds a slab and threads its objects onto the free list.
+static void pool_grow(struct pool *p) {
+    struct pool_slab *slab;
+    char *obj;
+    int i;
+
+    // Slab header padded to pointer alignment, then the objects.
+    slab = (struct pool_slab *) malloc(sizeof(void *) + p->size * p->per_slab);
+    if (slab == NULL) {
+        perror("pool malloc failed :\n");
+        exit(1);
+    }
+    slab->next = p->slabs;
+    p->slabs   = slab;
+
+    obj = (char *) slab + sizeof(void *);
+    for (i = 0; i < p->per_slab; i++, obj += p->size) {
+        ((struct pool_obj *) obj)->next = p->free;
+        p->free = (struct pool_obj *) obj;
+    }
+    p->total += p->per_slab;
+
+    printf("POOL: %s grew to %d objects\n", p->name, p->total);
+    fflush(stdout);
+}
+
+static void *pool_alloc(struct pool *p) {
+    struct pool_obj *obj;
+
+    if (p->free == NULL)
+        pool_grow(p);
+    obj = p->free;
+    p->free = obj->next;
+    if (++p->used > p->high)
+        p->high = p->used;
+    return obj;
+}
+
+static void pool_free(struct pool *p, void *ptr) {
+    struct pool_obj *obj = (struct pool_obj *) ptr;
+
+    obj->next = p->free;
+    p->free = obj;
+    p->used--;
+}
+
+static void pool_report(struct pool *p) {
+    printf("POOL: %s %d in use, high-water %d, %d allocated\n", p->name, p->used, p->high, p->total);
+    fflush(stdout);
+}
+
+static void pool_destroy(struct pool *p) {
+    struct pool_slab *slab;
+
+    while ((slab = p->slabs) != NULL) {
+        p->slabs = slab->next;
+        free(slab);
+    }
+    p->free  = NULL;
+    p->used  = 0;
+    p->total = 0;
+}
+
+#endif
@@ -8,30 +8,118 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <sys/msg.h>
+#include <sys/time.h>
 
 #include "dme.h"
+#include "dme_v2.h"
+#include "dme_client.h"
+#include "donut.h"
 
-#define PORTNO 1992
 #define BSIZE  100
 
-// Assuming buffer manager container hostname
-#define BUFFMAN "dme_bm"
+// Every STALL_EVERY donuts, a producer run with DME_STALL_MS sleeps that long
+// while holding the lock, as a paused holder would.
+#define STALL_EVERY 10
 
-struct msg {
-	int node_id;
-	int donut_number;
-};
+// Lease of the current critical section when the node controller grants them.
+struct dme_lease lease;
+
+// Acquire of a v2 library. With DME_ACQUIRE_MS it is withdrawn after that long
+// and made again, with DME_ASYNC it is sent before the donut is prepared.
+struct dme_acquire acq;
+int acquire_ms = -1;
+int timeouts;
+
+// With DME_TRY_MS each acquire is first made in one of the ways it can be
+// withdrawn, in turn: only if it is granted at once (dme_try_down), within
+// try_ms (dme_down_timed), or cancelled unless granted within try_ms
+// (dme_down_cancel). One that is withdrawn is made again without a timeout
+// try_ms later, which leaves the time for a grant on its way to arrive.
+// Every critical section is logged with when it began and ended, so a check
+// can see that no two overlap.
+int try_ms = -1;
+int withdrawn;
 
 void error(char *msg) {
 	perror(msg);
 	exit(1);
 }
 
+// Waits for the acquire in acq to be granted, asking again each time it times out.
+static void v2_wait() {
+	while (dme_down_wait(&acq) != DME_GRANTED) {
+		timeouts++;
+		printf("PROD: not granted within %d ms, asking again\n", acquire_ms);
+		fflush(stdout);
+		dme_down_async(&acq, acquire_ms);
+	}
+	lease = acq.lease;
+}
+
+// dme_down and dme_up for v2 libraries, which are driven by the node controller.
+static void v2_down() {
+	dme_down_async(&acq, acquire_ms);
+	v2_wait();
+}
+
+// Wall clock in milliseconds.
+static double now_ms() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static void v2_up() {
+	dme_local_up();
+}
+
+// Tries for the lock the way donut i does (see try_ms). Returns 1 once it is held.
+static int v2_try(int i) {
+	double until;
+
+	switch (i % 3) {
+	case 0:
+		return dme_try_down(&acq);
+	case 1:
+		return dme_down_timed(&acq, try_ms);
+	default:
+		dme_down_async(&acq, -1);
+		until = now_ms() + try_ms;
+		while (dme_down_test(&acq) == DME_PENDING && now_ms() < until)
+			usleep(1000);
+		// The grant may come first, and then the lock is held.
+		return dme_down_cancel(&acq) == DME_GRANTED;
+	}
+}
+
+// Hands the donut to the node controller, which has the combiner write it
+// (DME_DELEGATE), and returns the buffer manager's answer.
+static int v2_delegate(struct msg *donut) {
+	MSG imsg;
+	int msqid = dme_client_queue(), num;
+
+	imsg.type    = TO_DME;
+	imsg.network = 0;
+	imsg.ref     = NULL;
+	imsg.size    = 1 + sizeof(struct msg);
+	imsg.buf[0]  = DME_LOCAL_DELEGATE;
+	memcpy(imsg.buf + 1, donut, sizeof(struct msg));
+	if (msgsnd(msqid, &imsg, msg_size(&imsg), 0) == -1)
+		error("Error on message send");
+	if (msgrcv(msqid, &imsg, sizeof(MSG) - sizeof(long), TO_CON, 0) == -1)
+		error("Error on message receive");
+	memcpy(&num, msg_payload(&imsg), sizeof(int));
+	msg_release(&imsg);
+	return num;
+}
+
 int main(int argc, char *argv[]) {
-	int sockfd, portno, n;
+	int sockfd, n;
 	struct sockaddr_in serv_addr;
-	struct hostent *server;
-	int i, j, msgs, node_id, num;
+	int i, j, msgs, node_id, num, stall, async, delegate, rejected = 0;
+	double start, t, held, lock_ms = 0;
 	struct msg donut;
 
 	void *handle;
@@ -41,6 +129,7 @@ int main(int argc, char *argv[]) {
     // For random number generation using nrand48
     short xsub1[3]; // nrand48 uses 48 bits (16 * 3 = 48)
     struct timeval randtime;
+    int think; // Longest sleep between donuts (DME_THINK_US), or -1 for the default.
 
     /*** Initialize 48-bit random seed. ***/
     // This system call fills a timeval structure, which has two members:
@@ -61,51 +150,117 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "%s\n", dlerror());
 		exit(1);
 	}
-	dme_up = dlsym(handle, "dme_up");
-	if (dlerror() != NULL) {
-		fprintf(stderr, "%s\n", dlerror());
-		exit(1);
+	if (dlsym(handle, DME_OPS_SYMBOL) != NULL) {
+		// A v2 library has no client side of its own.
+		dme_up   = v2_up;
+		dme_down = v2_down;
 	}
-	dme_down = dlsym(handle, "dme_down");
-	if (dlerror() != NULL) {
-		fprintf(stderr, "%s\n", dlerror());
-		exit(1);
+	else {
+		dlerror(); // Clears the failed lookup above.
+		dme_up = dlsym(handle, "dme_up");
+		if (dlerror() != NULL) {
+			fprintf(stderr, "%s\n", dlerror());
+			exit(1);
+		}
+		dme_down = dlsym(handle, "dme_down");
+		if (dlerror() != NULL) {
+			fprintf(stderr, "%s\n", dlerror());
+			exit(1);
+		}
+	}
+	stall = getenv("DME_STALL_MS") != NULL ? atoi(getenv("DME_STALL_MS")) : 0;
+	think = getenv("DME_THINK_US") != NULL ? atoi(getenv("DME_THINK_US")) : -1;
+	async = getenv("DME_ASYNC") != NULL && atoi(getenv("DME_ASYNC")) != 0;
+	if (getenv("DME_ACQUIRE_MS") != NULL)
+		acquire_ms = atoi(getenv("DME_ACQUIRE_MS"));
+	if (getenv("DME_TRY_MS") != NULL)
+		try_ms = atoi(getenv("DME_TRY_MS"));
+	if ((async || acquire_ms >= 0 || try_ms >= 0) && dme_down != v2_down) {
+		fprintf(stderr, "PROD: DME_ASYNC, DME_ACQUIRE_MS and DME_TRY_MS need a v2 library, ignored\n");
+		async = 0;
+		acquire_ms = -1;
+		try_ms = -1;
 	}
-	
+	if (async && try_ms >= 0) {
+		fprintf(stderr, "PROD: DME_TRY_MS does not go with DME_ASYNC, ignored\n");
+		try_ms = -1;
+	}
+	delegate = getenv("DME_DELEGATE") != NULL && atoi(getenv("DME_DELEGATE")) != 0;
+	if (delegate && dme_down != v2_down) {
+		fprintf(stderr, "PROD: DME_DELEGATE needs a v2 library, ignored\n");
+		delegate = 0;
+	}
+	start = now_ms();
 
 	for (i = 0; i < msgs; i++) {
+        if (think >= 0)
+            j = think > 0 ? nrand48(xsub1) % (think + 1) : 0;
+        else
+            j = nrand48(xsub1) & 0xEFFFF; // Between 0 - 1000000
+        printf("PROD: sleeping for %d microseconds\n", j); 
+        usleep(j);
+
+        // Ask for the lock now and set up the donut while the request is out.
+		t = now_ms();
+		if (delegate) {
+			// The combiner writes it under a lock taken for a whole batch.
+			donut.node_id      = node_id;
+			donut.donut_number = i;
+			donut.token        = 0;
+			if ((num = v2_delegate(&donut)) == -1) {
+				printf("PROD: donut %d rejected, the combiner's token is stale\n", i);
+				rejected++;
+			}
+			else
+				printf("PROD: Provided buffer manager with donut #%d\n", num);
+			fflush(stdout);
+			lock_ms += now_ms() - t;
+			continue;
+		}
+		if (async)
+			dme_down_async(&acq, acquire_ms);
+
         // Setting up socket to make connections.
-        portno = PORTNO;
         sockfd = socket(AF_INET, SOCK_STREAM, 0);
         if (sockfd < 0)
             error("ERROR opening socket");
-        server = gethostbyname(BUFFMAN);
-        if (server == NULL) {
+        if (!bm_addr(&serv_addr)) {
             fprintf(stderr, "ERROR, no such host\n");
             exit(0);
         }
-        bzero((char *) &serv_addr, sizeof(serv_addr));
-        serv_addr.sin_family = AF_INET;
-        bcopy((char *)server->h_addr,
-                (char *)&serv_addr.sin_addr.s_addr,
-                server->h_length);
-        serv_addr.sin_port = htons(portno);
-		
-        j = nrand48(xsub1) & 0xEFFFF; // Between 0 - 1000000
-        printf("PROD: sleeping for %d microseconds\n", j); 
-        usleep(j);
-        
 
         // Get distributed mutex in order to run critical section
-		(*dme_down)();
+		if (async)
+			v2_wait();
+		else if (try_ms >= 0) {
+			if (v2_try(i))
+				lease = acq.lease;
+			else {
+				withdrawn++;
+				printf("PROD: acquire for donut %d withdrawn, asking again in %d ms\n", i, try_ms);
+				fflush(stdout);
+				usleep(try_ms * 1000);
+				v2_down();
+			}
+		}
+		else
+			(*dme_down)();
+		held = now_ms();
+		if (stall > 0 && i % STALL_EVERY == STALL_EVERY - 1) {
+			printf("PROD: stalling for %d ms with the lock\n", stall);
+			fflush(stdout);
+			usleep(stall * 1000);
+		}
 
 		// Connecting to buffer manager
+		donut.node_id      = node_id;
+		donut.donut_number = i;
+		bm_route(&serv_addr, &donut);
 		if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
 			error("ERROR connecting");
 		
 		// Send donut to buffer manadger
-		donut.node_id      = node_id;
-		donut.donut_number = i;
+		donut.token        = lease.token;
 
 		n = write(sockfd, &donut, sizeof(struct msg));
 		if (n < 0)
@@ -116,16 +271,36 @@ int main(int argc, char *argv[]) {
 		if (n < 0)
 			error("ERROR reading from socket");
 		
-		printf("PROD: Provided buffer manager with donut #%d\n", num);
+		if (num == -1) {
+			// The lease ran out and another node has written since.
+			printf("PROD: donut %d rejected, token %u is stale\n", i, lease.token);
+			rejected++;
+		}
+		else
+			printf("PROD: Provided buffer manager with donut #%d\n", num);
 		fflush(stdout);
 
         close(sockfd);
         sockfd = -1;
 
+		if (try_ms >= 0) {
+			printf("PROD: held the lock from %.3f to %.3f ms\n", held, now_ms());
+			fflush(stdout);
+		}
+
 		// Free distributed mutext lock
 		(*dme_up)();
+		lock_ms += now_ms() - t;
 	}
 
+	if (try_ms >= 0)
+		printf("PROD: %d acquires withdrawn\n", withdrawn);
+	// Comparing runs with and without DME_LEASE_MS gives the cost of leases.
+	t = (now_ms() - start) / 1000.0;
+	printf("PROD: %d donuts in %.2f s (%.2f per second), %.2f ms per critical section including the wait, %d rejected, %d timed out\n",
+	       msgs, t, msgs / t, msgs > 0 ? lock_ms / msgs : 0.0, rejected, timeouts);
+	fflush(stdout);
+
 	dlclose(handle);
 
 	return 0;
@@ -0,0 +1,376 @@
+#ifndef _QUORUM
+#define _QUORUM
+// Quorum construction shared by the quorum-based algorithms.
+// Node ids are 1..ntot, and set[i] holds the size[i] node ids in node i's quorum.
+// Any two quorums must intersect, which is what quorum_check() verifies.
+// NOTE: Everything is static so each algorithm library gets its own copy.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct quorum {
+    int ntot;
+    int *size;  // size[i] is the number of nodes in node i's quorum.
+    int **set;  // set[i][0..size[i]-1] are the nodes in node i's quorum.
+};
+
+// Allocates room for ntot quorums of up to ntot nodes each.
+static void quorum_alloc(struct quorum *q, int ntot) {
+    int i;
+
+    q->ntot = ntot;
+    q->size = (int *) calloc(ntot + 1, sizeof(int));
+    q->set  = (int **) calloc(ntot + 1, sizeof(int *));
+    if (q->size == NULL || q->set == NULL) {
+        perror("quorum malloc failed :\n");
+        exit(1);
+    }
+    for (i = 1; i <= ntot; i++) {
+        q->set[i] = (int *) malloc(sizeof(int) * ntot);
+        if (q->set[i] == NULL) {
+            perror("quorum malloc failed :\n");
+            exit(1);
+        }
+    }
+}
+
+static void quorum_free(struct quorum *q) {
+    int i;
+
+    for (i = 1; i <= q->ntot; i++)
+        free(q->set[i]);
+    free(q->set);
+    free(q->size);
+}
+
+// Grid quorums: nodes are laid out row by row in a grid with ceil(sqrt(N))
+// columns, and a node's quorum is its whole row plus its whole column.
+// When the last row is short, two nodes that are not both in it still meet:
+// the one in a full row has a cell in the other's column.
+static void quorum_grid(struct quorum *q, int ntot) {
+    int cols, i, j, r, c;
+
+    quorum_alloc(q, ntot);
+    for (cols = 1; cols * cols < ntot; cols++) ;
+
+    for (i = 1; i <= ntot; i++) {
+        r = (i - 1) / cols;
+        c = (i - 1) % cols;
+        q->size[i] = 0;
+        for (j = 1; j <= ntot; j++)
+            if ((j - 1) / cols == r || (j - 1) % cols == c)
+                q->set[i][q->size[i]++] = j;
+    }
+}
+
+// Tree quorums (Agrawal & El Abbadi, 1991): nodes form a complete binary tree
+// in heap order (node k's children are 2k and 2k+1) and a quorum is a path from
+// the root to a leaf. Node i uses the path through itself, continued down to a
+// leaf, so quorums are about log2(N) nodes and all share the root.
+static void quorum_tree(struct quorum *q, int ntot) {
+    int i, k, n;
+
+    quorum_alloc(q, ntot);
+    for (i = 1; i <= ntot; i++) {
+        // Ancestors of i, root first.
+        for (n = 0, k = i; k >= 1; k /= 2) n++;
+        q->size[i] = n;
+        for (k = i; k >= 1; k /= 2)
+            q->set[i][--n] = k;
+        // Descend to a leaf, alternating sides to spread the leaves' load.
+        for (k = i; 2 * k <= ntot; ) {
+            if (2 * k + 1 <= ntot && (i & 1))
+                k = 2 * k + 1;
+            else
+                k = 2 * k;
+            q->set[i][q->size[i]++] = k;
+        }
+    }
+}
+
+// Agrawal & El Abbadi's answer to failures in tree quorums: a node that is
+// down is replaced by a path through each of its subtrees. Appends a quorum
+// of the subtree rooted at k to out[*n..], avoiding the nodes marked in down,
+// and returns 0 if there is none. Start it at the root, k = 1.
+static int quorum_tree_avoid(int ntot, const int *down, int k, int *out, int *n) {
+    int start = *n;
+
+    if (k > ntot)
+        return 0;
+    if (!down[k]) {
+        out[(*n)++] = k;
+        if (2 * k > ntot)
+            return 1;
+        if (quorum_tree_avoid(ntot, down, 2 * k, out, n))
+            return 1;
+        *n = start + 1;
+        if (quorum_tree_avoid(ntot, down, 2 * k + 1, out, n))
+            return 1;
+    }
+    else if (quorum_tree_avoid(ntot, down, 2 * k, out, n) &&
+             quorum_tree_avoid(ntot, down, 2 * k + 1, out, n))
+        return 1;
+    *n = start;
+    return 0;
+}
+
+// Arithmetic over the finite field GF(q), q = p^k, used to build projective planes.
+// Elements are stored as integers whose base-p digits are polynomial coefficients.
+struct gf {
+    int q, p, k;
+    int *exp;   // exp[i] = x^i for 0 <= i < q-1
+    int *log;   // log[exp[i]] = i
+};
+
+static int gf_add(struct gf *f, int a, int b) {
+    int r = 0, m = 1;
+
+    for (; a > 0 || b > 0; a /= f->p, b /= f->p, m *= f->p)
+        r += ((a % f->p + b % f->p) % f->p) * m;
+    return r;
+}
+
+static int gf_mul(struct gf *f, int a, int b) {
+    if (a == 0 || b == 0)
+        return 0;
+    return f->exp[(f->log[a] + f->log[b]) % (f->q - 1)];
+}
+
+// Multiplies a by x modulo the monic polynomial whose low coefficients are poly.
+static int gf_mulx(struct gf *f, int a, int *poly) {
+    int d[32], i, top;
+
+    for (i = 0; i < f->k; i++, a /= f->p)
+        d[i] = a % f->p;
+    top = d[f->k - 1];
+    for (i = f->k - 1; i > 0; i--)
+        d[i] = d[i - 1];
+    d[0] = 0;
+    for (i = 0; i < f->k; i++)
+        d[i] = ((d[i] - top * poly[i]) % f->p + f->p) % f->p;
+    for (a = 0, i = f->k - 1; i >= 0; i--)
+        a = a * f->p + d[i];
+    return a;
+}
+
+// Sets up GF(q). Returns 0 if q is not a prime power.
+static int gf_init(struct gf *f, int q) {
+    int poly[32], i, c, e, x;
+
+    if (q < 2)
+        return 0;
+    for (f->p = 2; q % f->p != 0; f->p++) ;
+    for (f->k = 0, c = q; c % f->p == 0; c /= f->p) f->k++;
+    if (c != 1)
+        return 0;
+    f->q   = q;
+    f->exp = (int *) malloc(sizeof(int) * q);
+    f->log = (int *) malloc(sizeof(int) * q);
+
+    // Search for a primitive polynomial: one for which x generates all q-1 nonzero elements.
+    for (c = 0; c < q; c++) {
+        for (i = 0, e = c; i < f->k; i++, e /= f->p)
+            poly[i] = e % f->p;
+        x = gf_mulx(f, 1, poly);
+        for (i = 0, e = 1; i < q - 1; i++) {
+            f->exp[i] = e;
+            e = gf_mulx(f, e, poly);
+            if (e == 1)
+                break;
+        }
+        if (i == q - 2 && x != 0)
+            break;
+    }
+    for (i = 0; i < q - 1; i++)
+        f->log[f->exp[i]] = i;
+    return 1;
+}
+
+// Finds a perfect matching from points to lines in a bipartite incidence graph
+// (augmenting paths). on[pt] lists the lines through point pt.
+static int quorum_augment(int pt, int **on, int deg, int *line_of, int *point_of, int *seen, int stamp) {
+    int j, l;
+
+    for (j = 0; j < deg; j++) {
+        l = on[pt][j];
+        if (seen[l] == stamp)
+            continue;
+        seen[l] = stamp;
+        if (point_of[l] == 0 || quorum_augment(point_of[l], on, deg, line_of, point_of, seen, stamp)) {
+            line_of[pt]  = l;
+            point_of[l]  = pt;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Projective plane quorums: the q^2+q+1 points and lines of PG(2,q), with any
+// two lines meeting in exactly one point, so K = q+1 and every node has load q+1.
+// Each node is matched to a line through its own point, so its quorum contains it.
+// When ntot is smaller than the plane, the extra points are folded onto real
+// nodes, which keeps every pair of quorums intersecting.
+// Returns 0 if there is no plane of order q.
+static int quorum_plane(struct quorum *qr, int ntot, int q) {
+    struct gf f;
+    int npts = q * q + q + 1;
+    int (*pt)[3];
+    int **on, *cnt, *line_of, *point_of, *seen;
+    int i, j, a, b, n, dot;
+
+    if (!gf_init(&f, q) || npts < ntot)
+        return 0;
+
+    // Points (and lines) are normalized triples: (1,a,b), (0,1,b) and (0,0,1).
+    pt = malloc(sizeof(*pt) * (npts + 1));
+    for (n = 1, a = 0; a < q; a++)
+        for (b = 0; b < q; b++, n++) {
+            pt[n][0] = 1; pt[n][1] = a; pt[n][2] = b;
+        }
+    for (b = 0; b < q; b++, n++) {
+        pt[n][0] = 0; pt[n][1] = 1; pt[n][2] = b;
+    }
+    pt[n][0] = 0; pt[n][1] = 0; pt[n][2] = 1;
+
+    // Incidence: point i lies on line j when their dot product is zero.
+    on  = (int **) malloc(sizeof(int *) * (npts + 1));
+    cnt = (int *) calloc(npts + 1, sizeof(int));
+    for (i = 1; i <= npts; i++) {
+        on[i] = (int *) malloc(sizeof(int) * (q + 1));
+        for (j = 1; j <= npts; j++) {
+            dot = gf_add(&f, gf_add(&f, gf_mul(&f, pt[i][0], pt[j][0]),
+                                        gf_mul(&f, pt[i][1], pt[j][1])),
+                                        gf_mul(&f, pt[i][2], pt[j][2]));
+            if (dot == 0)
+                on[i][cnt[i]++] = j;
+        }
+    }
+
+    // Match every point to a line through it.
+    line_of  = (int *) calloc(npts + 1, sizeof(int));
+    point_of = (int *) calloc(npts + 1, sizeof(int));
+    seen     = (int *) calloc(npts + 1, sizeof(int));
+    for (i = 1; i <= ntot; i++)
+        quorum_augment(i, on, q + 1, line_of, point_of, seen, i);
+
+    // Node i's quorum is the points on its line, with extra points folded onto nodes.
+    quorum_alloc(qr, ntot);
+    for (i = 1; i <= ntot; i++) {
+        for (j = 1; j <= npts; j++)
+            seen[j] = 0;
+        for (j = 1; j <= npts; j++) {
+            for (a = 0; a < cnt[j] && on[j][a] != line_of[i]; a++) ;
+            if (a == cnt[j])
+                continue;
+            n = (j - 1) % ntot + 1;
+            if (!seen[n]) {
+                seen[n] = 1;
+                qr->set[i][qr->size[i]++] = n;
+            }
+        }
+    }
+
+    for (i = 1; i <= npts; i++)
+        free(on[i]);
+    free(on); free(cnt); free(line_of); free(point_of); free(seen); free(pt);
+    free(f.exp); free(f.log);
+    return 1;
+}
+
+// Voting sets for Maekawa-style algorithms with any number of nodes.
+// Uses the smallest projective plane that covers ntot nodes (exact when
+// ntot = q^2+q+1 for a prime power q), unless grid quorums are smaller.
+// Returns a short description of the construction used.
+static const char *quorum_maekawa(struct quorum *qr, int ntot) {
+    struct quorum grid;
+    int i, q, kp = 0, kg = 0;
+
+    // Three nodes use the degenerate plane of order 1, a triangle.
+    if (ntot == 3) {
+        quorum_alloc(qr, ntot);
+        for (i = 1; i <= 3; i++) {
+            qr->size[i] = 2;
+            qr->set[i][0] = i;
+            qr->set[i][1] = i % 3 + 1;
+        }
+        return "Projective plane";
+    }
+
+    for (q = 2; q * q + q + 1 < ntot || !quorum_plane(qr, ntot, q); q++) ;
+    quorum_grid(&grid, ntot);
+    for (i = 1; i <= ntot; i++) {
+        if (qr->size[i] > kp) kp = qr->size[i];
+        if (grid.size[i] > kg) kg = grid.size[i];
+    }
+    if (kg < kp) {
+        quorum_free(qr);
+        *qr = grid;
+        return "Grid";
+    }
+    quorum_free(&grid);
+    return q * q + q + 1 == ntot ? "Projective plane" : "Folded projective plane";
+}
+
+// Checks that every pair of quorums intersects. Returns 1 if they do.
+static int quorum_check(struct quorum *q) {
+    int *mark = (int *) calloc(q->ntot + 1, sizeof(int));
+    int i, j, k, ok = 1;
+
+    for (i = 1; i <= q->ntot && ok; i++) {
+        for (k = 0; k < q->size[i]; k++)
+            mark[q->set[i][k]] = i;
+        for (j = i + 1; j <= q->ntot && ok; j++) {
+            for (k = 0; k < q->size[j] && mark[q->set[j][k]] != i; k++) ;
+            if (k == q->size[j]) {
+                fprintf(stderr, "QUORUM: quorums of nodes %d and %d do not intersect\n", i, j);
+                ok = 0;
+            }
+        }
+    }
+    free(mark);
+    return ok;
+}
+
+// Picks a quorum for node nid that avoids the nodes marked in down[1..ntot]:
+// its own if every member is up, otherwise the next one (by node id) that is.
+// Every quorum intersects every other, so nodes that pick different ones
+// still exclude each other. Copies the quorum to out and returns its size,
+// or 0 if every quorum has a node that is down.
+static int quorum_pick(struct quorum *q, int nid, const int *down, int *out) {
+    int i, j, k;
+
+    for (k = 0; k < q->ntot; k++) {
+        i = (nid - 1 + k) % q->ntot + 1;
+        for (j = 0; j < q->size[i] && !down[q->set[i][j]]; j++) ;
+        if (j == q->size[i]) {
+            memcpy(out, q->set[i], sizeof(int) * q->size[i]);
+            return q->size[i];
+        }
+    }
+    return 0;
+}
+
+// Prints the quorum size K and the load (number of quorums each node is in).
+static void quorum_report(struct quorum *q, const char *name) {
+    int *load = (int *) calloc(q->ntot + 1, sizeof(int));
+    int i, k;
+    int kmin = q->ntot, kmax = 0, lmin = q->ntot, lmax = 0;
+
+    for (i = 1; i <= q->ntot; i++) {
+        if (q->size[i] < kmin) kmin = q->size[i];
+        if (q->size[i] > kmax) kmax = q->size[i];
+        for (k = 0; k < q->size[i]; k++)
+            load[q->set[i][k]]++;
+    }
+    for (i = 1; i <= q->ntot; i++) {
+        if (load[i] < lmin) lmin = load[i];
+        if (load[i] > lmax) lmax = load[i];
+    }
+    printf("QUORUM: %s quorums for %d nodes, K = %d..%d, load = %d..%d\n",
+           name, q->ntot, kmin, kmax, lmin, lmax);
+    fflush(stdout);
+    free(load);
+}
+
+#endif
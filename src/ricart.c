@@ -5,15 +5,30 @@
 /*           "An Optimal Algorithm for Mutual Exclusion in Computer Networks" */
 /*           Ricart & Agrawala, 1981                                          */
 /*                                                                            */
+/*            Built with -DCACHED_PERMISSIONS it uses Roucairol and           */
+/*            Carvalho's improvement: a REPLY is a permission that stays      */
+/*            with the requester until the other node asks for it back, so    */
+/*            a node only sends REQUESTs to the nodes whose permission it     */
+/*            gave away. Repeated entries without contention cost nothing.    */
+/*                                                                            */
+/*            Built against the v2 interface (see dme_v2.h). A node the       */
+/*            failure detector reports down is left out: its requests are     */
+/*            dropped and its REPLY is no longer waited for.                  */
+/*                                                                            */
+/*            A REPLY carries the clock of the REQUEST it answers, so a       */
+/*            withdrawn request (on_local_cancel) can leave its REPLYs        */
+/*            behind: they are ignored, even once a newer request is out.     */
+/*                                                                            */
 /******************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
-#include <sys/msg.h>
-#include <netinet/in.h>
 
-#include "dme.h"
+#include "dme_v2.h"
+#include "codec.h"
+#include "pool.h"
+#include "heap.h"
 
 typedef enum {REQUEST, REPLY} r_type; 
 
@@ -23,223 +38,348 @@ struct ric_msg {
 	int nid;
 };
 
+// Wire order of its fields, see codec.h.
+static const struct codec_field ric_schema[] = {
+    CODEC_FIELD(CODEC_TYPE, struct ric_msg, type),
+    CODEC_FIELD(CODEC_INT,  struct ric_msg, clk),
+    CODEC_FIELD(CODEC_UINT, struct ric_msg, nid),
+};
+
+// Requests wait in a heap ordered by (clk, nid), see heap.h.
 struct qent {
     struct ric_msg rmsg;
     int reply_count;     // Number of replies.
-    struct qent *next;
 };
 
-void *dme_msg_handler(void *arg) {
-    static int clock = 1;
-    int nid  = *((int *) arg);      // nid contains the node id.
-    int ntot = *(((int *) arg)+1);  // Total number of nodes. 
-	int msqid = msgget(M_ID, 0600); // msqid contains the message queue id.
-	MSG imsg;
-	struct ric_msg rmsg;
+// State of one instance.
+struct ric_ctx {
+    const struct dme_env *env;
+    int nid;
+    int ntot;
+    int clock;
 
     // Queue for requests.
-    struct qent *ric_front;
-    struct qent *temp1, *temp2;
+    struct heap ric_queue;
+    struct qent *local;  // The local request, while there is one.
 
-    int i;
+    // Queue entries come from a pool so the handler does not malloc per message.
+    struct pool qent_pool;
 
-	if (msqid == -1) {
-		perror("msgget failed :\n");
-		exit(1);
-	}
+    // requested[j] is set while a REQUEST to node j is waiting for its REPLY.
+    // down[j] is set while node j is reported down.
+    int *requested;
+    int *down;
+#ifdef CACHED_PERMISSIONS
+    // granted[j] is set while this node holds node j's permission.
+    int *granted;
+#endif
+};
 
-    printf("Ricart algorithm started with %d nodes\n", ntot); // prints are for logging information
+static void send_msg(struct ric_ctx *r, struct ric_msg rmsg, int to) {
+    unsigned char wire[CODEC_FIELD_MAX * CODEC_FIELDS(ric_schema)];
+
+    r->env->send(r->env->arg, to, wire, codec_encode(ric_schema, CODEC_FIELDS(ric_schema), &rmsg, wire, sizeof(wire)));
+}
+
+#ifdef CACHED_PERMISSIONS
+static void send_request(struct ric_ctx *r, struct ric_msg rmsg, int to) {
+    rmsg.type = REQUEST;
+    printf("RICART: REQUEST sent to %d\n", to);
     fflush(stdout);
-    
-	for (;;) {
-        for( i = 0, temp1 = ric_front; temp1 != NULL; temp1 = temp1->next, i++) ;
-        printf("RICART: %d entries in queue.\n", i);
+    send_msg(r, rmsg, to);
+    r->requested[to] = 1;
+}
+#endif
+
+// The local request has every REPLY it needs: set priority to zero (To ensure
+// no REPLYs will be sent from this node until critical section is complete),
+// then let the client run the critical section.
+static void enter(struct ric_ctx *r) {
+    r->local->rmsg.clk = 0; // Now no requests will supercede this.
+    heap_rekey_top(&r->ric_queue, 0, r->nid);
+    r->env->grant(r->env->arg);
+}
+
+// Look at top of queue. Send REPLYs while queue is not empty or top
+// is local request. 
+static void reply_queued(struct ric_ctx *r) {
+    struct heap_ent *top;
+    struct qent *temp1;
+    struct ric_msg rmsg;
+    int to;
+
+    while ((top = heap_top(&r->ric_queue)) != NULL && top->nid != r->nid) {
+        temp1 = (struct qent *) heap_pop(&r->ric_queue);
+
+        to = temp1->rmsg.nid;
+        rmsg.nid  = r->nid;
+        rmsg.clk  = temp1->rmsg.clk; // The request it answers.
+        rmsg.type = REPLY;
+        r->clock++;  // The next local request comes after the one answered.
+
+        printf("RICART: REPLY SENT\n");
         fflush(stdout);
+        send_msg(r, rmsg, to);
+#ifdef CACHED_PERMISSIONS
+        // The permission went with the REPLY. If the local request is
+        // still waiting, it has to ask for it back.
+        r->granted[to] = 0;
+        if (r->local != NULL && !r->requested[to]) {
+            send_request(r, r->local->rmsg, to);
+            r->local->reply_count++;
+        }
+#endif
+        // Remove entry from memory.
+        pool_free(&r->qent_pool, temp1);
+    }
+}
+
+// Add a request to the queue.
+static struct qent *enqueue(struct ric_ctx *r, struct ric_msg rmsg) {
+    struct qent *temp1;
+
+    temp1 = (struct qent *) pool_alloc(&r->qent_pool);
+    temp1->rmsg        = rmsg;
+    temp1->reply_count = r->ntot-1;
+    heap_push(&r->ric_queue, rmsg.clk, rmsg.nid, temp1);
+    return temp1;
+}
+
+static void ric_init(void *ctx, const struct dme_env *env, int nid, int ntot) {
+    struct ric_ctx *r = (struct ric_ctx *) ctx;
+
+    r->env   = env;
+    r->nid   = nid;
+    r->ntot  = ntot;
+    r->clock = 1;
+    r->local = NULL;
+
+    r->requested = (int *) calloc(ntot + 1, sizeof(int));
+    r->down      = (int *) calloc(ntot + 1, sizeof(int));
+    if (r->requested == NULL || r->down == NULL) {
+        perror("calloc failed :\n");
+        exit(1);
+    }
+#ifdef CACHED_PERMISSIONS
+    // No node holds any permission at first, so the first entry asks everyone.
+    r->granted = (int *) calloc(ntot + 1, sizeof(int));
+    if (r->granted == NULL) {
+        perror("calloc failed :\n");
+        exit(1);
+    }
+#endif
+
+    pool_init(&r->qent_pool, "qent", sizeof(struct qent), POOL_SLAB);
+    heap_init(&r->ric_queue, HEAP_INIT);
+
+    printf("Ricart algorithm started with %d nodes\n", ntot); // prints are for logging information
+    fflush(stdout);
+}
+
+static void ric_message(void *ctx, int from, const void *buf, unsigned int len) {
+    struct ric_ctx *r = (struct ric_ctx *) ctx;
+    struct ric_msg rmsg;
 
-		if (msgrcv(msqid, &imsg, sizeof(MSG), TO_DME, 0) == -1) {
-			perror("msgrcv failed :\n");
-			exit(1);
-		}
-		
-        printf("RICART: Message queue message received!\n");
+    if (codec_decode(ric_schema, CODEC_FIELDS(ric_schema), &rmsg, buf, len) != 0) {
+        printf("RICART: malformed message of %u bytes from %d, ignored\n", len, from);
         fflush(stdout);
+        return;
+    }
+    printf("RICART: %d entries in queue.\n", heap_size(&r->ric_queue));
+    fflush(stdout);
+
+    // Update clock
+    if (rmsg.clk > r->clock) {
+        r->clock = rmsg.clk;
+    }
     
-		memcpy(&rmsg, &imsg.buf, sizeof(struct ric_msg));
-        
-        // Update clock
-        if (rmsg.clk > clock) {
-            clock = rmsg.clk;
-        }
-        
-        if (rmsg.type == REQUEST) {
-        // REQUEST received, add to the queue, then look at top at queue. If the
-        // top is a request for another node, immediatley send a reply.
-        // Repeat until request that belongs to this node is found, or the queue is empty. 
-            // Check if local request, update nid and clock.
-            if (rmsg.nid == 0) {
-                rmsg.nid = nid;
-                rmsg.clk = clock++;
-            }
-
-            
-            // Add to queue
-            if (ric_front == NULL || ric_front->rmsg.clk > rmsg.clk ||
-            (ric_front->rmsg.clk == rmsg.clk && ric_front->rmsg.nid > rmsg.nid)) {
-                // Queue empty, or bettwe than first entry -> add to the front
-                temp1 = (struct qent *) malloc(sizeof(struct qent));
-                temp1->rmsg        = rmsg; 
-                temp1->reply_count = ntot-1;
-                temp1->next        = ric_front;
-                ric_front = temp1;
-            }
-            else {
-                // Queue is not empty or not better than front, find appropriate spot to place this item. 
-                for (temp1 = ric_front; (temp1->next != NULL &&
-                (temp1->next->rmsg.clk < rmsg.clk || (temp1->next->rmsg.clk ==
-                rmsg.clk && temp1->next->rmsg.nid < rmsg.nid))); temp1=temp1->next) ;
-                
-                temp2 = (struct qent *) malloc(sizeof(struct qent));
-                temp2->rmsg = rmsg;
-                temp2->reply_count = ntot-1;
-                temp2->next = temp1->next;
-                temp1->next = temp2;
-            }
-            
-            // If local request, broadcast to other nodes.
-            if (rmsg.nid == nid) {
-                memcpy(&imsg.buf, &rmsg, sizeof(struct ric_msg));
-                imsg.size = sizeof(struct ric_msg);
-                imsg.type = TO_SND;
-                imsg.network = 0; // Broadcast. 
-
-                if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-                    perror("Error on message send\n");
-                    exit(1);
-                }	
-            }
+    if (rmsg.type == REQUEST && r->down[rmsg.nid]) {
+        // Sent before the node went down, nobody will take the REPLY.
+        printf("RICART: REQUEST from %d, which is down, ignored\n", rmsg.nid);
+        fflush(stdout);
+    }
+    else if (rmsg.type == REQUEST) {
+    // REQUEST received, add to the queue, then look at top at queue. If the
+    // top is a request for another node, immediatley send a reply.
+    // Repeat until request that belongs to this node is found, or the queue is empty. 
+        enqueue(r, rmsg);
+    }
+    else if (!r->requested[rmsg.nid]) {
+        // The node was reported down after it sent this, and is not waited for.
+        printf("RICART: REPLY from %d was not waited for, ignored\n", rmsg.nid);
+        fflush(stdout);
+    }
+    else if (r->local != NULL && rmsg.clk != r->local->rmsg.clk) {
+        // Answers a withdrawn request, this one still needs its own.
+        printf("RICART: REPLY from %d for a withdrawn request, ignored\n", rmsg.nid);
+        fflush(stdout);
+    }
+    else {
+    // REPLY received, the local request must be on top, decrement number of replies
+    // needed, if it is zero the critical section can start.
+        if (r->local == NULL || heap_top(&r->ric_queue)->item != r->local) {
+            // The top of the queue must be the local request because we
+            // assume only one client per node and all remote requests are
+            // immediatly REPLYed to unless in critical section. 
+            printf("ERROR: Invalid message sent\n");
+            exit(1);
         }
-        else {
-        // REPLY received, find request in queue (on top), decrement number of replies
-        // needed, if it is zero, set priority to zero (To ensure no REPLYs will
-        // be sent from this node until critical section is complete), then send
-        // message to client to start running the critical section.
-        // If the number of replies needed is negative one (meaning this client
-        // sent a REPLY), the client has completed executing its critical
-        // section, and the queue can now be cleared of external requests. 
-            temp1 = ric_front;
-            
-            if (temp1->rmsg.nid != nid) {
-                // The top of the queue must be the local request because we
-                // assume only one client per node and all remote requests are
-                // immediatly REPLYed to unless in critical section. 
-                printf("ERROR: Invalid message sent\n");
-                exit(1);
-            }
-
-            temp1->reply_count--;
-            if (temp1->reply_count == 0) {
-                // Node ready to allow client to run critical section.
-                // Block other requests and notify client.
-                temp1->rmsg.clk = 0; // Now no requests will supercede this.
-                // NOTE: doesn't matter what is in imsg, dme_down just needs a
-                // message to unblock.
-                imsg.type = TO_CON;
-                if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-                    perror("Error on message send\n");
-                    exit(1);
-                }	
-            }
-            if (temp1->reply_count == -1) {
-                // The client has finished the critical section, remove entry
-                // and reply to remote requests.
-                printf("RICART: Can send REPLY's again\n");
-                fflush(stdout);
-                ric_front = ric_front->next;
-                free(temp1);
-            }
 
+        r->requested[rmsg.nid] = 0;
+#ifdef CACHED_PERMISSIONS
+        // A REPLY from another node hands over its permission.
+        r->granted[rmsg.nid] = 1;
+#endif
+        if (--r->local->reply_count == 0) {
+            // Node ready to allow client to run critical section.
+            enter(r);
         }
-            
-        // Look at top of queue. Send REPLYs while queue is not empty or top
-        // is local request. 
-        while (ric_front != NULL && ric_front->rmsg.nid != nid) {
-            temp1 = ric_front;
-            ric_front = ric_front->next;
-            
-            imsg.type = TO_SND;
-            imsg.network = temp1->rmsg.nid;
-            temp1->rmsg.nid = nid;
-            temp1->rmsg.clk = clock++;
-            temp1->rmsg.type = REPLY;
-            memcpy(&imsg.buf, &(temp1->rmsg), sizeof(struct ric_msg));
-            imsg.size = sizeof(struct ric_msg);
-
-            printf("RICART: REPLY SENT\n");
-            fflush(stdout);
-            
-            if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-                perror("Error on message send\n");
-                exit(1);
-            }
-            // Remove entry from memory.
-            free(temp1);
-        }
-	}
+    }
+    reply_queued(r);
 }
 
-void dme_down() { 
-	int msqid = msgget(M_ID, 0600);
-	MSG imsg;
-	struct ric_msg rmsg;
+static void ric_acquire(void *ctx) {
+    struct ric_ctx *r = (struct ric_ctx *) ctx;
+    struct ric_msg rmsg;
+    int i;
 
-	if (msqid == -1) {
-		perror("msgget failed :\n");
-		exit(1);
-	}
-    
     rmsg.type = REQUEST;
-    rmsg.clk = 0; // Handler will fill in the clock value
-    rmsg.nid = 0; // nid of 0 implies local node.
+    rmsg.nid  = r->nid;
+    rmsg.clk  = r->clock++;
+    // Remote requests never stay queued ahead of it, so it is the top.
+    r->local = enqueue(r, rmsg);
+
+#ifdef CACHED_PERMISSIONS
+    // Ask only the nodes whose permission is not held.
+    r->local->reply_count = 0;
+    for (i = 1; i <= r->ntot; i++) {
+        if (i == r->nid || r->granted[i] || r->down[i])
+            continue;
+        send_request(r, rmsg, i);
+        r->local->reply_count++;
+    }
+    if (r->local->reply_count == 0) {
+        // Every permission is still held, enter right away.
+        printf("RICART: all permissions held, no messages needed\n");
+        fflush(stdout);
+        enter(r);
+    }
+#else
+    // Broadcast to other nodes, only the ones that are up will REPLY.
+    send_msg(r, rmsg, 0);
+    for (i = 1; i <= r->ntot; i++) {
+        if (i != r->nid && r->down[i])
+            r->local->reply_count--;
+        r->requested[i] = i != r->nid && !r->down[i];
+    }
+    if (r->local->reply_count == 0)
+        enter(r);
+#endif
+}
 
-	memcpy(&imsg.buf, &rmsg, sizeof(struct ric_msg));
+static void ric_release(void *ctx) {
+    struct ric_ctx *r = (struct ric_ctx *) ctx;
 
-    // Place REQUEST in message queue, block until ready.
-    imsg.size = sizeof(struct ric_msg);
-	imsg.type = TO_DME;
-	if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-		perror("Error on message send\n");
-		exit(1);
-	}	
+    // The client has finished the critical section, remove entry
+    // and reply to remote requests.
+    printf("RICART: Can send REPLY's again\n");
+    fflush(stdout);
+    heap_pop(&r->ric_queue);
+    pool_free(&r->qent_pool, r->local);
+    r->local = NULL;
+    reply_queued(r);
+}
 
+// The local request is withdrawn before it entered: the requests it held
+// back get their REPLY, and the REPLYs it is still owed are no longer waited
+// for. They are told from those to the next request by their clock. With
+// cached permissions the permission such a REPLY carries is dropped: the
+// other node may have been answered meanwhile, and neither holding it is safe.
+static void ric_cancel(void *ctx) {
+    struct ric_ctx *r = (struct ric_ctx *) ctx;
+    int i;
 
-    // Wait to hear back from handler to start critical section. 
-	if (msgrcv(msqid, &imsg, sizeof(MSG), TO_CON, 0) == -1) {
-		perror("Error on message receive\n");
-		exit(1);
-	}	
+    printf("RICART: request withdrawn\n");
+    fflush(stdout);
+    for (i = heap_size(&r->ric_queue) - 1; i >= 0; i--)
+        if (r->ric_queue.v[i].item == r->local)
+            heap_remove(&r->ric_queue, i);
+    pool_free(&r->qent_pool, r->local);
+    r->local = NULL;
+    for (i = 1; i <= r->ntot; i++)
+        r->requested[i] = 0;
+    reply_queued(r);
 }
 
-void dme_up() {
-    // Tell handler critical section is complete
-    // This will allow it to send replies. 
-	int msqid = msgget(M_ID, 0600);
-	MSG imsg;
-	struct ric_msg rmsg;
-
-	if (msqid == -1) {
-		perror("msgget failed :\n");
-		exit(1);
-	}
-    
-    rmsg.type = REPLY;
+static void ric_fini(void *ctx) {
+    struct ric_ctx *r = (struct ric_ctx *) ctx;
+
+    free(r->ric_queue.v);
+    pool_report(&r->qent_pool);
+    pool_destroy(&r->qent_pool);
+    free(r->requested);
+    free(r->down);
+#ifdef CACHED_PERMISSIONS
+    free(r->granted);
+#endif
+}
 
-	memcpy(&imsg.buf, &rmsg, sizeof(struct ric_msg));
+// Node nid crashed: forget its requests and stop waiting for its REPLY.
+static void ric_peer_down(void *ctx, int nid) {
+    struct ric_ctx *r = (struct ric_ctx *) ctx;
+    int i;
+
+    printf("RICART: node %d is down\n", nid);
+    fflush(stdout);
+    r->down[nid] = 1;
+    for (i = heap_size(&r->ric_queue) - 1; i >= 0; i--)
+        if (r->ric_queue.v[i].nid == nid)
+            pool_free(&r->qent_pool, heap_remove(&r->ric_queue, i));
+#ifdef CACHED_PERMISSIONS
+    // Never ask it again while it is down.
+    r->granted[nid] = 1;
+#endif
+    if (r->local != NULL && r->requested[nid]) {
+        r->requested[nid] = 0;
+        if (--r->local->reply_count == 0)
+            enter(r);
+    }
+}
 
-    // Place REQUEST in message queue, block until ready.
-    imsg.size = sizeof(struct ric_msg);
-	imsg.type = TO_DME;
-	if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
-		perror("Error on message send\n");
-		exit(1);
-	}	
+// Node nid is back: a waiting local request needs its REPLY as well.
+static void ric_peer_up(void *ctx, int nid) {
+    struct ric_ctx *r = (struct ric_ctx *) ctx;
+
+    printf("RICART: node %d is up\n", nid);
+    fflush(stdout);
+    r->down[nid] = 0;
+#ifdef CACHED_PERMISSIONS
+    // Whatever it held before, it starts over without our permission and we without its.
+    r->granted[nid] = 0;
+#endif
+    // A local request that already entered (clk 0) will REPLY at release.
+    if (r->local != NULL && r->local->rmsg.clk != 0 && !r->requested[nid]) {
+        r->local->rmsg.type = REQUEST;
+        send_msg(r, r->local->rmsg, nid);
+        r->requested[nid] = 1;
+        r->local->reply_count++;
+    }
 }
+
+const struct dme_ops dme_ops = {
+    DME_ABI_V2,
+#ifdef CACHED_PERMISSIONS
+    "ricart_rc",
+#else
+    "ricart",
+#endif
+    sizeof(struct ric_ctx),
+    ric_init,
+    ric_message,
+    ric_acquire,
+    ric_release,
+    ric_fini,
+    ric_peer_down,
+    ric_peer_up,
+    ric_cancel,
+};
@@ -0,0 +1,394 @@
+/******************************************************************************/
+/*                                                                            */
+/* sim.c - Runs every node of a v2 algorithm library (see dme_v2.h) in one    */
+/*         process. Messages are delivered in simulated time, with a random   */
+/*         delay per message that keeps every link FIFO, and each node        */
+/*         enters the critical section a given number of times. The run      */
+/*         fails if two nodes are ever in the critical section together, or  */
+/*         if the nodes stop making progress.                                 */
+/*                                                                            */
+/*         Usage: sim number_of_nodes dme_library [entries_per_node] [seed]   */
+/*         The libraries' own logging is dropped unless DME_SIM_VERBOSE is    */
+/*         set.                                                               */
+/*                                                                            */
+/*         DME_SIM_KILL=node@time crashes a node at that time. DME_SIM_DETECT */
+/*         ticks later (default DETECT_TIME) the others hear it is down, and  */
+/*         the report says how long the survivors took to enter the critical */
+/*         section again.                                                     */
+/*                                                                            */
+/*         DME_SIM_TIMEOUT=ticks withdraws an acquire that has not been       */
+/*         granted after that long (on_local_cancel), and asks again later.   */
+/*         A library without the hook has its grant released on arrival, as  */
+/*         the node controller does.                                          */
+/*                                                                            */
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dme_v2.h"
+#include "heap.h"
+
+// Simulated time: link delay, time spent in the critical section, and the
+// longest pause between leaving the critical section and asking again.
+#define LINK_MIN   1
+#define LINK_JITTER 10
+#define CS_TIME    5
+#define THINK_MAX  50
+
+// Default failure detection delay. It outlasts a critical section plus a
+// message, which is what a real detector's timeout has to be set to.
+#define DETECT_TIME 50
+
+// Kinds of events.
+typedef enum { EV_MSG,        // Message delivery.
+               EV_ACQUIRE,    // Node asks for the critical section.
+               EV_ENTER,      // Node was granted the critical section.
+               EV_LEAVE,
+               EV_KILL,       // Node crashes.
+               EV_DOWN,       // Node is told the other one is down.
+               EV_TIMEOUT     } ev_type;  // Node gives up on an acquire.
+
+struct event {
+    ev_type kind;
+    int from, to;
+    unsigned int len;
+    char data[];
+};
+
+// Node states. A node is GRANTED from the grant until it enters, and
+// ABANDONED while a withdrawn acquire waits for its grant (no on_local_cancel).
+typedef enum { IDLE, WAITING, IN_CS, GRANTED, ABANDONED } n_state;
+
+struct sim_node {
+    int nid;
+    void *ctx;
+    struct dme_env env;
+    n_state state;
+    int left;         // Critical sections still to run.
+    long asked;       // When the pending acquire was made.
+    int tries;        // Acquires made, so a timeout can tell which one it is for.
+    int dead;
+};
+
+const struct dme_ops *ops;
+struct sim_node *nodes;
+int ntot;
+
+// Events ordered by (time, sequence number), so ties keep the order they were made in.
+struct heap events;
+long now;
+int seq;
+long **link_last;     // Last delivery time on each link, keeps links FIFO.
+unsigned short xsub[3];
+
+// Totals for the report.
+long messages, bytes, entries, wait_total, wait_max, timeouts;
+int in_cs;
+int verbose;
+
+// Crash test: who is killed and when, and what happened afterwards.
+int kill_node;
+// free_since is when the critical section last became free, free_max the
+// longest it stayed free with someone waiting after the kill.
+long kill_at = -1, detect = DETECT_TIME, told_at = -1, next_entry = -1;
+long free_since, free_max;
+
+// Ticks an acquire may wait before it is withdrawn, or 0.
+long timeout;
+
+static void schedule(long at, struct event *ev) {
+    // The heap keys are ints, which is plenty for a run.
+    heap_push(&events, (int) at, seq++, ev);
+}
+
+static struct event *event_new(ev_type kind, int from, int to, const void *buf, unsigned int len) {
+    struct event *ev = (struct event *) malloc(sizeof(struct event) + len);
+
+    if (ev == NULL) {
+        perror("malloc failed :\n");
+        exit(1);
+    }
+    ev->kind = kind;
+    ev->from = from;
+    ev->to   = to;
+    ev->len  = len;
+    if (len > 0)
+        memcpy(ev->data, buf, len);
+    return ev;
+}
+
+static void deliver_later(int from, int to, const void *buf, unsigned int len) {
+    long at = now + LINK_MIN + nrand48(xsub) % LINK_JITTER;
+
+    if (at < link_last[from][to])
+        at = link_last[from][to];
+    link_last[from][to] = at;
+    schedule(at, event_new(EV_MSG, from, to, buf, len));
+    messages++;
+    bytes += len;
+}
+
+static void sim_send(void *arg, int to, const void *buf, unsigned int len) {
+    struct sim_node *n = (struct sim_node *) arg;
+    int i;
+
+    if (to < 0 || to > ntot) {
+        fprintf(stderr, "SIM: node %d sent to unknown node %d\n", n->nid, to);
+        exit(1);
+    }
+    if (to != 0) {
+        deliver_later(n->nid, to, buf, len);
+        return;
+    }
+    for (i = 1; i <= ntot; i++)
+        if (i != n->nid)
+            deliver_later(n->nid, i, buf, len);
+}
+
+static void sim_grant(void *arg) {
+    struct sim_node *n = (struct sim_node *) arg;
+
+    if (n->state != WAITING && n->state != ABANDONED) {
+        fprintf(stderr, "SIM: node %d granted without asking at time %ld\n", n->nid, now);
+        exit(1);
+    }
+    // Entered (or given back) from the event loop, since the instance is still
+    // running. A timeout can no longer withdraw it.
+    if (n->state == WAITING)
+        n->state = GRANTED;
+    schedule(now, event_new(EV_ENTER, n->nid, n->nid, NULL, 0));
+}
+
+int main(int argc, char *argv[]) {
+    void *handle;
+    struct sim_node *n;
+    struct event *ev;
+    int i, per_node = 10, seed = 1, out;
+    FILE *report = stdout;
+    char *env;
+    const char *state[] = { "idle", "waiting", "in the critical section", "granted", "waiting to give back a grant" };
+    n_state killed_in = IDLE;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s number_of_nodes dme_library [entries_per_node] [seed]\n", argv[0]);
+        exit(1);
+    }
+    ntot = atoi(argv[1]);
+    if (argc > 3)
+        per_node = atoi(argv[3]);
+    if (argc > 4)
+        seed = atoi(argv[4]);
+    if (ntot < 1 || per_node < 0) {
+        fprintf(stderr, "SIM: bad arguments\n");
+        exit(1);
+    }
+    xsub[0] = (unsigned short) seed;
+    xsub[1] = (unsigned short) (seed >> 16);
+    xsub[2] = 0x330E;
+
+    handle = dlopen(argv[2], RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+    ops = (const struct dme_ops *) dlsym(handle, DME_OPS_SYMBOL);
+    if (ops == NULL || ops->version != DME_ABI_V2) {
+        fprintf(stderr, "SIM: %s is not a v2 library\n", argv[2]);
+        exit(1);
+    }
+
+    // Library logs go nowhere unless asked for, the report goes to the real stdout.
+    verbose = getenv("DME_SIM_VERBOSE") != NULL;
+    if (!verbose) {
+        if ((out = dup(1)) == -1 || (report = fdopen(out, "w")) == NULL) {
+            perror("dup failed :\n");
+            exit(1);
+        }
+        if (freopen("/dev/null", "w", stdout) == NULL) {
+            perror("freopen failed :\n");
+            exit(1);
+        }
+    }
+
+    if ((env = getenv("DME_SIM_KILL")) != NULL) {
+        if (sscanf(env, "%d@%ld", &kill_node, &kill_at) != 2 || kill_node < 1 || kill_node > ntot || kill_at < 0) {
+            fprintf(stderr, "SIM: DME_SIM_KILL must be node@time\n");
+            exit(1);
+        }
+        if ((env = getenv("DME_SIM_DETECT")) != NULL)
+            detect = atol(env);
+    }
+    if ((env = getenv("DME_SIM_TIMEOUT")) != NULL && (timeout = atol(env)) < 0) {
+        fprintf(stderr, "SIM: DME_SIM_TIMEOUT must be at least 0\n");
+        exit(1);
+    }
+
+    heap_init(&events, HEAP_INIT);
+    nodes     = (struct sim_node *) calloc(ntot + 1, sizeof(struct sim_node));
+    link_last = (long **) malloc(sizeof(long *) * (ntot + 1));
+    if (nodes == NULL || link_last == NULL) {
+        perror("malloc failed :\n");
+        exit(1);
+    }
+    for (i = 0; i <= ntot; i++)
+        if ((link_last[i] = (long *) calloc(ntot + 1, sizeof(long))) == NULL) {
+            perror("calloc failed :\n");
+            exit(1);
+        }
+
+    for (i = 1; i <= ntot; i++) {
+        n = &nodes[i];
+        n->nid       = i;
+        n->state     = IDLE;
+        n->left      = per_node;
+        n->env.arg   = n;
+        n->env.send  = sim_send;
+        n->env.grant = sim_grant;
+        if ((n->ctx = calloc(1, ops->ctx_size)) == NULL) {
+            perror("calloc failed :\n");
+            exit(1);
+        }
+        ops->init(n->ctx, &n->env, i, ntot);
+        if (n->left > 0)
+            schedule(nrand48(xsub) % THINK_MAX, event_new(EV_ACQUIRE, i, i, NULL, 0));
+    }
+    if (kill_at >= 0)
+        schedule(kill_at, event_new(EV_KILL, kill_node, kill_node, NULL, 0));
+
+    while (heap_size(&events) > 0) {
+        now = heap_top(&events)->clk;
+        ev  = (struct event *) heap_pop(&events);
+        n   = &nodes[ev->to];
+        if (verbose) {
+            printf("SIM: time %ld, event %d, node %d from %d\n", now, ev->kind, ev->to, ev->from);
+            fflush(stdout);
+        }
+        if (n->dead) {
+            // Whatever reaches a crashed node is lost.
+            free(ev);
+            continue;
+        }
+
+        switch (ev->kind) {
+        case EV_MSG:
+            ops->on_message(n->ctx, ev->from, ev->data, ev->len);
+            break;
+        case EV_ACQUIRE:
+            n->asked = now;
+            if (timeout > 0)
+                schedule(now + timeout, event_new(EV_TIMEOUT, n->nid, n->nid, &n->tries, sizeof(int)));
+            n->tries++;
+            if (n->state == ABANDONED) {
+                // The withdrawn acquire is still out, it will do.
+                n->state = WAITING;
+                break;
+            }
+            n->state = WAITING;
+            ops->on_local_acquire(n->ctx);
+            break;
+        case EV_TIMEOUT:
+            if (n->state != WAITING || *(int *) ev->data != n->tries - 1)
+                break;
+            timeouts++;
+            if (ops->on_local_cancel != NULL) {
+                n->state = IDLE;
+                ops->on_local_cancel(n->ctx);
+            }
+            else
+                n->state = ABANDONED;
+            schedule(now + 1 + nrand48(xsub) % THINK_MAX, event_new(EV_ACQUIRE, n->nid, n->nid, NULL, 0));
+            break;
+        case EV_ENTER:
+            if (n->state == ABANDONED) {
+                n->state = IDLE;
+                ops->on_local_release(n->ctx);
+                break;
+            }
+            if (in_cs != 0) {
+                fprintf(report, "SIM: %s: node %d entered the critical section while it was held, time %ld\n",
+                        ops->name, n->nid, now);
+                exit(2);
+            }
+            in_cs++;
+            n->state = IN_CS;
+            entries++;
+            if (kill_at >= 0 && now >= kill_at) {
+                if (next_entry < 0)
+                    next_entry = now;
+                // Free while this node was waiting.
+                if (now - (n->asked > free_since ? n->asked : free_since) > free_max)
+                    free_max = now - (n->asked > free_since ? n->asked : free_since);
+            }
+            wait_total += now - n->asked;
+            if (now - n->asked > wait_max)
+                wait_max = now - n->asked;
+            schedule(now + CS_TIME, event_new(EV_LEAVE, n->nid, n->nid, NULL, 0));
+            break;
+        case EV_LEAVE:
+            in_cs--;
+            free_since = now;
+            n->state = IDLE;
+            ops->on_local_release(n->ctx);
+            if (--n->left > 0)
+                schedule(now + 1 + nrand48(xsub) % THINK_MAX, event_new(EV_ACQUIRE, n->nid, n->nid, NULL, 0));
+            break;
+        case EV_KILL:
+            // A node that dies in the critical section takes no lock with it here.
+            n->dead   = 1;
+            killed_in = n->state;
+            if (n->state == IN_CS)
+                in_cs--;
+            if (in_cs == 0 && free_since < now)
+                free_since = now;
+            // The others find out one by one.
+            for (i = 1; i <= ntot; i++)
+                if (i != n->nid)
+                    schedule(now + detect + nrand48(xsub) % LINK_JITTER, event_new(EV_DOWN, n->nid, i, NULL, 0));
+            break;
+        case EV_DOWN:
+            if (told_at < 0)
+                told_at = now;
+            if (ops->on_peer_down != NULL)
+                ops->on_peer_down(n->ctx, ev->from);
+            break;
+        }
+        free(ev);
+    }
+
+    fprintf(report, "SIM: %s, %d nodes, %ld critical sections, %ld messages (%.2f per entry), %ld bytes, "
+            "time %ld, wait mean %.2f max %ld\n",
+            ops->name, ntot, entries, messages, entries ? (double) messages / entries : 0.0, bytes,
+            now, entries ? (double) wait_total / entries : 0.0, wait_max);
+    if (timeout > 0)
+        fprintf(report, "SIM: %s, %ld acquires withdrawn after %ld ticks\n", ops->name, timeouts, timeout);
+    if (kill_at >= 0) {
+        fprintf(report, "SIM: %s, node %d killed at %ld while %s, others told from %ld, ",
+                ops->name, kill_node, kill_at, state[killed_in], told_at);
+        if (next_entry >= 0)
+            fprintf(report, "next entry at %ld: recovery %ld, free for at most %ld afterwards\n",
+                    next_entry, next_entry - kill_at, free_max);
+        else
+            fprintf(report, "no entry after it\n");
+    }
+
+    // Every node that is still up should have finished.
+    for (i = 1; i <= ntot; i++)
+        if (nodes[i].left > 0 && !nodes[i].dead) {
+            fprintf(report, "SIM: %s stalled, node %d has %d entries left (state %d)\n",
+                    ops->name, i, nodes[i].left, nodes[i].state);
+            exit(3);
+        }
+
+    for (i = 1; i <= ntot; i++) {
+        if (ops->fini != NULL)
+            ops->fini(nodes[i].ctx);
+        free(nodes[i].ctx);
+    }
+    fclose(report);
+    dlclose(handle);
+
+    return 0;
+}
@@ -17,7 +17,7 @@ struct simple_msg {
 void *dme_msg_handler(void *arg) {
     int nid = *((int *) arg);
     int ntot = *(((int *) arg)+1);
-	int msqid = msgget(M_ID, 0600);
+	int msqid = msgget(dme_queue_key(), 0600);
 	MSG imsg;
 	struct simple_msg smsg;
 
@@ -38,7 +38,8 @@ void *dme_msg_handler(void *arg) {
         printf("Simple: Message queue message received!\n");
         fflush(stdout);
     
-		memcpy(&smsg, &imsg.buf, sizeof(struct simple_msg));
+		memcpy(&smsg, msg_payload(&imsg), sizeof(struct simple_msg));
+		msg_release(&imsg);
 		// Check if from receiver or consumer
 		if (imsg.network) {
 			// Message was from another node. Convert to hardware byte order and print.
@@ -53,15 +54,16 @@ void *dme_msg_handler(void *arg) {
 			smsg.n = nid;
 
 			memcpy(&imsg.buf, &smsg, sizeof(struct simple_msg));
+			imsg.ref = NULL;
 			imsg.size = sizeof(struct simple_msg);
 			imsg.type = TO_SND;
     
-            if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
+            if (msgsnd(msqid, &imsg, msg_size(&imsg), 0) == -1) {
 				perror("Error on message send\n");
 				exit(1);
 			}	
 			imsg.type = TO_CON;
-			if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
+			if (msgsnd(msqid, &imsg, msg_size(&imsg), 0) == -1) {
 				perror("Error on message send\n");
 				exit(1);
 			}	
@@ -71,7 +73,7 @@ void *dme_msg_handler(void *arg) {
 
 void dme_down() { 
 	static int r = 0;
-	int msqid = msgget(M_ID, 0600);
+	int msqid = msgget(dme_queue_key(), 0600);
 	MSG imsg;
 	struct simple_msg smsg;
 
@@ -85,12 +87,13 @@ void dme_down() {
 	
 
 	memcpy(&imsg.buf, &smsg, sizeof(struct simple_msg));
+	imsg.ref = NULL;
     
     imsg.size = sizeof(struct simple_msg);
 	imsg.type = TO_DME;
 	imsg.network = 0;
 
-	if (msgsnd(msqid, &imsg, sizeof(MSG), 0) == -1) {
+	if (msgsnd(msqid, &imsg, msg_size(&imsg), 0) == -1) {
 		perror("Error on message send\n");
 		exit(1);
 	}	